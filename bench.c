@@ -0,0 +1,298 @@
+/* Idle connection footprint: parks a readiness read on each of N local
+ * socket pairs and reports what iomp adds per connection, in user memory
+ * (resident set) and in kernel slab (epoll registrations).
+ * Ping-pong: bounces a small message over N pairs and reports round trips
+ * per second, over loopback pipes when the library was built with
+ * IOMP_LOOPBACK=1, so only dispatch is measured, else over socket pairs.
+ * usage: bench [connections] [threads]
+ *        bench pingpong [pairs] [threads] [round trips per pair] */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include "iomp.h"
+
+static volatile long woken = 0;
+static volatile long failed = 0;
+static volatile long synced = 0;
+
+static void on_ready(iomp_aio_t aio, int error) {
+    __atomic_add_fetch(error == 0 ? &woken : &failed, 1, __ATOMIC_RELAXED);
+}
+
+static void on_sync(void* arg, int error) {
+    __atomic_add_fetch(&synced, 1, __ATOMIC_RELAXED);
+}
+
+#define PINGPONG_MSG 64
+
+/* one end of a ping-pong pair, reading and writing in turn */
+struct peer {
+    struct iomp_aio aio;
+    iomp_t iomp;
+    long left;
+    int client;
+    int writing;
+    char buf[PINGPONG_MSG];
+};
+
+static volatile long finished = 0;
+
+static void on_pingpong(iomp_aio_t aio, int error) {
+    struct peer* p = (struct peer*)((char*)aio - offsetof(struct peer, aio));
+    if (error != 0) {
+        /* servers see their read cancelled at the end */
+        if (p->client) {
+            __atomic_add_fetch(&failed, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&finished, 1, __ATOMIC_RELAXED);
+        }
+        return;
+    }
+    if (p->writing) {
+        p->writing = 0;
+        iomp_read(p->iomp, aio);
+    } else if (p->client && --p->left == 0) {
+        __atomic_add_fetch(&finished, 1, __ATOMIC_RELAXED);
+    } else {
+        p->writing = 1;
+        iomp_write(p->iomp, aio);
+    }
+}
+
+static double now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int pingpong(long n, int nthreads, long count) {
+    int loopback = 1;
+    int fds[2];
+    if (iomp_loopback_pair(fds, PINGPONG_MSG) == ENOSYS) {
+        loopback = 0;
+    } else {
+        iomp_loopback_close(fds[0]);
+        iomp_loopback_close(fds[1]);
+    }
+    iomp_t iomp = iomp_new(nthreads);
+    int* pairs = (int*)malloc(sizeof(int) * 2 * n);
+    struct peer* peers = (struct peer*)calloc(2 * n, sizeof(*peers));
+    if (!iomp || !pairs || !peers) {
+        fprintf(stderr, "setup: %s\n", strerror(errno));
+        return 1;
+    }
+    for (long i = 0; i < n; i++) {
+        int error = loopback ? iomp_loopback_pair(pairs + 2 * i, 4096) :
+            (socketpair(AF_LOCAL, SOCK_STREAM | SOCK_NONBLOCK, 0,
+                    pairs + 2 * i) == -1 ? errno : 0);
+        if (error != 0) {
+            fprintf(stderr, "pair: %s\n", strerror(error));
+            return 1;
+        }
+    }
+    for (long i = 0; i < 2 * n; i++) {
+        struct peer* p = peers + i;
+        p->aio.fildes = pairs[i];
+        p->aio.buf = p->buf;
+        p->aio.nbytes = PINGPONG_MSG;
+        p->aio.complete = on_pingpong;
+        p->iomp = iomp;
+        p->left = count;
+        p->client = (i % 2 == 0);
+    }
+    double t0 = now();
+    for (long i = 0; i < 2 * n; i++) {
+        struct peer* p = peers + i;
+        p->writing = p->client;
+        if (p->client) {
+            iomp_write(iomp, &p->aio);
+        } else {
+            iomp_read(iomp, &p->aio);
+        }
+    }
+    while (finished < n) {
+        usleep(1000);
+    }
+    double t = now() - t0;
+    printf("%s, pairs %ld, threads %d, %ld round trips of %d bytes\n",
+            loopback ? "loopback" : "socketpair", n, nthreads, n * count,
+            PINGPONG_MSG);
+    printf("%.0f round trips/s, %.2f us each per pair\n",
+            n * count / t, t * 1e6 / count);
+    iomp_drop(iomp);
+    for (long i = 0; i < 2 * n; i++) {
+        if (loopback) {
+            iomp_loopback_close(pairs[i]);
+        } else {
+            close(pairs[i]);
+        }
+    }
+    free(peers);
+    free(pairs);
+    return failed == 0 ? 0 : 1;
+}
+
+static long resident(void) {
+    long size = 0;
+    long pages = 0;
+    FILE* fp = fopen("/proc/self/statm", "r");
+    if (!fp) {
+        return 0;
+    }
+    if (fscanf(fp, "%ld %ld", &size, &pages) != 2) {
+        pages = 0;
+    }
+    fclose(fp);
+    return pages * sysconf(_SC_PAGESIZE);
+}
+
+static long slab(void) {
+    char line[256];
+    long kb = 0;
+    FILE* fp = fopen("/proc/meminfo", "r");
+    if (!fp) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "Slab: %ld kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(fp);
+    return kb * 1024;
+}
+
+/* waits until the workers got past the jobs posted so far */
+static void sync_workers(iomp_t iomp, int nthreads, int settle_ms) {
+    long target = synced + nthreads;
+    for (int i = 0; i < nthreads; i++) {
+        iomp_post(iomp, on_sync, NULL);
+    }
+    while (synced < target) {
+        usleep(100);
+    }
+    usleep(settle_ms * 1000);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc > 1 && strcmp(argv[1], "pingpong") == 0) {
+        long n = argc > 2 ? atol(argv[2]) : 64;
+        int nthreads = argc > 3 ? atoi(argv[3]) : 4;
+        long count = argc > 4 ? atol(argv[4]) : 100000;
+        if (n <= 0 || nthreads <= 0 || count <= 0) {
+            fprintf(stderr, "usage: %s pingpong [pairs] [threads] "
+                    "[round trips per pair]\n", argv[0]);
+            return 1;
+        }
+        return pingpong(n, nthreads, count);
+    }
+    long n = argc > 1 ? atol(argv[1]) : 100000;
+    int nthreads = argc > 2 ? atoi(argv[2]) : 4;
+    if (n <= 0 || nthreads <= 0) {
+        fprintf(stderr, "usage: %s [connections] [threads]\n", argv[0]);
+        return 1;
+    }
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = 2 * n + 64;
+    if (rl.rlim_max < rl.rlim_cur) {
+        rl.rlim_max = rl.rlim_cur;
+    }
+    if (setrlimit(RLIMIT_NOFILE, &rl) == -1) {
+        getrlimit(RLIMIT_NOFILE, &rl);
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        n = ((long)rl.rlim_cur - 64) / 2;
+        fprintf(stderr, "fd limit %ld, only %ld connections\n",
+                (long)rl.rlim_cur, n);
+    }
+    int probe[2];
+    if (iomp_loopback_pair(probe, 0) == 0) {
+        iomp_loopback_close(probe[0]);
+        iomp_loopback_close(probe[1]);
+        fprintf(stderr, "the footprint needs kernel sockets, "
+                "build without IOMP_LOOPBACK\n");
+        return 1;
+    }
+    iomp_t iomp = iomp_new(nthreads);
+    if (!iomp) {
+        return 1;
+    }
+    int* fds = (int*)malloc(sizeof(int) * 2 * n);
+    struct iomp_aio* aios = (struct iomp_aio*)malloc(sizeof(*aios) * n);
+    if (!fds || !aios) {
+        fprintf(stderr, "malloc: %s\n", strerror(errno));
+        return 1;
+    }
+    for (long i = 0; i < n; i++) {
+        if (socketpair(AF_LOCAL, SOCK_STREAM | SOCK_NONBLOCK, 0,
+                fds + 2 * i) == -1) {
+            fprintf(stderr, "socketpair: %s\n", strerror(errno));
+            return 1;
+        }
+    }
+    sync_workers(iomp, nthreads, 100);
+    long rss0 = resident();
+    long slab0 = slab();
+    char dummy = 0;
+    for (long i = 0; i < n; i++) {
+        struct iomp_aio* aio = aios + i;
+        memset(aio, 0, sizeof(*aio));
+        aio->fildes = fds[2 * i];
+        aio->buf = &dummy;
+        aio->nbytes = 0;
+        aio->complete = on_ready;
+        iomp_read(iomp, aio);
+        /* connections come in over time, not all queued at once */
+        if (i % 256 == 255) {
+            sync_workers(iomp, nthreads, 0);
+        }
+    }
+    sync_workers(iomp, nthreads, 100);
+    long rss1 = resident();
+    long slab1 = slab();
+    printf("connections %ld, threads %d, sizeof(struct iomp_aio) %zu\n",
+            n, nthreads, sizeof(struct iomp_aio));
+    printf("user   %8.1f bytes/connection (aio included)\n",
+            (double)(rss1 - rss0) / n);
+    printf("kernel %8.1f bytes/connection (slab, system wide)\n",
+            (double)(slab1 - slab0) / n);
+    for (long i = 0; i < n; i++) {
+        if (write(fds[2 * i + 1], &dummy, 1) != 1) {
+            __atomic_add_fetch(&failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+    while (woken + failed < n) {
+        usleep(1000);
+    }
+    /* one reply each, write queues are what an idle writer leaves behind */
+    for (long i = 0; i < n; i++) {
+        struct iomp_aio* aio = aios + i;
+        aio->nbytes = 1;
+        iomp_write(iomp, aio);
+        if (i % 256 == 255) {
+            sync_workers(iomp, nthreads, 0);
+        }
+    }
+    while (woken + failed < 2 * n) {
+        usleep(1000);
+    }
+    sync_workers(iomp, nthreads, 100);
+    long rss2 = resident();
+    printf("user   %8.1f bytes/connection after a write\n",
+            (double)(rss2 - rss0) / n);
+    printf("woken %ld, failed %ld\n", (long)woken - n, (long)failed);
+    iomp_drop(iomp);
+    for (long i = 0; i < 2 * n; i++) {
+        close(fds[i]);
+    }
+    free(aios);
+    free(fds);
+    return failed == 0 ? 0 : 1;
+}
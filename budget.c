@@ -0,0 +1,210 @@
+/* Checks that one big transfer does not hold up its worker: on a single
+ * worker, a read of many event budgets worth of data and a one byte read
+ * are let go at the same moment, the big one first in line, and the small
+ * one must complete first; the same through the job path and the event
+ * path, then for writes. The worker is held in a task while the data is
+ * put in place, so both are ready when it gets to them.
+ * Exits non zero on any mismatch; needs a build without IOMP_LOOPBACK and
+ * pipes that take IOMP_EVENT_BUDGET * 8 bytes.
+ * usage: budget [repeats] */
+#define _GNU_SOURCE /* F_SETPIPE_SZ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "iomp.h"
+
+#define BULK        (8 * IOMP_EVENT_BUDGET)
+
+struct op {
+    struct iomp_aio aio;
+    int error;
+    int order;
+};
+
+static volatile int ndone = 0;
+static volatile int holding = 0;
+static volatile int hold = 0;
+static char g_bulk[BULK];
+static char g_byte[1];
+
+static void on_done(iomp_aio_t aio, int error) {
+    struct op* op = (struct op*)aio;
+    op->error = error;
+    op->order = __atomic_add_fetch(&ndone, 1, __ATOMIC_ACQ_REL);
+}
+
+static void on_hold(void* arg, int error) {
+    __atomic_store_n(&holding, 1, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&hold, __ATOMIC_ACQUIRE)) {
+        usleep(100);
+    }
+    __atomic_store_n(&holding, 0, __ATOMIC_RELEASE);
+}
+
+/* keeps the only worker busy until release */
+static void worker_hold(iomp_t iomp) {
+    hold = 1;
+    iomp_post(iomp, on_hold, NULL);
+    while (!__atomic_load_n(&holding, __ATOMIC_ACQUIRE)) {
+        usleep(100);
+    }
+}
+
+static void worker_release(void) {
+    __atomic_store_n(&hold, 0, __ATOMIC_RELEASE);
+}
+
+static int wait_done(int n) {
+    int waited = 0;
+    while (__atomic_load_n(&ndone, __ATOMIC_ACQUIRE) < n &&
+            waited++ < 100000) {
+        usleep(100);
+    }
+    return ndone == n;
+}
+
+static int pipe_open(int* fds) {
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        return -1;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+    }
+#if defined(F_SETPIPE_SZ)
+    fcntl(fds[0], F_SETPIPE_SZ, BULK);
+    if (fcntl(fds[0], F_GETPIPE_SZ) >= BULK) {
+        return 0;
+    }
+#endif /* F_SETPIPE_SZ */
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+}
+
+static void pipe_close(iomp_t iomp, int* fds) {
+    iomp_forget(iomp, fds[0]);
+    iomp_forget(iomp, fds[1]);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+/* into the pipe until it is full or nbytes are in */
+static size_t fill(int fd, size_t nbytes) {
+    size_t done = 0;
+    while (done < nbytes) {
+        size_t len = nbytes - done < BULK ? nbytes - done : BULK;
+        ssize_t n = write(fd, g_bulk, len);
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+static void drain(int fd) {
+    while (read(fd, g_bulk, BULK) > 0) {
+    }
+}
+
+static void op_init(struct op* op, int fd, void* buf, size_t nbytes) {
+    memset(op, 0, sizeof(*op));
+    op->error = -2;
+    op->aio.fildes = fd;
+    op->aio.buf = buf;
+    op->aio.nbytes = nbytes;
+    op->aio.complete = on_done;
+}
+
+/* writes go to fds[1], reads come from fds[0]; parked means both aios
+ * wait in the worker's queue before the data is put in place */
+static int race(iomp_t iomp, int write, int parked) {
+    int big[2];
+    int small[2];
+    if (pipe_open(big) != 0 || pipe_open(small) != 0) {
+        return -1;
+    }
+    static char in[BULK];
+    struct op b;
+    struct op s;
+    char byte = 0;
+    op_init(&b, big[write], write ? g_bulk : in, BULK);
+    op_init(&s, small[write], write ? g_byte : &byte, 1);
+    ndone = 0;
+    if (write && parked) {
+        /* full pipes, the writes wait for room */
+        fill(big[1], SIZE_MAX);
+        fill(small[1], SIZE_MAX);
+    }
+    if (parked) {
+        (write ? iomp_write : iomp_read)(iomp, &b.aio);
+        (write ? iomp_write : iomp_read)(iomp, &s.aio);
+        usleep(20000);
+        worker_hold(iomp);
+    } else {
+        worker_hold(iomp);
+        (write ? iomp_write : iomp_read)(iomp, &b.aio);
+        (write ? iomp_write : iomp_read)(iomp, &s.aio);
+    }
+    if (write && parked) {
+        drain(big[0]);
+        drain(small[0]);
+    } else if (!write) {
+        fill(big[1], BULK);
+        fill(small[1], 1);
+    }
+    worker_release();
+    int ok = wait_done(2) && b.error == 0 && s.error == 0;
+    pipe_close(iomp, big);
+    pipe_close(iomp, small);
+    return !ok ? 2 : s.order < b.order ? 0 : 1;
+}
+
+int main(int argc, char* argv[]) {
+    int repeats = argc > 1 ? atoi(argv[1]) : 20;
+    if (repeats <= 0) {
+        fprintf(stderr, "usage: %s [repeats]\n", argv[0]);
+        return 2;
+    }
+    int probe[2];
+    if (iomp_loopback_pair(probe, 0) == 0) {
+        iomp_loopback_close(probe[0]);
+        iomp_loopback_close(probe[1]);
+        fprintf(stderr, "the pipes need kernel fds, "
+                "build without IOMP_LOOPBACK\n");
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    iomp_t iomp = iomp_new(1);
+    if (!iomp) {
+        return 1;
+    }
+    static const char* names[] = { "read jobs", "parked reads",
+            "write jobs", "parked writes" };
+    int failed = 0;
+    for (int k = 0; k < 4; k++) {
+        int late = 0;
+        int bad = 0;
+        for (int i = 0; i < repeats; i++) {
+            int rv = race(iomp, k / 2, k % 2);
+            if (rv == -1) {
+                fprintf(stderr, "pipes can not take %d bytes\n", BULK);
+                iomp_drop(iomp);
+                return 1;
+            }
+            late += rv == 1;
+            bad += rv == 2;
+        }
+        printf("%s: small one behind %d of %d times, %d bad, %s\n",
+                names[k], late, repeats, bad, late || bad ? "FAIL" : "ok");
+        failed |= late || bad;
+    }
+    iomp_drop(iomp);
+    return failed;
+}
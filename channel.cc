@@ -0,0 +1,227 @@
+/* Drives a Channel against a peer that answers out of order: each
+ * request is echoed back as "re:" + body, in reversed batches of up to
+ * seven, while several threads keep calling; then checks that calls
+ * after the peer hung up fail at once, that a peer which never answers
+ * has its calls failed with ECANCELED when the channel goes away, and
+ * that a malformed response fails what is pending with EPROTO.
+ * Exits non zero on any mismatch; needs a build without IOMP_LOOPBACK.
+ * usage: channel [threads] [calls] */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include <future>
+#include <chrono>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "iomp.h"
+
+static const int g_callers = 4;
+
+static bool read_full(int fd, void* buf, size_t nbytes) {
+    char* p = static_cast<char*>(buf);
+    while (nbytes > 0) {
+        ssize_t n = ::read(fd, p, nbytes);
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        nbytes -= n;
+    }
+    return true;
+}
+
+static bool write_full(int fd, const std::string& data) {
+    const char* p = data.data();
+    size_t nbytes = data.size();
+    while (nbytes > 0) {
+        ssize_t n = ::write(fd, p, nbytes);
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        nbytes -= n;
+    }
+    return true;
+}
+
+static std::string frame(const char* id, const std::string& body,
+        uint32_t len) {
+    unsigned char hdr[4] = { (unsigned char)(len >> 24),
+            (unsigned char)(len >> 16), (unsigned char)(len >> 8),
+            (unsigned char)len };
+    return std::string((char*)hdr, 4) + std::string(id, 8) + body;
+}
+
+/* answers ncalls requests then hangs up; with bad set the first answer
+ * claims a length shorter than its own id */
+static void serve(int fd, int ncalls, bool bad) {
+    std::vector<std::string> batch;
+    for (int n = 1; n <= ncalls; n++) {
+        unsigned char hdr[12];
+        if (!read_full(fd, hdr, sizeof(hdr))) {
+            break;
+        }
+        uint32_t len = (uint32_t)hdr[0] << 24 | (uint32_t)hdr[1] << 16 |
+                (uint32_t)hdr[2] << 8 | hdr[3];
+        std::string body(len - 8, '\0');
+        if (!read_full(fd, &body[0], body.size())) {
+            break;
+        }
+        std::string reply = "re:" + body;
+        batch.push_back(frame((char*)hdr + 4, reply,
+                bad ? 4 : 8 + reply.size()));
+        char c;
+        if (batch.size() == 7 || n == ncalls ||
+                recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) <= 0) {
+            for (auto it = batch.rbegin(); it != batch.rend(); ++it) {
+                write_full(fd, *it);
+            }
+            batch.clear();
+        }
+    }
+    ::shutdown(fd, SHUT_WR);
+}
+
+static bool connect_pair(int sv[2]) {
+    if (socketpair(AF_LOCAL, SOCK_STREAM, 0, sv) != 0) {
+        perror("socketpair");
+        return false;
+    }
+    fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+    return true;
+}
+
+static int out_of_order(iomp::IOMultiPlexer& iomp, int ncalls) {
+    int sv[2];
+    if (!connect_pair(sv)) {
+        return 1;
+    }
+    std::thread peer(serve, sv[1], ncalls, false);
+    std::atomic<int> ok(0);
+    std::atomic<int> bad(0);
+    int late = 0;
+    auto start = std::chrono::steady_clock::now();
+    {
+        iomp::Channel channel(iomp, sv[0]);
+        std::vector<std::thread> callers;
+        for (int t = 0; t < g_callers; t++) {
+            callers.emplace_back([&, t] {
+                for (int i = t; i < ncalls; i += g_callers) {
+                    std::string body = "req" + std::to_string(i) +
+                            std::string(i % 100, 'x');
+                    if (i % 100 == 0) {
+                        auto reply = channel.call(body.data(), body.size());
+                        (reply.get() == "re:" + body ? ok : bad)++;
+                        continue;
+                    }
+                    channel.call(body.data(), body.size(),
+                            [body, &ok, &bad](int error, const char* data,
+                            size_t nbytes) {
+                        bool same = error == 0 &&
+                                std::string(data, nbytes) == "re:" + body;
+                        (same ? ok : bad)++;
+                    });
+                }
+            });
+        }
+        for (auto& caller : callers) {
+            caller.join();
+        }
+        while (!channel.closed()) {
+            usleep(1000);
+        }
+        channel.call("x", 1, [&late](int error, const char*, size_t) {
+            late = error;
+        });
+    }
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - start).count();
+    peer.join();
+    iomp.forget(sv[0]);
+    close(sv[0]);
+    close(sv[1]);
+    printf("out of order: %d ok, %d bad, late call error %d, %lld ms\n",
+            ok.load(), bad.load(), late, (long long)ms);
+    return ok != ncalls || bad != 0 || late == 0;
+}
+
+static int silent(iomp::IOMultiPlexer& iomp, int ncalls) {
+    int sv[2];
+    if (!connect_pair(sv)) {
+        return 1;
+    }
+    std::atomic<int> canceled(0);
+    std::atomic<int> other(0);
+    {
+        iomp::Channel channel(iomp, sv[0]);
+        for (int i = 0; i < ncalls; i++) {
+            channel.call("ping", 4, [&](int error, const char*, size_t) {
+                (error == ECANCELED ? canceled : other)++;
+            });
+        }
+    }
+    iomp.forget(sv[0]);
+    close(sv[0]);
+    close(sv[1]);
+    printf("silent peer: %d canceled, %d otherwise\n", canceled.load(),
+            other.load());
+    return canceled != ncalls || other != 0;
+}
+
+static int malformed(iomp::IOMultiPlexer& iomp, int ncalls) {
+    int sv[2];
+    if (!connect_pair(sv)) {
+        return 1;
+    }
+    std::thread peer(serve, sv[1], ncalls, true);
+    std::atomic<int> proto(0);
+    std::atomic<int> other(0);
+    {
+        iomp::Channel channel(iomp, sv[0]);
+        for (int i = 0; i < ncalls; i++) {
+            channel.call("ping", 4, [&](int error, const char*, size_t) {
+                (error == EPROTO ? proto : other)++;
+            });
+        }
+        while (!channel.closed()) {
+            usleep(1000);
+        }
+    }
+    peer.join();
+    iomp.forget(sv[0]);
+    close(sv[0]);
+    close(sv[1]);
+    printf("malformed response: %d failed with EPROTO, %d otherwise\n",
+            proto.load(), other.load());
+    return proto != ncalls || other != 0;
+}
+
+int main(int argc, char* argv[]) {
+    int nthreads = argc > 1 ? atoi(argv[1]) : 4;
+    int ncalls = argc > 2 ? atoi(argv[2]) : 20000;
+    if (nthreads <= 0 || ncalls <= 0) {
+        fprintf(stderr, "usage: %s [threads] [calls]\n", argv[0]);
+        return 2;
+    }
+    int probe[2];
+    if (iomp_loopback_pair(probe, 0) == 0) {
+        iomp_loopback_close(probe[0]);
+        iomp_loopback_close(probe[1]);
+        fprintf(stderr, "a channel needs kernel sockets, "
+                "build without IOMP_LOOPBACK\n");
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    iomp::IOMultiPlexer iomp(nthreads);
+    int failed = out_of_order(iomp, ncalls);
+    failed |= silent(iomp, 64);
+    failed |= malformed(iomp, 16);
+    return failed;
+}
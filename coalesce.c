@@ -0,0 +1,201 @@
+/* Checks that merged writes keep their order: several threads write
+ * small records to the one socket, through iomp_write and iomp_try_write
+ * in turn, while the peer only starts reading once a good part of them
+ * is queued, so they go out through the write queue in batches. Every
+ * record must arrive whole, those of a thread in the order they were
+ * submitted, and every write must complete without error.
+ * Exits non zero on any mismatch.
+ * usage: coalesce [threads] [records per thread] */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "iomp.h"
+
+#define REC_HDR     8
+#define REC_MAX     (REC_HDR + 255)
+
+struct record {
+    struct iomp_aio aio;
+    unsigned char data[REC_MAX];
+};
+
+struct writer {
+    pthread_t thread;
+    iomp_t iomp;
+    int fd;
+    int index;
+    int n;
+    struct record* recs;
+};
+
+static volatile int nwritten = 0;
+static volatile int nfailed = 0;
+
+static void on_write(iomp_aio_t aio, int error) {
+    if (error != 0) {
+        __atomic_add_fetch(&nfailed, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&nwritten, 1, __ATOMIC_RELEASE);
+}
+
+/* thread, payload length, seq, then the payload, all from (thread, seq) */
+static size_t record_fill(unsigned char* p, int thread, uint32_t seq) {
+    size_t len = (seq * 7 + thread) % 256;
+    p[0] = (unsigned char)thread;
+    p[1] = (unsigned char)len;
+    p[2] = 0;
+    p[3] = 0;
+    memcpy(p + 4, &seq, 4);
+    for (size_t i = 0; i < len; i++) {
+        p[REC_HDR + i] = (unsigned char)(seq + thread + i);
+    }
+    return REC_HDR + len;
+}
+
+static void* write_all(void* arg) {
+    struct writer* w = (struct writer*)arg;
+    for (int i = 0; i < w->n; i++) {
+        struct record* r = w->recs + i;
+        memset(&r->aio, 0, sizeof(r->aio));
+        r->aio.fildes = w->fd;
+        r->aio.buf = r->data;
+        r->aio.nbytes = record_fill(r->data, w->index, i);
+        r->aio.complete = on_write;
+        if (i % 2 == 0) {
+            iomp_write(w->iomp, &r->aio);
+            continue;
+        }
+        int error = iomp_try_write(w->iomp, &r->aio);
+        if (error != EINPROGRESS) {
+            on_write(&r->aio, error);
+        }
+    }
+    return NULL;
+}
+
+static int read_full(int fd, unsigned char* buf, size_t nbytes) {
+    while (nbytes > 0) {
+        ssize_t n = read(fd, buf, nbytes);
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        nbytes -= n;
+    }
+    return 0;
+}
+
+/* checks nthreads * n records off fd, returns the number of bad ones */
+static int check_all(int fd, int nthreads, int n) {
+    uint32_t* next = (uint32_t*)calloc(nthreads, sizeof(*next));
+    unsigned char got[REC_MAX];
+    unsigned char want[REC_MAX];
+    int bad = 0;
+    for (long i = 0; i < (long)nthreads * n; i++) {
+        if (read_full(fd, got, REC_HDR) != 0) {
+            bad++;
+            break;
+        }
+        int thread = got[0];
+        uint32_t seq = 0;
+        memcpy(&seq, got + 4, 4);
+        if (thread >= nthreads || seq != next[thread]) {
+            /* out of order or torn, nothing after it lines up */
+            printf("record %ld: thread %d seq %u, wanted seq %u\n", i,
+                    thread, seq, thread < nthreads ? next[thread] : 0);
+            bad++;
+            break;
+        }
+        next[thread]++;
+        size_t len = record_fill(want, thread, seq) - REC_HDR;
+        if (got[1] != len || read_full(fd, got + REC_HDR, len) != 0 ||
+                memcmp(got, want, REC_HDR + len) != 0) {
+            bad++;
+            break;
+        }
+    }
+    free(next);
+    return bad;
+}
+
+int main(int argc, char* argv[]) {
+    int nthreads = argc > 1 ? atoi(argv[1]) : 4;
+    int n = argc > 2 ? atoi(argv[2]) : 20000;
+    if (nthreads <= 0 || nthreads > 255 || n <= 0) {
+        fprintf(stderr, "usage: %s [threads, up to 255] "
+                "[records per thread]\n", argv[0]);
+        return 2;
+    }
+    int probe[2];
+    if (iomp_loopback_pair(probe, 0) == 0) {
+        iomp_loopback_close(probe[0]);
+        iomp_loopback_close(probe[1]);
+        fprintf(stderr, "the writes need kernel sockets, "
+                "build without IOMP_LOOPBACK\n");
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    int sv[2];
+    if (socketpair(AF_LOCAL, SOCK_STREAM, 0, sv) != 0) {
+        perror("socketpair");
+        return 1;
+    }
+    fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+    int sndbuf = 16384;
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    /* a write queue that got stuck fails the check instead of hanging */
+    struct timeval tv = { 10, 0 };
+    setsockopt(sv[1], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    iomp_t iomp = iomp_new(4);
+    if (!iomp) {
+        return 1;
+    }
+    struct writer* ws = (struct writer*)calloc(nthreads, sizeof(*ws));
+    for (int t = 0; t < nthreads; t++) {
+        ws[t].iomp = iomp;
+        ws[t].fd = sv[0];
+        ws[t].index = t;
+        ws[t].n = n;
+        ws[t].recs = (struct record*)malloc(sizeof(struct record) * n);
+        pthread_create(&ws[t].thread, NULL, write_all, ws + t);
+    }
+    /* let the queue build up before draining it */
+    usleep(20000);
+    int bad = check_all(sv[1], nthreads, n);
+    if (bad) {
+        /* fail whatever is still queued rather than wait for it */
+        shutdown(sv[1], SHUT_RDWR);
+    }
+    for (int t = 0; t < nthreads; t++) {
+        pthread_join(ws[t].thread, NULL);
+    }
+    int waited = 0;
+    while (__atomic_load_n(&nwritten, __ATOMIC_ACQUIRE) < nthreads * n &&
+            waited++ < 10000) {
+        usleep(1000);
+    }
+    int lost = nthreads * n - nwritten;
+    printf("coalesce: %d threads, %d records, %d failed writes, "
+            "%d lost, %s\n", nthreads, nthreads * n, nfailed, lost,
+            bad || nfailed || lost ? "FAIL" : "ok");
+    if (lost) {
+        return 1;
+    }
+    iomp_forget(iomp, sv[0]);
+    iomp_drop(iomp);
+    close(sv[0]);
+    close(sv[1]);
+    for (int t = 0; t < nthreads; t++) {
+        free(ws[t].recs);
+    }
+    free(ws);
+    return bad || nfailed;
+}
@@ -0,0 +1,300 @@
+/* Checks iomp_crc32c against published CRC32C values and a bit at a time
+ * reference, over every short length at every alignment and continued
+ * across arbitrary splits, then the integrity stage: sealed writes must
+ * carry the right trailer, a sealed message read back in dribs must
+ * complete without error, the same with one byte flipped with EBADMSG,
+ * and an aio too short for the trailer with EINVAL.
+ * Exits non zero on any mismatch.
+ * usage: crc [messages] */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include "iomp.h"
+
+#define MSG_MAX     65536
+
+static uint32_t crc_ref(uint32_t crc, const unsigned char* p, size_t len) {
+    crc = ~crc;
+    while (len-- > 0) {
+        crc ^= *p++;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
+
+static uint32_t trailer(const unsigned char* p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+            (uint32_t)p[2] << 8 | p[3];
+}
+
+static int vectors(void) {
+    unsigned char zeros[32];
+    unsigned char ones[32];
+    unsigned char ramp[32];
+    memset(zeros, 0, sizeof(zeros));
+    memset(ones, 0xff, sizeof(ones));
+    for (int i = 0; i < 32; i++) {
+        ramp[i] = (unsigned char)i;
+    }
+    /* from RFC 3720, B.4, and the usual check string */
+    int bad = iomp_crc32c(0, "123456789", 9) != 0xe3069283;
+    bad += iomp_crc32c(0, zeros, 32) != 0x8a9136aa;
+    bad += iomp_crc32c(0, ones, 32) != 0x62a8ab43;
+    bad += iomp_crc32c(0, ramp, 32) != 0x46dd794e;
+    bad += iomp_crc32c(0, NULL, 0) != 0;
+    printf("vectors: %d bad, %s\n", bad, bad ? "FAIL" : "ok");
+    return bad != 0;
+}
+
+/* every length up to 300 at every alignment up to 16, then splits */
+static int lengths(void) {
+    unsigned char buf[4096 + 16];
+    for (size_t i = 0; i < sizeof(buf); i++) {
+        buf[i] = (unsigned char)(i * 131 + (i >> 7));
+    }
+    int bad = 0;
+    for (int at = 0; at < 16; at++) {
+        for (size_t len = 0; len <= 300; len++) {
+            bad += iomp_crc32c(0, buf + at, len) != crc_ref(0, buf + at, len);
+        }
+    }
+    uint32_t whole = crc_ref(0, buf, 4096);
+    bad += iomp_crc32c(0, buf, 4096) != whole;
+    for (size_t step = 1; step <= 257; step += 8) {
+        uint32_t crc = 0;
+        for (size_t at = 0; at < 4096; at += step) {
+            crc = iomp_crc32c(crc, buf + at, at + step < 4096 ? step :
+                    4096 - at);
+        }
+        bad += crc != whole;
+    }
+    printf("lengths: %d bad, %s\n", bad, bad ? "FAIL" : "ok");
+    return bad != 0;
+}
+
+#if !IOMP_COMPACT
+
+struct conn {
+    int fds[2];
+    pthread_t peer;
+    const unsigned char* data;
+    size_t nbytes;
+};
+
+static volatile int ndone = 0;
+static volatile int last_error = 0;
+
+static void on_done(iomp_aio_t aio, int error) {
+    last_error = error;
+    __atomic_add_fetch(&ndone, 1, __ATOMIC_RELEASE);
+}
+
+static void wait_done(int n) {
+    int waited = 0;
+    while (__atomic_load_n(&ndone, __ATOMIC_ACQUIRE) < n && waited++ < 10000) {
+        usleep(1000);
+    }
+}
+
+static void* dribble(void* arg) {
+    struct conn* c = (struct conn*)arg;
+    size_t at = 0;
+    for (int i = 0; at < c->nbytes; i++) {
+        size_t len = 1 + (i * 97) % 1500;
+        len = len < c->nbytes - at ? len : c->nbytes - at;
+        if (write(c->fds[1], c->data + at, len) != (ssize_t)len) {
+            break;
+        }
+        at += len;
+        if (i % 8 == 0) {
+            usleep(50);
+        }
+    }
+    return NULL;
+}
+
+static void fill(unsigned char* p, size_t len, int seed) {
+    for (size_t i = 0; i < len; i++) {
+        p[i] = (unsigned char)(seed * 31 + i * 7 + (i >> 9));
+    }
+}
+
+/* sealed by iomp_write, checked by the peer */
+static int sealed(iomp_t iomp, int fd, int peer, unsigned char* buf,
+        unsigned char* got, int n) {
+    int bad = 0;
+    for (int i = 0; i < n; i++) {
+        size_t len = 4 + (i * 4099) % (MSG_MAX - 4);
+        fill(buf, len - 4, i);
+        struct iomp_aio aio;
+        memset(&aio, 0, sizeof(aio));
+        aio.fildes = fd;
+        aio.buf = buf;
+        aio.nbytes = len;
+        aio.complete = on_done;
+        aio.flags = IOMP_AIO_CRC32C;
+        ndone = 0;
+        iomp_write(iomp, &aio);
+        size_t have = 0;
+        while (have < len) {
+            ssize_t k = read(peer, got + have, len - have);
+            if (k <= 0) {
+                break;
+            }
+            have += k;
+        }
+        wait_done(1);
+        bad += ndone != 1 || last_error != 0 || have != len ||
+                memcmp(got, buf, len - 4) != 0 ||
+                trailer(got + len - 4) != crc_ref(0, got, len - 4);
+    }
+    printf("sealed writes: %d of %d bad, %s\n", bad, n, bad ? "FAIL" : "ok");
+    return bad != 0;
+}
+
+/* read back in dribs, intact and with one byte flipped */
+static int checked(iomp_t iomp, int n, unsigned char* msg,
+        unsigned char* buf) {
+    int bad = 0;
+    int flipped = 0;
+    for (int i = 0; i < n; i++) {
+        size_t len = 5 + (i * 7919) % (MSG_MAX - 5);
+        fill(msg, len - 4, i);
+        uint32_t crc = crc_ref(0, msg, len - 4);
+        msg[len - 4] = crc >> 24;
+        msg[len - 3] = crc >> 16;
+        msg[len - 2] = crc >> 8;
+        msg[len - 1] = crc;
+        int flip = i % 2;
+        if (flip) {
+            msg[(i * 131) % len] ^= 0x10;
+        }
+        struct conn c;
+        if (socketpair(AF_LOCAL, SOCK_STREAM, 0, c.fds) != 0) {
+            perror("socketpair");
+            return 1;
+        }
+        fcntl(c.fds[0], F_SETFL, fcntl(c.fds[0], F_GETFL) | O_NONBLOCK);
+        c.data = msg;
+        c.nbytes = len;
+        struct iomp_aio aio;
+        memset(&aio, 0, sizeof(aio));
+        aio.fildes = c.fds[0];
+        aio.buf = buf;
+        aio.nbytes = len;
+        aio.complete = on_done;
+        aio.flags = IOMP_AIO_CRC32C;
+        ndone = 0;
+        last_error = -2;
+        pthread_create(&c.peer, NULL, dribble, &c);
+        /* every other one tried inline first */
+        if (i % 4 < 2) {
+            iomp_read(iomp, &aio);
+        } else {
+            int error = iomp_try_read(iomp, &aio);
+            if (error != EINPROGRESS) {
+                on_done(&aio, error);
+            }
+        }
+        wait_done(1);
+        pthread_join(c.peer, NULL);
+        int want = flip ? EBADMSG : 0;
+        if (ndone != 1 || last_error != want) {
+            printf("read %d: %zu bytes, error %d, wanted %d\n", i, len,
+                    last_error, want);
+            bad++;
+        }
+        flipped += flip && last_error == EBADMSG;
+        iomp_forget(iomp, c.fds[0]);
+        close(c.fds[0]);
+        close(c.fds[1]);
+    }
+    printf("checked reads: %d of %d bad, %d flipped caught, %s\n", bad, n,
+            flipped, bad ? "FAIL" : "ok");
+    return bad != 0;
+}
+
+/* no room for the trailer */
+static int short_aio(iomp_t iomp, int fd) {
+    unsigned char buf[4];
+    struct iomp_aio aio;
+    memset(&aio, 0, sizeof(aio));
+    aio.fildes = fd;
+    aio.buf = buf;
+    aio.nbytes = 3;
+    aio.complete = on_done;
+    aio.flags = IOMP_AIO_CRC32C;
+    ndone = 0;
+    last_error = 0;
+    iomp_read(iomp, &aio);
+    wait_done(1);
+    int bad = ndone != 1 || last_error != EINVAL;
+    ndone = 0;
+    last_error = 0;
+    iomp_write(iomp, &aio);
+    wait_done(1);
+    bad += ndone != 1 || last_error != EINVAL;
+    bad += iomp_try_read(iomp, &aio) != EINVAL;
+    bad += iomp_try_write(iomp, &aio) != EINVAL;
+    printf("short aio: %d bad, %s\n", bad, bad ? "FAIL" : "ok");
+    return bad != 0;
+}
+
+static int stage(int n) {
+    int probe[2];
+    if (iomp_loopback_pair(probe, 0) == 0) {
+        iomp_loopback_close(probe[0]);
+        iomp_loopback_close(probe[1]);
+        fprintf(stderr, "the stage needs kernel sockets, "
+                "build without IOMP_LOOPBACK\n");
+        return 1;
+    }
+    unsigned char* a = (unsigned char*)malloc(MSG_MAX);
+    unsigned char* b = (unsigned char*)malloc(MSG_MAX);
+    int sv[2];
+    if (!a || !b || socketpair(AF_LOCAL, SOCK_STREAM, 0, sv) != 0) {
+        perror("setup");
+        return 1;
+    }
+    fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+    iomp_t iomp = iomp_new(2);
+    if (!iomp) {
+        return 1;
+    }
+    /* every flipped byte is logged otherwise */
+    iomp_loglevel(IOMP_LOGLEVEL_ERROR);
+    int failed = sealed(iomp, sv[0], sv[1], a, b, n);
+    failed |= checked(iomp, n, a, b);
+    failed |= short_aio(iomp, sv[0]);
+    iomp_forget(iomp, sv[0]);
+    iomp_drop(iomp);
+    close(sv[0]);
+    close(sv[1]);
+    free(a);
+    free(b);
+    return failed;
+}
+
+#endif /* IOMP_COMPACT */
+
+int main(int argc, char* argv[]) {
+    int n = argc > 1 ? atoi(argv[1]) : 200;
+    if (n <= 0) {
+        fprintf(stderr, "usage: %s [messages]\n", argv[0]);
+        return 2;
+    }
+    int failed = vectors();
+    failed |= lengths();
+#if !IOMP_COMPACT
+    failed |= stage(n);
+#endif /* IOMP_COMPACT */
+    return failed;
+}
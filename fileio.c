@@ -0,0 +1,218 @@
+/* Checks iomp_pread and iomp_pwrite on a scratch file: a pattern written
+ * through iomp in uneven pieces must read back the same through reads at
+ * odd positions into odd buffers, many of them in flight at once, and a
+ * read past the end must complete with -1 after what is there. On an
+ * O_DIRECT fd the same misaligned reads go through the bounce copy, as
+ * do aligned writes from a misaligned buffer, and a misaligned write
+ * position must get EINVAL. The polled mode runs the same reads inside
+ * iomp_poll. The file system must take O_DIRECT for that part, it is
+ * skipped otherwise.
+ * Exits non zero on any mismatch.
+ * usage: fileio [directory] */
+#define _GNU_SOURCE /* O_DIRECT */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "iomp.h"
+
+#define FILE_SIZE   (1024 * 1024 + 1234)
+#define INFLIGHT    256
+
+struct op {
+    struct iomp_aio aio;
+    int error;
+};
+
+static volatile int ndone = 0;
+
+static void on_done(iomp_aio_t aio, int error) {
+    ((struct op*)aio)->error = error;
+    __atomic_add_fetch(&ndone, 1, __ATOMIC_RELEASE);
+}
+
+static void wait_done(iomp_t polled, int n) {
+    int waited = 0;
+    while (__atomic_load_n(&ndone, __ATOMIC_ACQUIRE) < n && waited++ < 10000) {
+        if (polled) {
+            iomp_poll(polled, 1);
+        } else {
+            usleep(1000);
+        }
+    }
+}
+
+static void pattern(unsigned char* p, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        p[i] = (unsigned char)(i * 13 + (i >> 11));
+    }
+}
+
+static iomp_aio_t op_init(struct op* op, int fd, void* buf, size_t nbytes) {
+    struct iomp_aio* aio = &op->aio;
+    memset(op, 0, sizeof(*op));
+    op->error = -2;
+    aio->fildes = fd;
+    aio->buf = buf;
+    aio->nbytes = nbytes;
+    aio->complete = on_done;
+    return aio;
+}
+
+/* the whole pattern, in pieces of uneven length */
+static int write_all(iomp_t iomp, int fd, const unsigned char* data) {
+    struct op op;
+    int bad = 0;
+    size_t at = 0;
+    for (int i = 0; at < FILE_SIZE; i++) {
+        size_t len = 1 + (i * 7919) % 65536;
+        len = len < FILE_SIZE - at ? len : FILE_SIZE - at;
+        op_init(&op, fd, (void*)(data + at), len);
+        ndone = 0;
+        iomp_pwrite(iomp, &op.aio, at);
+        wait_done(NULL, 1);
+        bad += ndone != 1 || op.error != 0 || op.aio.offset != len;
+        at += len;
+    }
+    return bad;
+}
+
+/* INFLIGHT reads at odd places into odd buffers, all at once */
+static int read_many(iomp_t iomp, iomp_t polled, int fd,
+        const unsigned char* data, unsigned char* buf) {
+    static struct op ops[INFLIGHT];
+    static size_t pos[INFLIGHT];
+    size_t slot = FILE_SIZE / INFLIGHT;
+    ndone = 0;
+    for (int i = 0; i < INFLIGHT; i++) {
+        size_t len = 1 + (i * 4099) % (slot - 64);
+        pos[i] = (size_t)i * slot + (i * 31) % 64;
+        iomp_pread(iomp, op_init(ops + i, fd, buf + (size_t)i * slot + i % 8,
+                len), pos[i]);
+    }
+    wait_done(polled, INFLIGHT);
+    int bad = ndone != INFLIGHT;
+    for (int i = 0; i < INFLIGHT; i++) {
+        struct iomp_aio* aio = &ops[i].aio;
+        bad += ops[i].error != 0 || aio->offset != aio->nbytes ||
+                memcmp(aio->buf, data + pos[i], aio->nbytes) != 0;
+    }
+    return bad;
+}
+
+/* past the end, what is there and then -1 */
+static int read_tail(iomp_t iomp, iomp_t polled, int fd,
+        const unsigned char* data, unsigned char* buf) {
+    struct op op;
+    op_init(&op, fd, buf + 3, 10000);
+    ndone = 0;
+    iomp_pread(iomp, &op.aio, FILE_SIZE - 777);
+    wait_done(polled, 1);
+    return ndone != 1 || op.error != -1 || op.aio.offset != 777 ||
+            memcmp(buf + 3, data + FILE_SIZE - 777, 777) != 0;
+}
+
+static int report(const char* name, int bad) {
+    printf("%s: %d bad, %s\n", name, bad, bad ? "FAIL" : "ok");
+    return bad != 0;
+}
+
+static int buffered(iomp_t iomp, const char* path, const unsigned char* data,
+        unsigned char* buf) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        perror(path);
+        return 1;
+    }
+    int bad = write_all(iomp, fd, data);
+    bad += read_many(iomp, NULL, fd, data, buf);
+    bad += read_tail(iomp, NULL, fd, data, buf);
+    close(fd);
+    return report("buffered", bad);
+}
+
+static int direct(iomp_t iomp, const char* path, const unsigned char* data,
+        unsigned char* buf) {
+#if defined(O_DIRECT)
+    int fd = open(path, O_RDWR | O_DIRECT);
+    if (fd == -1 && errno == EINVAL) {
+        printf("direct: no O_DIRECT here, skipped\n");
+        return 0;
+    }
+    if (fd == -1) {
+        perror(path);
+        return 1;
+    }
+    int bad = read_many(iomp, NULL, fd, data, buf);
+    bad += read_tail(iomp, NULL, fd, data, buf);
+    /* aligned position and length, misaligned buffer */
+    struct op op;
+    unsigned char* back = iomp_file_alloc(2 * IOMP_FILE_ALIGN);
+    memcpy(buf + 1, data + 3 * IOMP_FILE_ALIGN, 2 * IOMP_FILE_ALIGN);
+    op_init(&op, fd, buf + 1, 2 * IOMP_FILE_ALIGN);
+    ndone = 0;
+    iomp_pwrite(iomp, &op.aio, 3 * IOMP_FILE_ALIGN);
+    wait_done(NULL, 1);
+    bad += ndone != 1 || op.error != 0;
+    op_init(&op, fd, back, 2 * IOMP_FILE_ALIGN);
+    ndone = 0;
+    iomp_pread(iomp, &op.aio, 3 * IOMP_FILE_ALIGN);
+    wait_done(NULL, 1);
+    bad += ndone != 1 || op.error != 0 ||
+            memcmp(back, data + 3 * IOMP_FILE_ALIGN, 2 * IOMP_FILE_ALIGN) != 0;
+    /* a misaligned position can not be written */
+    op_init(&op, fd, back, IOMP_FILE_ALIGN);
+    ndone = 0;
+    iomp_pwrite(iomp, &op.aio, 100);
+    wait_done(NULL, 1);
+    bad += ndone != 1 || op.error != EINVAL;
+    iomp_file_free(back);
+    close(fd);
+    return report("direct", bad);
+#else
+    printf("direct: no O_DIRECT here, skipped\n");
+    return 0;
+#endif /* O_DIRECT */
+}
+
+static int polled(const char* path, const unsigned char* data,
+        unsigned char* buf) {
+    iomp_t iomp = iomp_new_polled();
+    int fd = open(path, O_RDONLY);
+    if (!iomp || fd == -1) {
+        perror(path);
+        return 1;
+    }
+    int bad = read_many(iomp, iomp, fd, data, buf);
+    bad += read_tail(iomp, iomp, fd, data, buf);
+    close(fd);
+    iomp_drop(iomp);
+    return report("polled", bad);
+}
+
+int main(int argc, char* argv[]) {
+    const char* dir = argc > 1 ? argv[1] : ".";
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/fileio.%d", dir, (int)getpid());
+    unsigned char* data = (unsigned char*)malloc(FILE_SIZE);
+    unsigned char* buf = (unsigned char*)malloc(FILE_SIZE + 16);
+    if (!data || !buf) {
+        perror("malloc");
+        return 1;
+    }
+    pattern(data, FILE_SIZE);
+    iomp_t iomp = iomp_new(2);
+    if (!iomp) {
+        return 1;
+    }
+    int failed = buffered(iomp, path, data, buf);
+    failed |= direct(iomp, path, data, buf);
+    iomp_drop(iomp);
+    failed |= polled(path, data, buf);
+    unlink(path);
+    free(buf);
+    free(data);
+    return failed;
+}
@@ -0,0 +1,336 @@
+/* Checks framed reads against a peer that dribbles its bytes in small
+ * uneven writes: every header length in both byte orders must hand back
+ * each message whole, empty and buffer growing ones included, and the
+ * single, two and IOMP_FRAME_DELIM_MAX byte delimiters must split a
+ * stream whose messages hold the first delimiter byte here and there,
+ * with delimiters cut in two by the writes and long runs for the vector
+ * scan. A header over IOMP_FRAME_LIMIT, or that many bytes without a
+ * delimiter, must complete with EMSGSIZE, and bad arguments with EINVAL.
+ * Exits non zero on any mismatch; needs a build without IOMP_LOOPBACK.
+ * usage: frame [messages] */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include "iomp.h"
+
+#define LONG_RUN    100000
+
+struct op {
+    struct iomp_aio aio;
+    int error;
+};
+
+/* what the peer writes, and how */
+struct feed {
+    int fd;
+    const char* data;
+    size_t len;
+    unsigned seed;
+};
+
+static volatile int ndone = 0;
+
+static void on_done(iomp_aio_t aio, int error) {
+    ((struct op*)aio)->error = error;
+    __atomic_add_fetch(&ndone, 1, __ATOMIC_RELEASE);
+}
+
+static int wait_done(int n) {
+    int waited = 0;
+    while (__atomic_load_n(&ndone, __ATOMIC_ACQUIRE) < n &&
+            waited++ < 100000) {
+        usleep(100);
+    }
+    return ndone == n;
+}
+
+/* pieces of 1 to 64 bytes mostly, now and then a pause or a big one */
+static void* feed_run(void* arg) {
+    struct feed* feed = (struct feed*)arg;
+    size_t at = 0;
+    while (at < feed->len) {
+        unsigned r = rand_r(&feed->seed);
+        size_t len = r % 16 == 0 ? 1 + r % 8192 : 1 + r % 64;
+        len = len < feed->len - at ? len : feed->len - at;
+        ssize_t n = write(feed->fd, feed->data + at, len);
+        if (n <= 0) {
+            break;
+        }
+        at += n;
+        if (r % 64 == 1) {
+            usleep(100);
+        }
+    }
+    return NULL;
+}
+
+static int conn_open(int* sv) {
+    if (socketpair(AF_LOCAL, SOCK_STREAM, 0, sv) != 0) {
+        perror("socketpair");
+        return -1;
+    }
+    fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+    return 0;
+}
+
+/* forgotten and closed before the peer hears of it, so no edge comes in
+ * for a number already closed; a peer still writing gets EPIPE */
+static void conn_close(iomp_t iomp, int* sv, pthread_t* peer) {
+    iomp_forget(iomp, sv[0]);
+    close(sv[0]);
+    if (peer) {
+        pthread_join(*peer, NULL);
+    }
+    close(sv[1]);
+}
+
+static void op_init(struct op* op) {
+    memset(op, 0, sizeof(*op));
+    op->error = -2;
+    op->aio.complete = on_done;
+}
+
+static char msg_byte(int i, size_t j) {
+    return (char)('a' + (i * 7 + j) % 26);
+}
+
+static size_t frame_len(int i, int hdrlen) {
+    size_t most = hdrlen == 1 ? 255 : hdrlen == 2 ? 65535 : LONG_RUN;
+    return i % 50 == 7 ? most : (size_t)(i * 37) % (most < 3000 ? most : 3000);
+}
+
+static size_t put_header(char* p, uint64_t len, int hdrlen, int order) {
+    for (int k = 0; k < hdrlen; k++) {
+        int shift = 8 * (order == IOMP_FRAME_BE ? hdrlen - 1 - k : k);
+        p[k] = (char)(len >> shift);
+    }
+    return hdrlen;
+}
+
+/* reads n messages off sv[0] while the feed writes them */
+static int headers(iomp_t iomp, int n, int hdrlen, int order) {
+    int sv[2];
+    if (conn_open(sv) != 0) {
+        return 1;
+    }
+    size_t total = 0;
+    for (int i = 0; i < n; i++) {
+        total += hdrlen + frame_len(i, hdrlen);
+    }
+    char* data = (char*)malloc(total);
+    size_t at = 0;
+    for (int i = 0; i < n; i++) {
+        size_t len = frame_len(i, hdrlen);
+        at += put_header(data + at, len, hdrlen, order);
+        for (size_t j = 0; j < len; j++) {
+            data[at++] = msg_byte(i, j);
+        }
+    }
+    struct feed feed = { sv[1], data, total, (unsigned)(hdrlen * 2 + order) };
+    pthread_t peer;
+    pthread_create(&peer, NULL, feed_run, &feed);
+    iomp_framer_t f = iomp_framer_new(sv[0], 16);
+    struct op op;
+    int bad = 0;
+    for (int i = 0; i < n; i++) {
+        op_init(&op);
+        ndone = 0;
+        iomp_read_frame(iomp, f, &op.aio, hdrlen, order);
+        if (!wait_done(1) || op.error != 0) {
+            bad += n - i;
+            break;
+        }
+        size_t len = frame_len(i, hdrlen);
+        const char* got = (const char*)op.aio.buf;
+        int wrong = op.aio.nbytes != len;
+        for (size_t j = 0; j < len && !wrong; j++) {
+            wrong = got[j] != msg_byte(i, j);
+        }
+        bad += wrong;
+    }
+    conn_close(iomp, sv, &peer);
+    iomp_framer_drop(f);
+    free(data);
+    printf("header %d %s: %d messages, %d bad, %s\n", hdrlen,
+            order == IOMP_FRAME_BE ? "be" : "le", n, bad, bad ? "FAIL" : "ok");
+    return bad != 0;
+}
+
+static size_t line_len(int i) {
+    return i % 50 == 7 ? LONG_RUN : (size_t)(i * 37) % 500;
+}
+
+/* letters, with the first delimiter byte every so often but never
+ * the whole delimiter */
+static char line_byte(int i, size_t j, const char* delim, size_t dlen) {
+    if (dlen > 1 && j % 50 == 49) {
+        return delim[0];
+    }
+    return msg_byte(i, j);
+}
+
+static int delimited(iomp_t iomp, int n, const char* delim) {
+    size_t dlen = strlen(delim);
+    int sv[2];
+    if (conn_open(sv) != 0) {
+        return 1;
+    }
+    size_t total = 0;
+    for (int i = 0; i < n; i++) {
+        total += line_len(i) + dlen;
+    }
+    char* data = (char*)malloc(total);
+    size_t at = 0;
+    for (int i = 0; i < n; i++) {
+        for (size_t j = 0; j < line_len(i); j++) {
+            data[at++] = line_byte(i, j, delim, dlen);
+        }
+        memcpy(data + at, delim, dlen);
+        at += dlen;
+    }
+    struct feed feed = { sv[1], data, total, (unsigned)dlen };
+    pthread_t peer;
+    pthread_create(&peer, NULL, feed_run, &feed);
+    iomp_framer_t f = iomp_framer_new(sv[0], 64);
+    struct op op;
+    int bad = 0;
+    for (int i = 0; i < n; i++) {
+        op_init(&op);
+        ndone = 0;
+        iomp_read_until(iomp, f, &op.aio, delim, dlen);
+        if (!wait_done(1) || op.error != 0) {
+            bad += n - i;
+            break;
+        }
+        size_t len = line_len(i);
+        const char* got = (const char*)op.aio.buf;
+        int wrong = op.aio.nbytes != len;
+        for (size_t j = 0; j < len && !wrong; j++) {
+            wrong = got[j] != line_byte(i, j, delim, dlen);
+        }
+        bad += wrong;
+    }
+    conn_close(iomp, sv, &peer);
+    iomp_framer_drop(f);
+    free(data);
+    printf("delimiter of %zu: %d messages, %d bad, %s\n", dlen, n, bad,
+            bad ? "FAIL" : "ok");
+    return bad != 0;
+}
+
+/* one read on a fresh framer over what is fed, the error it gets */
+static int read_one(iomp_t iomp, const char* data, size_t len, int hdrlen) {
+    int sv[2];
+    if (conn_open(sv) != 0) {
+        return -2;
+    }
+    struct feed feed = { sv[1], data, len, 1 };
+    pthread_t peer;
+    pthread_create(&peer, NULL, feed_run, &feed);
+    iomp_framer_t f = iomp_framer_new(sv[0], 64);
+    struct op op;
+    op_init(&op);
+    ndone = 0;
+    if (hdrlen) {
+        iomp_read_frame(iomp, f, &op.aio, hdrlen, IOMP_FRAME_BE);
+    } else {
+        iomp_read_until(iomp, f, &op.aio, "\n", 1);
+    }
+    int error = wait_done(1) ? op.error : -2;
+    conn_close(iomp, sv, &peer);
+    iomp_framer_drop(f);
+    return error;
+}
+
+static int too_big(iomp_t iomp) {
+    char header[8];
+    put_header(header, (uint64_t)IOMP_FRAME_LIMIT + 1, 8, IOMP_FRAME_BE);
+    int by_header = read_one(iomp, header, sizeof(header), 8);
+    size_t len = IOMP_FRAME_LIMIT + 4096;
+    char* run = (char*)malloc(len);
+    memset(run, 'x', len);
+    int by_scan = read_one(iomp, run, len, 0);
+    free(run);
+    int bad = by_header != EMSGSIZE || by_scan != EMSGSIZE;
+    printf("too big: header %d, no delimiter %d, %s\n", by_header, by_scan,
+            bad ? "FAIL" : "ok");
+    return bad;
+}
+
+static int invalid(iomp_t iomp) {
+    int sv[2];
+    if (conn_open(sv) != 0) {
+        return 1;
+    }
+    iomp_framer_t f = iomp_framer_new(sv[0], 64);
+    static const char delim[IOMP_FRAME_DELIM_MAX + 1];
+    struct op op;
+    int bad = 0;
+    for (int k = 0; k < 5; k++) {
+        op_init(&op);
+        ndone = 0;
+        switch (k) {
+        case 0:
+            iomp_read_frame(iomp, f, &op.aio, 3, IOMP_FRAME_BE);
+            break;
+        case 1:
+            iomp_read_frame(iomp, f, &op.aio, 4, 7);
+            break;
+        case 2:
+            iomp_read_frame(iomp, NULL, &op.aio, 4, IOMP_FRAME_LE);
+            break;
+        case 3:
+            iomp_read_until(iomp, f, &op.aio, delim, 0);
+            break;
+        default:
+            iomp_read_until(iomp, f, &op.aio, delim, sizeof(delim));
+            break;
+        }
+        bad += !wait_done(1) || op.error != EINVAL;
+    }
+    conn_close(iomp, sv, NULL);
+    iomp_framer_drop(f);
+    printf("invalid: %d bad, %s\n", bad, bad ? "FAIL" : "ok");
+    return bad != 0;
+}
+
+int main(int argc, char* argv[]) {
+    int n = argc > 1 ? atoi(argv[1]) : 400;
+    if (n <= 0) {
+        fprintf(stderr, "usage: %s [messages]\n", argv[0]);
+        return 2;
+    }
+    int probe[2];
+    if (iomp_loopback_pair(probe, 0) == 0) {
+        iomp_loopback_close(probe[0]);
+        iomp_loopback_close(probe[1]);
+        fprintf(stderr, "the feeds need kernel sockets, "
+                "build without IOMP_LOOPBACK\n");
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    iomp_t iomp = iomp_new(2);
+    if (!iomp) {
+        return 1;
+    }
+    static const int hdrlens[] = { 1, 2, 4, 8 };
+    int failed = 0;
+    for (int k = 0; k < 4; k++) {
+        failed |= headers(iomp, n, hdrlens[k], IOMP_FRAME_BE);
+        failed |= headers(iomp, n, hdrlens[k], IOMP_FRAME_LE);
+    }
+    failed |= delimited(iomp, n, "\n");
+    failed |= delimited(iomp, n, "\r\n");
+    failed |= delimited(iomp, n, "-boundary-12345-");
+    failed |= too_big(iomp);
+    failed |= invalid(iomp);
+    iomp_drop(iomp);
+    return failed;
+}
@@ -0,0 +1,244 @@
+/* Checks how fds are routed to workers: rounds of reads on a few sockets,
+ * the byte sent before the read on some and after it on others, so both
+ * the job and the parked path are taken, must each see all completions of
+ * a socket on one worker, its home, with the sockets spread over more
+ * than one. A read and a write pending on one socket at once must both
+ * complete; and sockets closed after iomp_forget, their numbers reused at
+ * once by new ones, must go on completing reads, edges that came in with
+ * nothing pending included.
+ * Exits non zero on any mismatch; needs a build without IOMP_LOOPBACK.
+ * usage: home [rounds] */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include "iomp.h"
+
+#define THREADS     4
+#define SOCKETS     8
+
+struct conn {
+    struct iomp_aio aio;
+    int fds[2];
+    char byte;
+    int error;
+    /* the worker of the first completion, and how many came elsewhere */
+    pthread_t home;
+    int homed;
+    int strays;
+};
+
+static volatile int ndone = 0;
+
+static void on_read(iomp_aio_t aio, int error) {
+    struct conn* c = (struct conn*)aio;
+    pthread_t self = pthread_self();
+    if (!c->homed) {
+        c->home = self;
+        c->homed = 1;
+    } else if (!pthread_equal(c->home, self)) {
+        c->strays++;
+    }
+    c->error = error;
+    __atomic_add_fetch(&ndone, 1, __ATOMIC_RELEASE);
+}
+
+/* a conn with a write of its own */
+struct duplex {
+    struct conn c;
+    struct iomp_aio wr;
+    int error;
+};
+
+static void on_write(iomp_aio_t aio, int error) {
+    struct duplex* d = (struct duplex*)((char*)aio -
+            offsetof(struct duplex, wr));
+    d->error = error;
+    __atomic_add_fetch(&ndone, 1, __ATOMIC_RELEASE);
+}
+
+static int wait_done(int n) {
+    int waited = 0;
+    while (__atomic_load_n(&ndone, __ATOMIC_ACQUIRE) < n &&
+            waited++ < 100000) {
+        usleep(100);
+    }
+    return ndone == n;
+}
+
+static int conn_open(struct conn* c) {
+    memset(c, 0, sizeof(*c));
+    if (socketpair(AF_LOCAL, SOCK_STREAM, 0, c->fds) != 0) {
+        perror("socketpair");
+        return -1;
+    }
+    fcntl(c->fds[0], F_SETFL, fcntl(c->fds[0], F_GETFL) | O_NONBLOCK);
+    c->aio.fildes = c->fds[0];
+    c->aio.buf = &c->byte;
+    c->aio.nbytes = 1;
+    c->aio.complete = on_read;
+    return 0;
+}
+
+static void conn_close(iomp_t iomp, struct conn* c) {
+    iomp_forget(iomp, c->fds[0]);
+    close(c->fds[0]);
+    close(c->fds[1]);
+}
+
+/* one read per socket per round, the byte sent before or after it */
+static int round_trip(iomp_t iomp, struct conn* cs, int n, int round) {
+    ndone = 0;
+    for (int i = 0; i < n; i++) {
+        int early = (i + round) % 2;
+        if (early) {
+            write(cs[i].fds[1], "r", 1);
+        }
+        cs[i].byte = 0;
+        cs[i].error = -2;
+        iomp_read(iomp, &cs[i].aio);
+        if (!early) {
+            write(cs[i].fds[1], "r", 1);
+        }
+    }
+    int bad = !wait_done(n);
+    for (int i = 0; i < n; i++) {
+        bad += cs[i].error != 0 || cs[i].byte != 'r';
+    }
+    return bad;
+}
+
+static int homes(iomp_t iomp, int rounds) {
+    struct conn cs[SOCKETS];
+    for (int i = 0; i < SOCKETS; i++) {
+        if (conn_open(cs + i) != 0) {
+            return 1;
+        }
+    }
+    int bad = 0;
+    for (int r = 0; r < rounds; r++) {
+        bad += round_trip(iomp, cs, SOCKETS, r);
+    }
+    int strays = 0;
+    int workers = 0;
+    for (int i = 0; i < SOCKETS; i++) {
+        strays += cs[i].strays;
+        int seen = 0;
+        for (int j = 0; j < i; j++) {
+            seen |= pthread_equal(cs[i].home, cs[j].home);
+        }
+        workers += !seen;
+    }
+    int failed = bad || strays || workers < 2;
+    printf("homes: %d sockets on %d workers, %d stray completions, "
+            "%d bad, %s\n", SOCKETS, workers, strays, bad,
+            failed ? "FAIL" : "ok");
+    for (int i = 0; i < SOCKETS; i++) {
+        conn_close(iomp, cs + i);
+    }
+    return failed;
+}
+
+/* a read parked while a write goes out on the same socket */
+static int both_ways(iomp_t iomp) {
+    struct duplex s;
+    if (conn_open(&s.c) != 0) {
+        return 1;
+    }
+    static char out[256 * 1024];
+    memset(&s.wr, 0, sizeof(s.wr));
+    s.wr.fildes = s.c.fds[0];
+    s.wr.buf = out;
+    s.wr.nbytes = sizeof(out);
+    s.wr.complete = on_write;
+    ndone = 0;
+    iomp_read(iomp, &s.c.aio);
+    iomp_write(iomp, &s.wr);
+    /* drains the write, the read must still be waiting */
+    static char in[sizeof(out)];
+    size_t got = 0;
+    while (got < sizeof(out)) {
+        ssize_t len = read(s.c.fds[1], in + got, sizeof(in) - got);
+        if (len <= 0) {
+            break;
+        }
+        got += len;
+    }
+    int write_done = wait_done(1);
+    usleep(10000);
+    int read_early = __atomic_load_n(&ndone, __ATOMIC_ACQUIRE) != 1;
+    write(s.c.fds[1], "b", 1);
+    int bad = !write_done || s.error != 0 || read_early ||
+            got != sizeof(out) || !wait_done(2) || s.c.error != 0 ||
+            s.c.byte != 'b';
+    printf("read and write at once: %zu bytes out, read %s, %s\n", got,
+            read_early ? "came early" : "waited", bad ? "FAIL" : "ok");
+    conn_close(iomp, &s.c);
+    return bad;
+}
+
+/* numbers handed straight back out by the kernel after each close */
+static int reused(iomp_t iomp, int rounds) {
+    int bad = 0;
+    int same = 0;
+    int last = -1;
+    for (int r = 0; r < rounds; r++) {
+        struct conn c;
+        if (conn_open(&c) != 0) {
+            return 1;
+        }
+        same += c.fds[0] == last;
+        last = c.fds[0];
+        /* edges with nothing pending, then a read that must see them */
+        write(c.fds[1], "e", 1);
+        usleep(r % 4 == 0 ? 100 : 0);
+        write(c.fds[1], "e", 1);
+        for (int k = 0; k < 2; k++) {
+            ndone = 0;
+            c.error = -2;
+            iomp_read(iomp, &c.aio);
+            bad += !wait_done(1) || c.error != 0 || c.byte != 'e';
+        }
+        /* and one that parks */
+        ndone = 0;
+        iomp_read(iomp, &c.aio);
+        write(c.fds[1], "p", 1);
+        bad += !wait_done(1) || c.error != 0 || c.byte != 'p';
+        conn_close(iomp, &c);
+    }
+    printf("reused: %d sockets, %d on the previous number, %d bad, %s\n",
+            rounds, same, bad, bad ? "FAIL" : "ok");
+    return bad != 0;
+}
+
+int main(int argc, char* argv[]) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 2000;
+    if (rounds <= 0) {
+        fprintf(stderr, "usage: %s [rounds]\n", argv[0]);
+        return 2;
+    }
+    int probe[2];
+    if (iomp_loopback_pair(probe, 0) == 0) {
+        iomp_loopback_close(probe[0]);
+        iomp_loopback_close(probe[1]);
+        fprintf(stderr, "the reads need kernel sockets, "
+                "build without IOMP_LOOPBACK\n");
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    iomp_t iomp = iomp_new(THREADS);
+    if (!iomp) {
+        return 1;
+    }
+    int failed = homes(iomp, rounds);
+    failed |= both_ways(iomp);
+    failed |= reused(iomp, rounds);
+    iomp_drop(iomp);
+    return failed;
+}
@@ -1,22 +1,46 @@
+#if defined(__linux__)
+#define _GNU_SOURCE /* O_DIRECT */
+#endif /* __linux__ */
+
 #include <stdint.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <limits.h>
 #include <pthread.h>
+#include <poll.h>
+#include <time.h>
 #include <sys/queue.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
 #include <sys/sysctl.h>
 #include "iomp_queue.h"
 #include "iomp.h"
 
+#ifndef IOV_MAX
+#define IOV_MAX 16
+#endif /* IOV_MAX */
+
+#define IOMP_CONTAINER_OF(ptr, type, member) \
+    ((type*)((char*)(ptr) - offsetof(type, member)))
+
 struct iomp_thread {
     TAILQ_ENTRY(iomp_thread) entries;
     iomp_t iomp;
     pthread_t thread;
     iomp_queue_t queue;
+    /* on the blocked list, waiting in its queue */
+    int blocked;
+    /* fd bound jobs of the fds this worker is home to, one FIFO per
+     * priority level picked along with the same level of iomp->jobs */
+    STAILQ_HEAD(, iomp_aiojb) inbox[IOMP_PRIORITY_LEVELS];
+    /* which of the two goes first when both are waiting on a level */
+    int turn;
 };
 typedef struct iomp_thread* iomp_thread_t;
 
@@ -24,30 +48,194 @@ struct iomp_aiojb {
     STAILQ_ENTRY(iomp_aiojb) entries;
     struct iomp_aio* aio;
     void (*execute)(struct iomp_aiojb* job, iomp_thread_t thread);
+    void (*cancel)(struct iomp_aiojb* job);
+    int level;
+    /* what execute parks on the worker queue, -1 if nothing */
+    int fildes;
 };
 typedef struct iomp_aiojb* iomp_aiojb_t;
 
+/* a job posted once its deadline (monotonic ns) passes */
+struct iomp_timer {
+    uint64_t deadline;
+    int index;
+    iomp_aiojb_t job;
+};
+typedef struct iomp_timer* iomp_timer_t;
+
+/* per-fd outbound queue, pending writes are merged into one writev */
+struct iomp_wrq {
+    STAILQ_HEAD(, iomp_aiojb) jobs;
+    struct iomp_aiojb flush;
+    struct iomp_aio ready;
+    iomp_t iomp;
+    iomp_queue_t queue;
+    int busy;
+    /* reposts flush once a pacer has tokens again */
+    struct iomp_timer timer;
+    /* the pacer and rate given to the kernel, until the queue goes idle,
+     * the fd may well be another socket by then */
+    struct iomp_pacer* paced;
+    uint64_t paced_rate;
+};
+typedef struct iomp_wrq* iomp_wrq_t;
+
+/* internal job handing a worker queue to fn */
+struct iomp_djob {
+    struct iomp_aiojb job;
+    void (*fn)(void* arg, iomp_queue_t q);
+    void* arg;
+};
+
+/* user task from iomp_post/iomp_schedule */
+struct iomp_tjob {
+    struct iomp_aiojb job;
+    struct iomp_timer timer;
+    void (*fn)(void* arg, int error);
+    void* arg;
+};
+
+/* connect in progress, ready waits for the socket to turn writable */
+struct iomp_cjob {
+    struct iomp_aio ready;
+    iomp_aio_t aio;
+};
+
+/* one allocation per broadcast: this, the payload, then an aio and an
+ * error per subscriber; every aio points buf at data, which leads back
+ * here */
+struct iomp_bcast {
+    int refs;
+    int n;
+    void (*complete)(void* arg, const int* errors, int n);
+    void* arg;
+    iomp_aio_t aios;
+    int* errors;
+    char data[];
+};
+
+/* blocking offload pool for regular files, kept apart from the event
+ * workers so a slow disk only stalls its own threads */
+struct iomp_fpool {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    STAILQ_HEAD(, iomp_aiojb) jobs;
+    pthread_t* threads;
+    int nthreads;
+    int size;
+    int stop;
+};
+
+/* positional file job, offset in the aio is still the progress */
+struct iomp_fjob {
+    struct iomp_aiojb job;
+    iomp_t iomp;
+    off_t pos;
+    int write;
+};
+
 struct iomp_core {
     pthread_mutex_t lock;
     pthread_cond_t quit;
-    STAILQ_HEAD(, iomp_aiojb) jobs;
+    /* one FIFO per priority level, highest first */
+    STAILQ_HEAD(, iomp_aiojb) jobs[IOMP_PRIORITY_LEVELS];
+    int njobs;
+    int weights[IOMP_PRIORITY_LEVELS];
+    int credits[IOMP_PRIORITY_LEVELS];
+    size_t limit;
+    size_t pending;
     struct iomp_aiojb stop;
     TAILQ_HEAD(, iomp_thread) actived;
     TAILQ_HEAD(, iomp_thread) blocked;
     TAILQ_HEAD(, iomp_thread) zombies;
+    iomp_wrq_t* wrqs;
+    int nwrqs;
+    /* min-heap by deadline, the keeper is the one thread waiting on it */
+    iomp_timer_t* timers;
+    int ntimers;
+    int maxtimers;
+    iomp_thread_t keeper;
+    /* fd % nhomes picks the one worker an fd is ever parked on, so its
+     * registration stays with one backend queue */
+    iomp_thread_t* homes;
+    int nhomes;
+    struct iomp_fpool files;
+    int polled;
+    int polling;
+    int stopped;
 };
 
 static int get_ncpu();
+static uint64_t now_ns();
+
+static iomp_t iomp_create(int nthreads);
+static int run_jobs(iomp_t iomp, iomp_thread_t t);
+
+static int admit(iomp_t iomp, iomp_aio_t aio);
+static void discharge(iomp_t iomp, iomp_aio_t aio);
+static void jobs_push(iomp_t iomp, iomp_aiojb_t job);
+static iomp_aiojb_t jobs_pop(iomp_t iomp, iomp_thread_t t);
+
+static int timer_add(iomp_t iomp, iomp_timer_t timer, uint64_t deadline);
+static void timer_del(iomp_t iomp, iomp_timer_t timer);
+static void timer_swap(iomp_t iomp, int i, int j);
+static void timers_fire(iomp_t iomp);
+static int timers_wait(iomp_t iomp);
+static void timers_cancel(iomp_t iomp);
+
+static size_t pacer_take(struct iomp_pacer* pacer, size_t want,
+        uint64_t* wait);
+static void pacer_refund(struct iomp_pacer* pacer, size_t n);
 
 static iomp_thread_t iomp_thread_new(iomp_t iomp, int nevents);
+static int inbox_ready(iomp_thread_t t);
+static void inbox_cancel(iomp_t iomp);
 static void iomp_thread_drop(iomp_thread_t t);
 static void* iomp_thread_run(void* arg);
 
+static int try_read(iomp_t iomp, iomp_aio_t aio);
+static int try_write(iomp_t iomp, iomp_aio_t aio);
+static int post_read(iomp_t iomp, iomp_aio_t aio);
+static int push_write(iomp_t iomp, iomp_aio_t aio);
+
 static void do_post(iomp_t iomp, iomp_aiojb_t job);
+static void do_post_locked(iomp_t iomp, iomp_aiojb_t job);
 
 static void do_stop(iomp_aiojb_t job, iomp_thread_t thread);
 static void do_read(iomp_aiojb_t job, iomp_thread_t thread);
-static void do_write(iomp_aiojb_t job, iomp_thread_t thread);
+static void do_read_more(iomp_aiojb_t job, iomp_thread_t thread);
+static void do_flush(iomp_aiojb_t job, iomp_thread_t thread);
+static void do_cancel(iomp_aiojb_t job);
+static void do_nothing(iomp_aiojb_t job);
+static void do_defer(iomp_aiojb_t job, iomp_thread_t thread);
+static void do_dcancel(iomp_aiojb_t job);
+static void do_task(iomp_aiojb_t job, iomp_thread_t thread);
+static void do_tcancel(iomp_aiojb_t job);
+static struct iomp_tjob* task_new(void (*fn)(void*, int), void* arg);
+
+static void accept_ready(iomp_aio_t aio, int error);
+static int accept_arm(iomp_t iomp, iomp_aio_t aio);
+static void accept_pause(iomp_acceptor_t acc);
+static void accept_resume(void* arg, int error);
+static void connect_park(void* arg, iomp_queue_t q);
+static void connect_ready(iomp_aio_t aio, int error);
+static void bcast_done(iomp_aio_t aio, int error);
+
+static int post_file(iomp_t iomp, iomp_aio_t aio, off_t pos, int write);
+static void* fpool_run(void* arg);
+static void fpool_stop(iomp_t iomp);
+static void do_file(iomp_aiojb_t job, iomp_thread_t thread);
+static void do_fcancel(iomp_aiojb_t job);
+static int file_io(iomp_aio_t aio, off_t pos, int write);
+#if defined(O_DIRECT)
+static int file_bounce(iomp_aio_t aio, off_t pos, int write);
+#endif /* O_DIRECT */
+
+static iomp_wrq_t wrq_get(iomp_t iomp, int fd);
+static void wrq_flush(iomp_wrq_t q, iomp_queue_t queue);
+static void wrq_abort(iomp_wrq_t q, int error);
+static void wrq_ready(iomp_aio_t aio, int error);
+static void wrq_idle(iomp_t iomp, iomp_wrq_t q);
 
 #define DUMP_THREADS(iomp) \
     do { \
@@ -66,6 +254,20 @@ static void do_write(iomp_aiojb_t job, iomp_thread_t thread);
         IOMP_LOG(DEBUG, ">>>>>>>>>"); \
     } while (0)
 
+/* a polled iomp has no worker threads and takes no locks,
+ * everything runs inside iomp_poll on the caller's thread */
+static inline void iomp_lock(iomp_t iomp) {
+    if (!iomp->polled) {
+        pthread_mutex_lock(&iomp->lock);
+    }
+}
+
+static inline void iomp_unlock(iomp_t iomp) {
+    if (!iomp->polled) {
+        pthread_mutex_unlock(&iomp->lock);
+    }
+}
+
 iomp_t iomp_new(int nthreads) {
     if (nthreads <= 0) {
         nthreads = get_ncpu();
@@ -74,16 +276,50 @@ iomp_t iomp_new(int nthreads) {
         errno = EINVAL;
         return NULL;
     }
+    return iomp_create(nthreads);
+}
+
+iomp_t iomp_new_polled(void) {
+    return iomp_create(0);
+}
+
+iomp_t iomp_create(int nthreads) {
     iomp_t iomp = (iomp_t)malloc(sizeof(*iomp));
     if (!iomp) {
         IOMP_LOG(ERROR, "malloc fail: %s", strerror(errno));
         return NULL;
     }
-    STAILQ_INIT(&iomp->jobs);
+    for (int i = 0; i < IOMP_PRIORITY_LEVELS; i++) {
+        STAILQ_INIT(&iomp->jobs[i]);
+        iomp->weights[i] = 0;
+        iomp->credits[i] = 0;
+    }
+    iomp->njobs = 0;
+    iomp->limit = 0;
+    iomp->pending = 0;
     TAILQ_INIT(&iomp->actived);
     TAILQ_INIT(&iomp->blocked);
     TAILQ_INIT(&iomp->zombies);
+    iomp->wrqs = NULL;
+    iomp->nwrqs = 0;
+    iomp->timers = NULL;
+    iomp->ntimers = 0;
+    iomp->maxtimers = 0;
+    iomp->keeper = NULL;
+    iomp->homes = NULL;
+    iomp->nhomes = 0;
+    STAILQ_INIT(&iomp->files.jobs);
+    iomp->files.threads = NULL;
+    iomp->files.nthreads = 0;
+    iomp->files.size = IOMP_FILE_THREADS;
+    iomp->files.stop = 0;
+    iomp->polled = (nthreads == 0);
+    iomp->polling = 0;
+    iomp->stopped = 0;
     iomp->stop.execute = do_stop;
+    iomp->stop.cancel = do_nothing;
+    iomp->stop.level = 0;
+    iomp->stop.fildes = -1;
     int rv = pthread_mutex_init(&iomp->lock, NULL);
     if (rv != 0) {
         IOMP_LOG(ERROR, "pthread_mutex_init fail: %s", strerror(rv));
@@ -97,14 +333,57 @@ iomp_t iomp_new(int nthreads) {
         free(iomp);
         return NULL;
     }
-    pthread_mutex_lock(&iomp->lock);
+    rv = pthread_mutex_init(&iomp->files.lock, NULL);
+    if (rv != 0) {
+        IOMP_LOG(ERROR, "pthread_mutex_init fail: %s", strerror(rv));
+        pthread_cond_destroy(&iomp->quit);
+        pthread_mutex_destroy(&iomp->lock);
+        free(iomp);
+        return NULL;
+    }
+    rv = pthread_cond_init(&iomp->files.ready, NULL);
+    if (rv != 0) {
+        IOMP_LOG(ERROR, "pthread_cond_init fail: %s", strerror(rv));
+        pthread_mutex_destroy(&iomp->files.lock);
+        pthread_cond_destroy(&iomp->quit);
+        pthread_mutex_destroy(&iomp->lock);
+        free(iomp);
+        return NULL;
+    }
+    if (iomp->polled) {
+        iomp_thread_t t = iomp_thread_new(iomp, IOMP_EVENT_LIMIT);
+        if (!t) {
+            pthread_cond_destroy(&iomp->files.ready);
+            pthread_mutex_destroy(&iomp->files.lock);
+            pthread_cond_destroy(&iomp->quit);
+            pthread_mutex_destroy(&iomp->lock);
+            free(iomp);
+            return NULL;
+        }
+        TAILQ_INSERT_TAIL(&iomp->actived, t, entries);
+        return iomp;
+    }
+    iomp_lock(iomp);
     for (int i = 0; i < nthreads; i++) {
         iomp_thread_t t = iomp_thread_new(iomp, IOMP_EVENT_LIMIT);
         if (t) {
             TAILQ_INSERT_TAIL(&iomp->actived, t, entries);
         }
     }
-    pthread_mutex_unlock(&iomp->lock);
+    /* the workers wait on the lock, nothing is parked yet */
+    iomp->homes = (iomp_thread_t*)malloc(sizeof(*iomp->homes) * nthreads);
+    if (iomp->homes) {
+        iomp_thread_t t = NULL;
+        TAILQ_FOREACH(t, &iomp->actived, entries) {
+            iomp->homes[iomp->nhomes++] = t;
+        }
+        for (int i = 0; i < iomp->nhomes; i++) {
+            iomp_queue_shard(iomp->homes[i]->queue, i, iomp->nhomes);
+        }
+    } else {
+        IOMP_LOG(WARNING, "malloc fail: %s", strerror(errno));
+    }
+    iomp_unlock(iomp);
     return iomp;
 }
 
@@ -112,235 +391,1712 @@ void iomp_drop(iomp_t iomp) {
     if (!iomp) {
         return;
     }
-    do_post(iomp, &iomp->stop);
-    pthread_mutex_lock(&iomp->lock);
-    pthread_cond_wait(&iomp->quit, &iomp->lock);
+    fpool_stop(iomp);
+    if (iomp->polled) {
+        iomp_aiojb_t job = NULL;
+        timers_cancel(iomp);
+        while ((job = jobs_pop(iomp, NULL)) != NULL) {
+            job->cancel(job);
+        }
+        iomp_thread_t t = TAILQ_FIRST(&iomp->actived);
+        TAILQ_REMOVE(&iomp->actived, t, entries);
+        TAILQ_INSERT_TAIL(&iomp->zombies, t, entries);
+    } else {
+        do_post(iomp, &iomp->stop);
+        iomp_lock(iomp);
+        while (!TAILQ_EMPTY(&iomp->actived) || !TAILQ_EMPTY(&iomp->blocked)) {
+            pthread_cond_wait(&iomp->quit, &iomp->lock);
+        }
+        iomp_unlock(iomp);
+    }
+    /* zombies still need the lock on their way out, join them unlocked */
     while (!TAILQ_EMPTY(&iomp->zombies)) {
         iomp_thread_t t = TAILQ_FIRST(&iomp->zombies);
         TAILQ_REMOVE(&iomp->zombies, t, entries);
         iomp_thread_drop(t);
     }
-    pthread_mutex_unlock(&iomp->lock);
+    for (int fd = 0; fd < iomp->nwrqs; fd++) {
+        iomp_wrq_t q = iomp->wrqs[fd];
+        if (q) {
+            wrq_abort(q, -1);
+#if !IOMP_COMPACT
+            free(q);
+#endif /* IOMP_COMPACT */
+        }
+    }
+    free(iomp->wrqs);
+    free(iomp->timers);
+    free(iomp->homes);
+    free(iomp->files.threads);
+    pthread_cond_destroy(&iomp->files.ready);
+    pthread_mutex_destroy(&iomp->files.lock);
     pthread_cond_destroy(&iomp->quit);
     pthread_mutex_destroy(&iomp->lock);
     free(iomp);
 }
 
+int iomp_poll(iomp_t iomp, int timeout) {
+    if (!iomp || !iomp->polled || iomp->polling) {
+        errno = EINVAL;
+        return -1;
+    }
+    iomp_thread_t t = TAILQ_FIRST(&iomp->actived);
+    iomp->polling = 1;
+    timers_fire(iomp);
+    int njobs = run_jobs(iomp, t);
+    if (njobs > 0 || iomp->njobs > 0) {
+        timeout = 0;
+    }
+    int wait = timers_wait(iomp);
+    if (wait >= 0 && (timeout < 0 || wait < timeout)) {
+        timeout = wait;
+    }
+    int rv = iomp_queue_run(t->queue, timeout);
+    if (rv == -1 && errno == EINTR) {
+        rv = 0;
+    }
+    if (rv != -1) {
+        timers_fire(iomp);
+        run_jobs(iomp, t);
+        rv = (rv > 0 || iomp->njobs > 0);
+    }
+    iomp->polling = 0;
+    return rv;
+}
+
+int iomp_run(iomp_t iomp) {
+    if (!iomp || !iomp->polled) {
+        errno = EINVAL;
+        return -1;
+    }
+    while (!__atomic_load_n(&iomp->stopped, __ATOMIC_ACQUIRE)) {
+        if (iomp_poll(iomp, -1) == -1) {
+            return -1;
+        }
+    }
+    __atomic_store_n(&iomp->stopped, 0, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void iomp_stop(iomp_t iomp) {
+    if (!iomp || !iomp->polled) {
+        return;
+    }
+    __atomic_store_n(&iomp->stopped, 1, __ATOMIC_RELEASE);
+    iomp_queue_interrupt(TAILQ_FIRST(&iomp->actived)->queue);
+}
+
+int iomp_fileno(iomp_t iomp) {
+    if (!iomp || !iomp->polled) {
+        errno = EINVAL;
+        return -1;
+    }
+    return iomp_queue_fileno(TAILQ_FIRST(&iomp->actived)->queue);
+}
+
+void iomp_set_limit(iomp_t iomp, size_t limit) {
+    if (!iomp) {
+        return;
+    }
+    __atomic_store_n(&iomp->limit, limit, __ATOMIC_RELAXED);
+}
+
+void iomp_set_weights(iomp_t iomp, int high, int normal, int low) {
+    if (!iomp) {
+        return;
+    }
+    iomp_lock(iomp);
+    iomp->weights[0] = high > 0 ? high : 0;
+    iomp->weights[1] = normal > 0 ? normal : 0;
+    iomp->weights[2] = low > 0 ? low : 0;
+    memcpy(iomp->credits, iomp->weights, sizeof(iomp->credits));
+    iomp_unlock(iomp);
+}
+
 void iomp_read(iomp_t iomp, iomp_aio_t aio) {
-    if (!aio || !aio->complete) {
+    if (!aio || (!aio->complete && !aio->ring)) {
         IOMP_LOG(ERROR, "invalid argument");
         return;
     }
     if (!iomp || !aio->buf) {
-        aio->complete(aio, EINVAL);
+        iomp_complete(aio, EINVAL);
         return;
     }
-    iomp_aiojb_t job = (iomp_aiojb_t)malloc(sizeof(*job));
-    if (!job) {
-        aio->complete(aio, errno);
+    int error = IOMP_CRC_START(aio, 0);
+    if (error != 0) {
+        iomp_complete(aio, error);
         return;
     }
-    job->aio = aio;
+    iomp_trace_submit(aio, IOMP_TRACE_READ);
     aio->offset = 0;
-    job->execute = do_read;
-    do_post(iomp, job);
+    error = admit(iomp, aio);
+    if (error == 0) {
+        error = post_read(iomp, aio);
+    }
+    if (error != 0) {
+        iomp_complete(aio, error);
+    }
 }
 
 void iomp_write(iomp_t iomp, iomp_aio_t aio) {
-    if (!aio || !aio->complete) {
+    if (!aio || (!aio->complete && !aio->ring)) {
         IOMP_LOG(ERROR, "invalid argument");
         return;
     }
     if (!iomp || !aio->buf) {
-        aio->complete(aio, EINVAL);
+        iomp_complete(aio, EINVAL);
         return;
     }
-    iomp_aiojb_t job = (iomp_aiojb_t)malloc(sizeof(*job));
-    if (!job) {
-        aio->complete(aio, errno);
+    int error = IOMP_CRC_START(aio, 1);
+    if (error != 0) {
+        iomp_complete(aio, error);
         return;
     }
-    job->aio = aio;
+    iomp_trace_submit(aio, IOMP_TRACE_WRITE);
     aio->offset = 0;
-    job->execute = do_write;
-    do_post(iomp, job);
+    error = admit(iomp, aio);
+    if (error == 0) {
+        error = push_write(iomp, aio);
+    }
+    if (error != 0) {
+        iomp_complete(aio, error);
+    }
 }
 
-void iomp_accept(iomp_t iomp, iomp_aio_t aio) {
-    if (!aio || !aio->complete) {
+void iomp_pread(iomp_t iomp, iomp_aio_t aio, off_t pos) {
+    if (!aio || (!aio->complete && !aio->ring)) {
         IOMP_LOG(ERROR, "invalid argument");
         return;
     }
-    if (!iomp || aio->buf) {
-        aio->complete(aio, EINVAL);
+    if (!iomp || !aio->buf || pos < 0) {
+        iomp_complete(aio, EINVAL);
         return;
     }
-    pthread_mutex_lock(&iomp->lock);
-    iomp_thread_t t = NULL;
-    TAILQ_FOREACH(t, &iomp->actived, entries) {
-        if (iomp_queue_accept(t->queue, aio) != 0) {
-            int error = errno;
-            pthread_mutex_unlock(&iomp->lock);
-            aio->complete(aio, error);
-            return;
-        }
+    iomp_trace_submit(aio, IOMP_TRACE_PREAD);
+    aio->offset = 0;
+    int error = admit(iomp, aio);
+    if (error == 0) {
+        error = post_file(iomp, aio, pos, 0);
     }
-    TAILQ_FOREACH(t, &iomp->blocked, entries) {
-        if (iomp_queue_accept(t->queue, aio) != 0) {
-            int error = errno;
-            pthread_mutex_unlock(&iomp->lock);
-            aio->complete(aio, error);
-            return;
-        }
+    if (error != 0) {
+        iomp_complete(aio, error);
     }
-    pthread_mutex_unlock(&iomp->lock);
 }
 
-iomp_thread_t iomp_thread_new(iomp_t iomp, int nevents) {
-    iomp_thread_t t = (iomp_thread_t)malloc(sizeof(*t));
-    if (!t) {
-        IOMP_LOG(ERROR, "malloc fail: %s", strerror(errno));
-        return NULL;
+void iomp_pwrite(iomp_t iomp, iomp_aio_t aio, off_t pos) {
+    if (!aio || (!aio->complete && !aio->ring)) {
+        IOMP_LOG(ERROR, "invalid argument");
+        return;
     }
-    t->iomp = iomp;
-    t->queue = iomp_queue_new(nevents);
-    if (!t->queue) {
-        IOMP_LOG(ERROR, "iomp_queue_new fail");
-        free(t);
-        return NULL;
+    if (!iomp || !aio->buf || pos < 0) {
+        iomp_complete(aio, EINVAL);
+        return;
     }
-    int rv = pthread_create(&t->thread, NULL, iomp_thread_run, t);
-    if (rv == -1) {
-        IOMP_LOG(ERROR, "pthread_create fail: %s", strerror(errno));
-        iomp_queue_drop(t->queue);
-        free(t);
-        return NULL;
+    iomp_trace_submit(aio, IOMP_TRACE_PWRITE);
+    aio->offset = 0;
+    int error = admit(iomp, aio);
+    if (error == 0) {
+        error = post_file(iomp, aio, pos, 1);
+    }
+    if (error != 0) {
+        iomp_complete(aio, error);
     }
-    return t;
 }
 
-void iomp_thread_drop(iomp_thread_t t) {
-    if (!t) {
+void iomp_set_file_threads(iomp_t iomp, int nthreads) {
+    if (!iomp) {
         return;
     }
-    pthread_join(t->thread, NULL);
-    iomp_queue_drop(t->queue);
-    free(t);
+    pthread_mutex_lock(&iomp->files.lock);
+    iomp->files.size = nthreads > 0 ? nthreads : IOMP_FILE_THREADS;
+    pthread_mutex_unlock(&iomp->files.lock);
 }
 
-void* iomp_thread_run(void* arg) {
-    iomp_thread_t t = (iomp_thread_t)arg;
-    iomp_t iomp = t->iomp;
-    int stop = 0;
-    pthread_mutex_lock(&iomp->lock);
-    while (!stop) {
-        while (STAILQ_EMPTY(&iomp->jobs)) {
-            TAILQ_REMOVE(&iomp->actived, t, entries);
-            TAILQ_INSERT_TAIL(&iomp->blocked, t, entries);
-            pthread_mutex_unlock(&iomp->lock);
-            iomp_queue_run(t->queue, -1);
-            pthread_mutex_lock(&iomp->lock);
-            TAILQ_REMOVE(&iomp->blocked, t, entries);
-            TAILQ_INSERT_TAIL(&iomp->actived, t, entries);
-        }
-        iomp_aiojb_t job = STAILQ_FIRST(&iomp->jobs);
-        STAILQ_REMOVE_HEAD(&iomp->jobs, entries);
-        pthread_mutex_unlock(&iomp->lock);
-        job->execute(job, t);
-        if (job == &iomp->stop) {
-            stop = 1;
-        }
-        pthread_mutex_lock(&iomp->lock);
+void* iomp_file_alloc(size_t size) {
+    void* buf = NULL;
+    int rv = posix_memalign(&buf, IOMP_FILE_ALIGN, size > 0 ? size : 1);
+    if (rv != 0) {
+        errno = rv;
+        return NULL;
     }
-    pthread_mutex_unlock(&iomp->lock);
-    return NULL;
+    return buf;
 }
 
-void do_post(iomp_t iomp, iomp_aiojb_t job) {
-    pthread_mutex_lock(&iomp->lock);
-    STAILQ_INSERT_TAIL(&iomp->jobs, job, entries);
-    if (TAILQ_EMPTY(&iomp->actived)) {
-        iomp_thread_t t = TAILQ_FIRST(&iomp->blocked);
-        iomp_queue_interrupt(t->queue);
+void iomp_file_free(void* buf) {
+    free(buf);
+}
+
+int iomp_try_read(iomp_t iomp, iomp_aio_t aio) {
+    if (!iomp || !aio || (!aio->complete && !aio->ring) || !aio->buf) {
+        return EINVAL;
     }
-    pthread_mutex_unlock(&iomp->lock);
+    int rv = IOMP_CRC_START(aio, 0);
+    if (rv != 0) {
+        return rv;
+    }
+    iomp_trace_submit(aio, IOMP_TRACE_READ);
+    rv = try_read(iomp, aio);
+    if (rv != EINPROGRESS) {
+        iomp_trace_complete(aio, rv);
+    }
+    return rv;
 }
 
-void do_stop(iomp_aiojb_t job, iomp_thread_t thread) {
-    iomp_t iomp = thread->iomp;
-    pthread_mutex_lock(&iomp->lock);
-    TAILQ_REMOVE(&thread->iomp->actived, thread, entries);
-    TAILQ_INSERT_TAIL(&thread->iomp->zombies, thread, entries);
-    if (TAILQ_EMPTY(&iomp->actived)) {
-        iomp_thread_t t = TAILQ_FIRST(&iomp->blocked);
-        if (t) {
-            STAILQ_INSERT_TAIL(&iomp->jobs, job, entries);
-            iomp_queue_interrupt(t->queue);
-        } else {
-            while (!STAILQ_EMPTY(&iomp->jobs)) {
-                iomp_aiojb_t job = STAILQ_FIRST(&iomp->jobs);
-                STAILQ_REMOVE_HEAD(&iomp->jobs, entries);
-                job->aio->complete(job->aio, -1);
-                free(job);
-            }
-            pthread_cond_signal(&iomp->quit);
-        }
-    } else {
-        STAILQ_INSERT_TAIL(&iomp->jobs, job, entries);
+int iomp_try_write(iomp_t iomp, iomp_aio_t aio) {
+    if (!iomp || !aio || (!aio->complete && !aio->ring) || !aio->buf) {
+        return EINVAL;
+    }
+    int rv = IOMP_CRC_START(aio, 1);
+    if (rv != 0) {
+        return rv;
+    }
+    iomp_trace_submit(aio, IOMP_TRACE_WRITE);
+    rv = try_write(iomp, aio);
+    if (rv != EINPROGRESS) {
+        iomp_trace_complete(aio, rv);
     }
-    pthread_mutex_unlock(&iomp->lock);
+    return rv;
 }
 
-void do_read(iomp_aiojb_t job, iomp_thread_t thread) {
-    iomp_aio_t aio = job->aio;
-    while (1) {
+int try_read(iomp_t iomp, iomp_aio_t aio) {
+    int error = admit(iomp, aio);
+    if (error != 0) {
+        return error;
+    }
+    aio->offset = 0;
+    while (aio->offset < aio->nbytes) {
         size_t todo = aio->nbytes - aio->offset;
-        ssize_t len = read(aio->fildes, aio->buf + aio->offset, todo);
+        ssize_t len = IOMP_READ(aio->fildes, aio->buf + aio->offset, todo);
         if (len > 0) {
+            IOMP_CRC_FEED(aio, aio->buf + aio->offset, len);
             aio->offset += len;
-            if (len == todo) {
-                free(job);
-                aio->complete(aio, 0);
-                break;
-            }
         } else if (len == -1 && errno == EAGAIN) {
-            free(job);
-            if (iomp_queue_read(thread->queue, aio) == -1) {
-                aio->complete(aio, errno);
-            }
-            break;
+            error = post_read(iomp, aio);
+            return error != 0 ? error : EINPROGRESS;
         } else {
-            free(job);
-            aio->complete(aio, (len == -1 ? errno : -1));
-            break;
+            discharge(iomp, aio);
+            return len == -1 ? errno : -1;
         }
     }
+    discharge(iomp, aio);
+    return IOMP_CRC_CHECK(aio);
 }
 
-void do_write(iomp_aiojb_t job, iomp_thread_t thread) {
-    iomp_aio_t aio = job->aio;
-    while (1) {
+int try_write(iomp_t iomp, iomp_aio_t aio) {
+    int error = admit(iomp, aio);
+    if (error != 0) {
+        return error;
+    }
+    aio->offset = 0;
+    iomp_lock(iomp);
+    iomp_wrq_t q = wrq_get(iomp, aio->fildes);
+    if (!q) {
+        error = errno;
+        iomp_unlock(iomp);
+        discharge(iomp, aio);
+        return error;
+    }
+    if (q->busy || aio->pacer) {
+        /* earlier writes are still queued, keep the byte order; a paced
+         * one waits for its tokens in wrq_flush */
+        iomp_unlock(iomp);
+        error = push_write(iomp, aio);
+        return error != 0 ? error : EINPROGRESS;
+    }
+    q->busy = 1;
+    iomp_unlock(iomp);
+    int rv = 0;
+    while (aio->offset < aio->nbytes) {
         size_t todo = aio->nbytes - aio->offset;
-        ssize_t len = write(aio->fildes, aio->buf + aio->offset, todo);
+        ssize_t len = IOMP_WRITE(aio->fildes, aio->buf + aio->offset, todo);
         if (len > 0) {
             aio->offset += len;
-            if (len == todo) {
-                free(job);
-                aio->complete(aio, 0);
-                break;
-            }
         } else if (len == -1 && errno == EAGAIN) {
-            free(job);
-            if (iomp_queue_write(thread->queue, aio) == -1) {
-                aio->complete(aio, errno);
-            }
+            rv = EINPROGRESS;
             break;
         } else {
-            free(job);
-            aio->complete(aio, (len == -1 ? errno : -1));
+            rv = (len == -1 ? errno : -1);
             break;
         }
     }
+    iomp_aiojb_t job = NULL;
+    if (rv == EINPROGRESS) {
+        job = (iomp_aiojb_t)malloc(sizeof(*job));
+        if (!job) {
+            rv = errno;
+        }
+    }
+    if (!job) {
+        discharge(iomp, aio);
+    }
+    iomp_lock(iomp);
+    if (job) {
+        job->aio = aio;
+        job->execute = NULL;
+        job->cancel = do_cancel;
+        job->level = IOMP_PRIORITY_LEVEL(aio->priority);
+        job->fildes = aio->fildes;
+        STAILQ_INSERT_HEAD(&q->jobs, job, entries);
+    }
+    if (STAILQ_EMPTY(&q->jobs)) {
+        wrq_idle(iomp, q);
+    } else {
+        q->flush.level = STAILQ_FIRST(&q->jobs)->level;
+        do_post_locked(iomp, &q->flush);
+    }
+    iomp_unlock(iomp);
+    return rv;
+}
+
+void iomp_forget(iomp_t iomp, int fd) {
+    if (!iomp || fd < 0) {
+        return;
+    }
+    if (iomp->nhomes > 0) {
+        iomp_queue_forget(iomp->homes[fd % iomp->nhomes]->queue, fd);
+        return;
+    }
+    /* polled, or no homes and any worker may have parked it */
+    iomp_lock(iomp);
+    iomp_thread_t t = NULL;
+    TAILQ_FOREACH(t, &iomp->actived, entries) {
+        iomp_queue_forget(t->queue, fd);
+    }
+    TAILQ_FOREACH(t, &iomp->blocked, entries) {
+        iomp_queue_forget(t->queue, fd);
+    }
+    iomp_unlock(iomp);
+}
+
+void iomp_accept(iomp_t iomp, iomp_aio_t aio) {
+    if (!aio || (!aio->complete && !aio->ring)) {
+        IOMP_LOG(ERROR, "invalid argument");
+        return;
+    }
+    if (!iomp || aio->buf) {
+        iomp_complete(aio, EINVAL);
+        return;
+    }
+    iomp_trace_submit(aio, IOMP_TRACE_ACCEPT);
+    int error = accept_arm(iomp, aio);
+    if (error != 0) {
+        iomp_complete(aio, error);
+    }
+}
+
+void iomp_accept_multishot(iomp_t iomp, iomp_acceptor_t acc) {
+    if (!acc || !acc->aio.complete) {
+        IOMP_LOG(ERROR, "invalid argument");
+        return;
+    }
+    acc->fd = -1;
+    if (!iomp || acc->aio.buf || acc->aio.ring ||
+            (acc->nopts > 0 && !acc->opts)) {
+        iomp_complete(&acc->aio, EINVAL);
+        return;
+    }
+    memset(&acc->listen, 0, sizeof(acc->listen));
+    acc->listen.fildes = acc->aio.fildes;
+    acc->listen.complete = accept_ready;
+    acc->busy = 0;
+    acc->iomp = iomp;
+    iomp_accept(iomp, &acc->listen);
+}
+
+void iomp_connect(iomp_t iomp, iomp_aio_t aio,
+        const struct sockaddr* addr, socklen_t addrlen) {
+    if (!aio || (!aio->complete && !aio->ring)) {
+        IOMP_LOG(ERROR, "invalid argument");
+        return;
+    }
+    if (!iomp || !addr) {
+        iomp_complete(aio, EINVAL);
+        return;
+    }
+    int rv = connect(aio->fildes, addr, addrlen);
+    if (rv == -1 && errno == EINTR) {
+        /* the attempt goes on in the background, poll it like any other */
+        errno = EINPROGRESS;
+    }
+    if (rv == 0) {
+        iomp_complete(aio, 0);
+        return;
+    }
+    if (errno != EINPROGRESS) {
+        iomp_complete(aio, errno);
+        return;
+    }
+    struct iomp_cjob* cj = (struct iomp_cjob*)malloc(sizeof(*cj));
+    if (!cj) {
+        iomp_complete(aio, errno);
+        return;
+    }
+    memset(&cj->ready, 0, sizeof(cj->ready));
+    cj->ready.fildes = aio->fildes;
+    cj->ready.buf = cj; /* never touched, nbytes is 0 */
+    cj->ready.complete = connect_ready;
+    cj->ready.priority = aio->priority;
+    cj->aio = aio;
+    int error = iomp_defer(iomp, aio->fildes, aio->priority, connect_park, cj);
+    if (error != 0) {
+        free(cj);
+        iomp_complete(aio, error);
+    }
+}
+
+int iomp_broadcast(iomp_t iomp, const int* fds, int n, const void* buf,
+        size_t len, void (*complete)(void* arg, const int* errors, int n),
+        void* arg) {
+    if (!iomp || n <= 0 || !fds || !buf || len == 0 || !complete) {
+        return EINVAL;
+    }
+#if IOMP_COMPACT
+    if (len > UINT32_MAX) {
+        return EINVAL;
+    }
+#endif /* IOMP_COMPACT */
+    size_t head = sizeof(struct iomp_bcast) + len;
+    head = (head + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+    if ((SIZE_MAX - head) / (sizeof(struct iomp_aio) + sizeof(int)) <
+            (size_t)n) {
+        return ENOMEM;
+    }
+    struct iomp_bcast* b = (struct iomp_bcast*)malloc(
+            head + (sizeof(struct iomp_aio) + sizeof(int)) * n);
+    if (!b) {
+        return errno;
+    }
+    b->refs = n;
+    b->n = n;
+    b->complete = complete;
+    b->arg = arg;
+    b->aios = (iomp_aio_t)((char*)b + head);
+    b->errors = (int*)(b->aios + n);
+    memcpy(b->data, buf, len);
+    memset(b->aios, 0, sizeof(struct iomp_aio) * n);
+    for (int i = 0; i < n; i++) {
+        iomp_aio_t aio = b->aios + i;
+        aio->fildes = fds[i];
+        aio->buf = b->data;
+        aio->nbytes = len;
+        aio->complete = bcast_done;
+    }
+    /* each goes through the write queue of its fd, so it keeps its place
+     * among other writes there and moves on from whichever worker the fd
+     * gets flushed on */
+    for (int i = 0; i < n; i++) {
+        iomp_write(iomp, b->aios + i);
+    }
+    return 0;
+}
+
+int post_read(iomp_t iomp, iomp_aio_t aio) {
+    iomp_aiojb_t job = (iomp_aiojb_t)malloc(sizeof(*job));
+    if (!job) {
+        int error = errno;
+        discharge(iomp, aio);
+        return error;
+    }
+    job->aio = aio;
+    job->execute = do_read;
+    job->cancel = do_cancel;
+    job->level = IOMP_PRIORITY_LEVEL(aio->priority);
+    job->fildes = aio->fildes;
+    do_post(iomp, job);
+    return 0;
+}
+
+int push_write(iomp_t iomp, iomp_aio_t aio) {
+    iomp_aiojb_t job = (iomp_aiojb_t)malloc(sizeof(*job));
+    if (!job) {
+        int error = errno;
+        discharge(iomp, aio);
+        return error;
+    }
+    job->aio = aio;
+    job->execute = NULL;
+    job->cancel = do_cancel;
+    job->level = IOMP_PRIORITY_LEVEL(aio->priority);
+    job->fildes = aio->fildes;
+    iomp_lock(iomp);
+    iomp_wrq_t q = wrq_get(iomp, aio->fildes);
+    if (!q) {
+        int error = errno;
+        iomp_unlock(iomp);
+        free(job);
+        discharge(iomp, aio);
+        return error;
+    }
+    STAILQ_INSERT_TAIL(&q->jobs, job, entries);
+    if (!q->busy) {
+        q->busy = 1;
+        q->flush.level = job->level;
+        do_post_locked(iomp, &q->flush);
+    }
+    iomp_unlock(iomp);
+    return 0;
+}
+
+void accept_ready(iomp_aio_t aio, int error) {
+    iomp_acceptor_t acc = IOMP_CONTAINER_OF(aio, struct iomp_acceptor, listen);
+    if (error != 0) {
+        acc->fd = -1;
+        iomp_complete(&acc->aio, error);
+        return;
+    }
+    /* every worker queue watches the listener, one of them drains it */
+    if (__atomic_exchange_n(&acc->busy, 1, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    for (int i = 0; i < IOMP_ACCEPT_BATCH; i++) {
+        acc->peerlen = sizeof(acc->peer);
+#if defined(__linux__) || defined(__FreeBSD__)
+        int fd = accept4(acc->aio.fildes, (struct sockaddr*)&acc->peer,
+                &acc->peerlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+        int fd = accept(acc->aio.fildes, (struct sockaddr*)&acc->peer,
+                &acc->peerlen);
+        if (fd != -1) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+            fcntl(fd, F_SETFD, fcntl(fd, F_GETFD, 0) | FD_CLOEXEC);
+        }
+#endif
+        if (fd == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            if (errno == ECONNABORTED || errno == EINTR) {
+                continue;
+            }
+            int error = errno;
+            acc->fd = -1;
+            if (error == EMFILE || error == ENFILE) {
+                /* the listener stays readable and would wake every
+                 * worker over and over, busy stays set until resumed */
+                accept_pause(acc);
+                iomp_complete(&acc->aio, error);
+                return;
+            }
+            iomp_complete(&acc->aio, error);
+            break;
+        }
+        for (int j = 0; j < acc->nopts; j++) {
+            const struct iomp_sockopt* opt = acc->opts + j;
+            if (setsockopt(fd, opt->level, opt->name,
+                    &opt->value, sizeof(opt->value)) == -1) {
+                IOMP_LOG(WARNING, "setsockopt fail: %s", strerror(errno));
+            }
+        }
+        acc->fd = fd;
+        iomp_complete(&acc->aio, 0);
+    }
+    __atomic_store_n(&acc->busy, 0, __ATOMIC_RELEASE);
+}
+
+/* watches the listener on every worker queue */
+int accept_arm(iomp_t iomp, iomp_aio_t aio) {
+    iomp_lock(iomp);
+    iomp_thread_t t = NULL;
+    TAILQ_FOREACH(t, &iomp->actived, entries) {
+        if (iomp_queue_accept(t->queue, aio) != 0) {
+            int error = errno;
+            iomp_unlock(iomp);
+            return error;
+        }
+    }
+    TAILQ_FOREACH(t, &iomp->blocked, entries) {
+        if (iomp_queue_accept(t->queue, aio) != 0) {
+            int error = errno;
+            iomp_unlock(iomp);
+            return error;
+        }
+    }
+    iomp_unlock(iomp);
+    return 0;
+}
+
+void accept_pause(iomp_acceptor_t acc) {
+    iomp_t iomp = acc->iomp;
+    iomp_lock(iomp);
+    iomp_thread_t t = NULL;
+    TAILQ_FOREACH(t, &iomp->actived, entries) {
+        iomp_queue_unaccept(t->queue, &acc->listen);
+    }
+    TAILQ_FOREACH(t, &iomp->blocked, entries) {
+        iomp_queue_unaccept(t->queue, &acc->listen);
+    }
+    iomp_unlock(iomp);
+    iomp_schedule(iomp, IOMP_ACCEPT_BACKOFF, accept_resume, acc);
+}
+
+void accept_resume(void* arg, int error) {
+    iomp_acceptor_t acc = (iomp_acceptor_t)arg;
+    if (error != 0) {
+        /* iomp is going away */
+        return;
+    }
+    __atomic_store_n(&acc->busy, 0, __ATOMIC_RELEASE);
+    error = accept_arm(acc->iomp, &acc->listen);
+    if (error != 0) {
+        acc->fd = -1;
+        iomp_complete(&acc->aio, error);
+    }
+}
+
+void connect_park(void* arg, iomp_queue_t q) {
+    struct iomp_cjob* cj = (struct iomp_cjob*)arg;
+    if (!q) {
+        iomp_aio_t aio = cj->aio;
+        free(cj);
+        iomp_complete(aio, -1);
+        return;
+    }
+    /* nbytes 0, completes once the socket turns writable */
+    if (iomp_queue_write(q, &cj->ready) != 0) {
+        int error = errno;
+        iomp_aio_t aio = cj->aio;
+        free(cj);
+        iomp_complete(aio, error);
+    }
+}
+
+void connect_ready(iomp_aio_t aio, int error) {
+    struct iomp_cjob* cj = IOMP_CONTAINER_OF(aio, struct iomp_cjob, ready);
+    iomp_aio_t user = cj->aio;
+    free(cj);
+    if (error == 0) {
+        socklen_t len = sizeof(error);
+        if (getsockopt(user->fildes, SOL_SOCKET, SO_ERROR, &error, &len) == -1) {
+            error = errno;
+        }
+    }
+    iomp_complete(user, error);
+}
+
+void bcast_done(iomp_aio_t aio, int error) {
+    struct iomp_bcast* b = IOMP_CONTAINER_OF(aio->buf, struct iomp_bcast,
+            data);
+    b->errors[aio - b->aios] = error;
+    if (__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        b->complete(b->arg, b->errors, b->n);
+        free(b);
+    }
+}
+
+int post_file(iomp_t iomp, iomp_aio_t aio, off_t pos, int write) {
+    struct iomp_fjob* fjob = (struct iomp_fjob*)malloc(sizeof(*fjob));
+    if (!fjob) {
+        int error = errno;
+        discharge(iomp, aio);
+        return error;
+    }
+    fjob->job.aio = aio;
+    fjob->job.execute = do_file;
+    fjob->job.cancel = do_fcancel;
+    fjob->job.level = IOMP_PRIORITY_LEVEL(aio->priority);
+    fjob->job.fildes = -1;
+    fjob->iomp = iomp;
+    fjob->pos = pos;
+    fjob->write = write;
+    if (iomp->polled) {
+        /* no threads to offload to, it runs inside iomp_poll */
+        do_post(iomp, &fjob->job);
+        return 0;
+    }
+    struct iomp_fpool* pool = &iomp->files;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->stop) {
+        pthread_mutex_unlock(&pool->lock);
+        free(fjob);
+        discharge(iomp, aio);
+        return -1;
+    }
+    /* started on first use and grown up to size */
+    if (pool->nthreads < pool->size) {
+        pthread_t* threads = (pthread_t*)realloc(pool->threads,
+                sizeof(*threads) * pool->size);
+        if (threads) {
+            pool->threads = threads;
+            while (pool->nthreads < pool->size) {
+                int rv = pthread_create(threads + pool->nthreads, NULL,
+                        fpool_run, iomp);
+                if (rv != 0) {
+                    IOMP_LOG(ERROR, "pthread_create fail: %s", strerror(rv));
+                    break;
+                }
+                pool->nthreads++;
+            }
+        } else {
+            IOMP_LOG(ERROR, "realloc fail: %s", strerror(errno));
+        }
+        if (pool->nthreads == 0) {
+            pthread_mutex_unlock(&pool->lock);
+            free(fjob);
+            discharge(iomp, aio);
+            return EAGAIN;
+        }
+    }
+    STAILQ_INSERT_TAIL(&pool->jobs, &fjob->job, entries);
+    pthread_cond_signal(&pool->ready);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+void* fpool_run(void* arg) {
+    iomp_t iomp = (iomp_t)arg;
+    struct iomp_fpool* pool = &iomp->files;
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (STAILQ_EMPTY(&pool->jobs) && !pool->stop) {
+            pthread_cond_wait(&pool->ready, &pool->lock);
+        }
+        if (pool->stop) {
+            break;
+        }
+        iomp_aiojb_t job = STAILQ_FIRST(&pool->jobs);
+        STAILQ_REMOVE_HEAD(&pool->jobs, entries);
+        pthread_mutex_unlock(&pool->lock);
+        job->execute(job, NULL);
+        pthread_mutex_lock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+void fpool_stop(iomp_t iomp) {
+    struct iomp_fpool* pool = &iomp->files;
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->ready);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->nthreads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pool->nthreads = 0;
+    pthread_mutex_lock(&pool->lock);
+    while (!STAILQ_EMPTY(&pool->jobs)) {
+        iomp_aiojb_t job = STAILQ_FIRST(&pool->jobs);
+        STAILQ_REMOVE_HEAD(&pool->jobs, entries);
+        pthread_mutex_unlock(&pool->lock);
+        job->cancel(job);
+        pthread_mutex_lock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+int iomp_defer(iomp_t iomp, int fildes, int priority,
+        void (*fn)(void* arg, iomp_queue_t q), void* arg) {
+    struct iomp_djob* djob = (struct iomp_djob*)malloc(sizeof(*djob));
+    if (!djob) {
+        return errno;
+    }
+    djob->job.aio = NULL;
+    djob->job.execute = do_defer;
+    djob->job.cancel = do_dcancel;
+    djob->job.level = IOMP_PRIORITY_LEVEL(priority);
+    djob->job.fildes = fildes;
+    djob->fn = fn;
+    djob->arg = arg;
+    do_post(iomp, &djob->job);
+    return 0;
+}
+
+void iomp_post(iomp_t iomp, void (*fn)(void* arg, int error), void* arg) {
+    if (!iomp || !fn) {
+        IOMP_LOG(ERROR, "invalid argument");
+        return;
+    }
+    struct iomp_tjob* tjob = task_new(fn, arg);
+    if (!tjob) {
+        fn(arg, ENOMEM);
+        return;
+    }
+    do_post(iomp, &tjob->job);
+}
+
+void iomp_schedule(iomp_t iomp, int delay_ms,
+        void (*fn)(void* arg, int error), void* arg) {
+    if (!iomp || !fn) {
+        IOMP_LOG(ERROR, "invalid argument");
+        return;
+    }
+    if (delay_ms <= 0) {
+        iomp_post(iomp, fn, arg);
+        return;
+    }
+    struct iomp_tjob* tjob = task_new(fn, arg);
+    if (!tjob) {
+        fn(arg, ENOMEM);
+        return;
+    }
+    uint64_t deadline = now_ns() + (uint64_t)delay_ms * 1000000;
+    iomp_lock(iomp);
+    int error = timer_add(iomp, &tjob->timer, deadline);
+    iomp_unlock(iomp);
+    if (error != 0) {
+        free(tjob);
+        fn(arg, error);
+    }
+}
+
+struct iomp_tjob* task_new(void (*fn)(void*, int), void* arg) {
+    struct iomp_tjob* tjob = (struct iomp_tjob*)malloc(sizeof(*tjob));
+    if (!tjob) {
+        IOMP_LOG(ERROR, "malloc fail: %s", strerror(errno));
+        return NULL;
+    }
+    tjob->job.aio = NULL;
+    tjob->job.execute = do_task;
+    tjob->job.cancel = do_tcancel;
+    tjob->job.level = IOMP_PRIORITY_LEVEL(IOMP_PRIORITY_NORMAL);
+    tjob->job.fildes = -1;
+    tjob->timer.index = -1;
+    tjob->timer.job = &tjob->job;
+    tjob->fn = fn;
+    tjob->arg = arg;
+    return tjob;
+}
+
+int run_jobs(iomp_t iomp, iomp_thread_t t) {
+    /* only what is queued now, jobs posted meanwhile wait for the next round */
+    int njobs = iomp->njobs;
+    for (int i = 0; i < njobs; i++) {
+        iomp_aiojb_t job = jobs_pop(iomp, NULL);
+        job->execute(job, t);
+    }
+    return njobs;
+}
+
+int admit(iomp_t iomp, iomp_aio_t aio) {
+    if (aio->priority >= IOMP_PRIORITY_HIGH) {
+        return 0;
+    }
+    size_t limit = __atomic_load_n(&iomp->limit, __ATOMIC_RELAXED);
+    size_t pending = __atomic_add_fetch(&iomp->pending, 1, __ATOMIC_RELAXED);
+    if (limit > 0 && pending > limit) {
+        __atomic_sub_fetch(&iomp->pending, 1, __ATOMIC_RELAXED);
+        return EBUSY;
+    }
+    return 0;
+}
+
+void discharge(iomp_t iomp, iomp_aio_t aio) {
+    if (aio->priority < IOMP_PRIORITY_HIGH) {
+        __atomic_sub_fetch(&iomp->pending, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void jobs_push(iomp_t iomp, iomp_aiojb_t job) {
+    STAILQ_INSERT_TAIL(&iomp->jobs[job->level], job, entries);
+    iomp->njobs++;
+}
+
+/* locked, t may be NULL to leave every inbox alone */
+iomp_aiojb_t jobs_pop(iomp_t iomp, iomp_thread_t t) {
+    if (iomp->njobs == 0 && (!t || !inbox_ready(t))) {
+        return NULL;
+    }
+    /* strict priority by default, levels with a weight only get that
+     * many picks per round while any other level is waiting; the inbox
+     * of t shares the level with the shared FIFO, taking turns */
+    while (1) {
+        for (int i = 0; i < IOMP_PRIORITY_LEVELS; i++) {
+            int shared = !STAILQ_EMPTY(&iomp->jobs[i]);
+            int own = t && !STAILQ_EMPTY(&t->inbox[i]);
+            if (!shared && !own) {
+                continue;
+            }
+            if (iomp->weights[i] > 0) {
+                if (iomp->credits[i] == 0) {
+                    continue;
+                }
+                iomp->credits[i]--;
+            }
+            if (own && (!shared || t->turn)) {
+                t->turn = 0;
+                iomp_aiojb_t job = STAILQ_FIRST(&t->inbox[i]);
+                STAILQ_REMOVE_HEAD(&t->inbox[i], entries);
+                return job;
+            }
+            if (t) {
+                t->turn = 1;
+            }
+            iomp_aiojb_t job = STAILQ_FIRST(&iomp->jobs[i]);
+            STAILQ_REMOVE_HEAD(&iomp->jobs[i], entries);
+            iomp->njobs--;
+            return job;
+        }
+        memcpy(iomp->credits, iomp->weights, sizeof(iomp->credits));
+    }
+}
+
+void iomp_pacer_init(struct iomp_pacer* pacer, uint64_t rate, size_t burst,
+        int flags) {
+    if (!pacer) {
+        return;
+    }
+    if (burst == 0) {
+        /* 10ms worth */
+        burst = rate / 100 > 0 ? rate / 100 : 1;
+    }
+    pacer->rate = rate;
+    pacer->burst = burst;
+    pacer->flags = flags;
+    pacer->lock = 0;
+    pacer->tokens = burst;
+    pacer->stamp = now_ns();
+}
+
+/* token bucket, returns how many of want may go now; if none, wait is
+ * set to the ns until min(want, burst) tokens are back */
+size_t pacer_take(struct iomp_pacer* pacer, size_t want, uint64_t* wait) {
+    if (pacer->rate == 0) {
+        return want;
+    }
+    uint64_t now = now_ns();
+    while (__atomic_exchange_n(&pacer->lock, 1, __ATOMIC_ACQUIRE)) {
+    }
+    if (now > pacer->stamp) {
+        pacer->tokens += (double)(now - pacer->stamp) * pacer->rate / 1e9;
+        if (pacer->tokens > pacer->burst) {
+            pacer->tokens = pacer->burst;
+        }
+        pacer->stamp = now;
+    }
+    size_t n = 0;
+    if (pacer->tokens >= 1) {
+        n = want < pacer->tokens ? want : (size_t)pacer->tokens;
+        pacer->tokens -= n;
+    } else {
+        size_t need = want < pacer->burst ? want : pacer->burst;
+        *wait = (uint64_t)((need - pacer->tokens) * 1e9 / pacer->rate) + 1;
+    }
+    __atomic_store_n(&pacer->lock, 0, __ATOMIC_RELEASE);
+    return n;
+}
+
+void pacer_refund(struct iomp_pacer* pacer, size_t n) {
+    if (pacer->rate == 0 || n == 0) {
+        return;
+    }
+    while (__atomic_exchange_n(&pacer->lock, 1, __ATOMIC_ACQUIRE)) {
+    }
+    pacer->tokens += n;
+    if (pacer->tokens > pacer->burst) {
+        pacer->tokens = pacer->burst;
+    }
+    __atomic_store_n(&pacer->lock, 0, __ATOMIC_RELEASE);
+}
+
+/* timers are kept under the iomp lock */
+int timer_add(iomp_t iomp, iomp_timer_t timer, uint64_t deadline) {
+    if (iomp->ntimers == iomp->maxtimers) {
+        int n = iomp->maxtimers > 0 ? iomp->maxtimers * 2 : 64;
+        iomp_timer_t* timers = (iomp_timer_t*)realloc(iomp->timers,
+                sizeof(*timers) * n);
+        if (!timers) {
+            IOMP_LOG(ERROR, "realloc fail: %s", strerror(errno));
+            return ENOMEM;
+        }
+        iomp->timers = timers;
+        iomp->maxtimers = n;
+    }
+    timer->deadline = deadline;
+    timer->index = iomp->ntimers;
+    iomp->timers[iomp->ntimers++] = timer;
+    int i = timer->index;
+    while (i > 0 && iomp->timers[(i - 1) / 2]->deadline > deadline) {
+        timer_swap(iomp, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    if (i == 0) {
+        /* new earliest deadline, whoever waits has to recompute */
+        if (iomp->polled) {
+            if (!iomp->polling) {
+                iomp_queue_interrupt(TAILQ_FIRST(&iomp->actived)->queue);
+            }
+        } else if (iomp->keeper) {
+            iomp_queue_interrupt(iomp->keeper->queue);
+        } else if (!TAILQ_EMPTY(&iomp->blocked)) {
+            iomp_queue_interrupt(TAILQ_FIRST(&iomp->blocked)->queue);
+        }
+    }
+    return 0;
+}
+
+void timer_del(iomp_t iomp, iomp_timer_t timer) {
+    int i = timer->index;
+    int last = --iomp->ntimers;
+    if (i != last) {
+        timer_swap(iomp, i, last);
+        while (i > 0 && iomp->timers[(i - 1) / 2]->deadline >
+                iomp->timers[i]->deadline) {
+            timer_swap(iomp, i, (i - 1) / 2);
+            i = (i - 1) / 2;
+        }
+        while (1) {
+            int l = i * 2 + 1;
+            int r = l + 1;
+            int m = i;
+            if (l < last && iomp->timers[l]->deadline < iomp->timers[m]->deadline) {
+                m = l;
+            }
+            if (r < last && iomp->timers[r]->deadline < iomp->timers[m]->deadline) {
+                m = r;
+            }
+            if (m == i) {
+                break;
+            }
+            timer_swap(iomp, i, m);
+            i = m;
+        }
+    }
+    timer->index = -1;
+}
+
+void timer_swap(iomp_t iomp, int i, int j) {
+    iomp_timer_t t = iomp->timers[i];
+    iomp->timers[i] = iomp->timers[j];
+    iomp->timers[j] = t;
+    iomp->timers[i]->index = i;
+    iomp->timers[j]->index = j;
+}
+
+void timers_fire(iomp_t iomp) {
+    if (iomp->ntimers == 0) {
+        return;
+    }
+    uint64_t now = now_ns();
+    while (iomp->ntimers > 0 && iomp->timers[0]->deadline <= now) {
+        iomp_timer_t timer = iomp->timers[0];
+        timer_del(iomp, timer);
+        do_post_locked(iomp, timer->job);
+    }
+}
+
+/* ms until the earliest deadline, rounded up, -1 if there is none */
+int timers_wait(iomp_t iomp) {
+    if (iomp->ntimers == 0) {
+        return -1;
+    }
+    uint64_t now = now_ns();
+    uint64_t deadline = iomp->timers[0]->deadline;
+    if (deadline <= now) {
+        return 0;
+    }
+    uint64_t ms = (deadline - now + 999999) / 1000000;
+    return ms > INT_MAX ? INT_MAX : (int)ms;
+}
+
+void timers_cancel(iomp_t iomp) {
+    while (iomp->ntimers > 0) {
+        iomp_timer_t timer = iomp->timers[0];
+        timer_del(iomp, timer);
+        timer->job->cancel(timer->job);
+    }
+}
+
+iomp_thread_t iomp_thread_new(iomp_t iomp, int nevents) {
+    iomp_thread_t t = (iomp_thread_t)malloc(sizeof(*t));
+    if (!t) {
+        IOMP_LOG(ERROR, "malloc fail: %s", strerror(errno));
+        return NULL;
+    }
+    t->iomp = iomp;
+    t->blocked = 0;
+    t->turn = 0;
+    for (int i = 0; i < IOMP_PRIORITY_LEVELS; i++) {
+        STAILQ_INIT(&t->inbox[i]);
+    }
+    t->queue = iomp_queue_new(nevents);
+    if (!t->queue) {
+        IOMP_LOG(ERROR, "iomp_queue_new fail");
+        free(t);
+        return NULL;
+    }
+    if (iomp->polled) {
+        return t;
+    }
+    int rv = pthread_create(&t->thread, NULL, iomp_thread_run, t);
+    if (rv == -1) {
+        IOMP_LOG(ERROR, "pthread_create fail: %s", strerror(errno));
+        iomp_queue_drop(t->queue);
+        free(t);
+        return NULL;
+    }
+    return t;
+}
+
+void iomp_thread_drop(iomp_thread_t t) {
+    if (!t) {
+        return;
+    }
+    if (!t->iomp->polled) {
+        pthread_join(t->thread, NULL);
+    }
+    iomp_queue_drop(t->queue);
+    free(t);
+}
+
+void* iomp_thread_run(void* arg) {
+    iomp_thread_t t = (iomp_thread_t)arg;
+    iomp_t iomp = t->iomp;
+    int stop = 0;
+    iomp_lock(iomp);
+    while (!stop) {
+        timers_fire(iomp);
+        while (iomp->njobs == 0 && !inbox_ready(t)) {
+            int timeout = -1;
+            if (!iomp->keeper && iomp->ntimers > 0) {
+                iomp->keeper = t;
+                timeout = timers_wait(iomp);
+            }
+            TAILQ_REMOVE(&iomp->actived, t, entries);
+            TAILQ_INSERT_TAIL(&iomp->blocked, t, entries);
+            t->blocked = 1;
+            iomp_unlock(iomp);
+            iomp_queue_run(t->queue, timeout);
+            iomp_lock(iomp);
+            TAILQ_REMOVE(&iomp->blocked, t, entries);
+            TAILQ_INSERT_TAIL(&iomp->actived, t, entries);
+            t->blocked = 0;
+            if (iomp->keeper == t) {
+                iomp->keeper = NULL;
+                timers_fire(iomp);
+                /* off to run jobs, hand the timers to someone blocked */
+                if (iomp->njobs > 0 && iomp->ntimers > 0 &&
+                        !TAILQ_EMPTY(&iomp->blocked)) {
+                    iomp_queue_interrupt(TAILQ_FIRST(&iomp->blocked)->queue);
+                }
+            }
+        }
+        iomp_aiojb_t job = jobs_pop(iomp, t);
+        iomp_unlock(iomp);
+        job->execute(job, t);
+        if (job == &iomp->stop) {
+            stop = 1;
+        }
+        iomp_lock(iomp);
+    }
+    iomp_unlock(iomp);
+    return NULL;
+}
+
+/* fd bound jobs skip the shared queues so each fd is registered with one
+ * worker queue and stays there, not paying for a move on every park;
+ * jobs_pop weighs them with the shared ones of the same level */
+int inbox_ready(iomp_thread_t t) {
+    for (int i = 0; i < IOMP_PRIORITY_LEVELS; i++) {
+        if (!STAILQ_EMPTY(&t->inbox[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* locked, on the way out once every worker stopped */
+void inbox_cancel(iomp_t iomp) {
+    iomp_thread_t t = NULL;
+    TAILQ_FOREACH(t, &iomp->zombies, entries) {
+        for (int i = 0; i < IOMP_PRIORITY_LEVELS; i++) {
+            while (!STAILQ_EMPTY(&t->inbox[i])) {
+                iomp_aiojb_t job = STAILQ_FIRST(&t->inbox[i]);
+                STAILQ_REMOVE_HEAD(&t->inbox[i], entries);
+                job->cancel(job);
+            }
+        }
+    }
+}
+
+void do_post(iomp_t iomp, iomp_aiojb_t job) {
+    iomp_lock(iomp);
+    do_post_locked(iomp, job);
+    iomp_unlock(iomp);
+}
+
+void do_post_locked(iomp_t iomp, iomp_aiojb_t job) {
+    if (iomp->polled) {
+        /* wake up a caller waiting on iomp_fileno */
+        if (!iomp->polling && iomp->njobs == 0) {
+            iomp_queue_interrupt(TAILQ_FIRST(&iomp->actived)->queue);
+        }
+        jobs_push(iomp, job);
+        return;
+    }
+    if (job->fildes >= 0 && iomp->nhomes > 0) {
+        iomp_thread_t t = iomp->homes[job->fildes % iomp->nhomes];
+        /* a running worker looks at its inbox before it blocks again,
+         * as does one posting from a completion it dispatched */
+        if (t->blocked && !inbox_ready(t) &&
+                !pthread_equal(pthread_self(), t->thread)) {
+            iomp_queue_interrupt(t->queue);
+        }
+        STAILQ_INSERT_TAIL(&t->inbox[job->level], job, entries);
+        return;
+    }
+    jobs_push(iomp, job);
+    if (TAILQ_EMPTY(&iomp->actived)) {
+        iomp_thread_t t = TAILQ_FIRST(&iomp->blocked);
+        iomp_queue_interrupt(t->queue);
+    }
+}
+
+void do_stop(iomp_aiojb_t job, iomp_thread_t thread) {
+    iomp_t iomp = thread->iomp;
+    iomp_lock(iomp);
+    TAILQ_REMOVE(&thread->iomp->actived, thread, entries);
+    TAILQ_INSERT_TAIL(&thread->iomp->zombies, thread, entries);
+    if (TAILQ_EMPTY(&iomp->actived)) {
+        iomp_thread_t t = TAILQ_FIRST(&iomp->blocked);
+        if (t) {
+            jobs_push(iomp, job);
+            iomp_queue_interrupt(t->queue);
+        } else {
+            timers_cancel(iomp);
+            inbox_cancel(iomp);
+            while ((job = jobs_pop(iomp, NULL)) != NULL) {
+                job->cancel(job);
+            }
+            pthread_cond_signal(&iomp->quit);
+        }
+    } else {
+        jobs_push(iomp, job);
+    }
+    iomp_unlock(iomp);
+}
+
+void do_read(iomp_aiojb_t job, iomp_thread_t thread) {
+    iomp_aio_t aio = job->aio;
+    discharge(thread->iomp, aio);
+    if (aio->nbytes == 0) {
+        /* readiness only, the backend completes it once readable; it
+         * only hears of new edges, so look for bytes already there */
+        free(job);
+#if !IOMP_LOOPBACK
+        struct pollfd pfd = { aio->fildes, POLLIN, 0 };
+        if (poll(&pfd, 1, 0) == 1) {
+            iomp_complete(aio, (pfd.revents & POLLNVAL) ? EBADF : 0);
+            return;
+        }
+#endif /* IOMP_LOOPBACK */
+        if (iomp_queue_read(thread->queue, aio) == -1) {
+            iomp_complete(aio, errno);
+        }
+        return;
+    }
+    job->execute = do_read_more;
+    do_read_more(job, thread);
+}
+
+/* the reading part of do_read, posted again with what is left once it
+ * used up its budget, so one big aio can't hold the worker */
+void do_read_more(iomp_aiojb_t job, iomp_thread_t thread) {
+    iomp_aio_t aio = job->aio;
+    size_t budget = IOMP_EVENT_BUDGET;
+    int nsyscall = IOMP_EVENT_SYSCALLS;
+    while (1) {
+        if (budget == 0 || nsyscall-- == 0) {
+            iomp_lock(thread->iomp);
+            do_post_locked(thread->iomp, job);
+            iomp_unlock(thread->iomp);
+            break;
+        }
+        size_t todo = aio->nbytes - aio->offset;
+        ssize_t len = IOMP_READ(aio->fildes, aio->buf + aio->offset,
+                todo < budget ? todo : budget);
+        if (len > 0) {
+            IOMP_CRC_FEED(aio, aio->buf + aio->offset, len);
+            aio->offset += len;
+            budget -= len;
+            if (len == todo) {
+                free(job);
+                iomp_complete(aio, IOMP_CRC_CHECK(aio));
+                break;
+            }
+        } else if (len == -1 && errno == EAGAIN) {
+            free(job);
+            if (iomp_queue_read(thread->queue, aio) == -1) {
+                iomp_complete(aio, errno);
+            }
+            break;
+        } else {
+            free(job);
+            iomp_complete(aio, (len == -1 ? errno : -1));
+            break;
+        }
+    }
+}
+
+void do_flush(iomp_aiojb_t job, iomp_thread_t thread) {
+    iomp_wrq_t q = IOMP_CONTAINER_OF(job, struct iomp_wrq, flush);
+    wrq_flush(q, thread->queue);
+}
+
+void do_cancel(iomp_aiojb_t job) {
+    iomp_aio_t aio = job->aio;
+    free(job);
+    iomp_complete(aio, -1);
+}
+
+void do_nothing(iomp_aiojb_t job) {
+}
+
+void do_defer(iomp_aiojb_t job, iomp_thread_t thread) {
+    struct iomp_djob* djob = IOMP_CONTAINER_OF(job, struct iomp_djob, job);
+    void (*fn)(void*, iomp_queue_t) = djob->fn;
+    void* arg = djob->arg;
+    free(djob);
+    fn(arg, thread->queue);
+}
+
+void do_dcancel(iomp_aiojb_t job) {
+    struct iomp_djob* djob = IOMP_CONTAINER_OF(job, struct iomp_djob, job);
+    void (*fn)(void*, iomp_queue_t) = djob->fn;
+    void* arg = djob->arg;
+    free(djob);
+    fn(arg, NULL);
+}
+
+void do_task(iomp_aiojb_t job, iomp_thread_t thread) {
+    struct iomp_tjob* tjob = IOMP_CONTAINER_OF(job, struct iomp_tjob, job);
+    void (*fn)(void*, int) = tjob->fn;
+    void* arg = tjob->arg;
+    free(tjob);
+    fn(arg, 0);
+}
+
+void do_tcancel(iomp_aiojb_t job) {
+    struct iomp_tjob* tjob = IOMP_CONTAINER_OF(job, struct iomp_tjob, job);
+    void (*fn)(void*, int) = tjob->fn;
+    void* arg = tjob->arg;
+    free(tjob);
+    fn(arg, -1);
+}
+
+void do_file(iomp_aiojb_t job, iomp_thread_t thread) {
+    struct iomp_fjob* fjob = IOMP_CONTAINER_OF(job, struct iomp_fjob, job);
+    iomp_aio_t aio = job->aio;
+    discharge(fjob->iomp, aio);
+    int error = file_io(aio, fjob->pos, fjob->write);
+    free(fjob);
+    iomp_complete(aio, error);
+}
+
+void do_fcancel(iomp_aiojb_t job) {
+    struct iomp_fjob* fjob = IOMP_CONTAINER_OF(job, struct iomp_fjob, job);
+    iomp_aio_t aio = job->aio;
+    discharge(fjob->iomp, aio);
+    free(fjob);
+    iomp_complete(aio, -1);
+}
+
+int file_io(iomp_aio_t aio, off_t pos, int write) {
+#if defined(O_DIRECT)
+    uintptr_t bits = (uintptr_t)aio->buf | (uintptr_t)pos | aio->nbytes;
+    if (bits & (IOMP_FILE_ALIGN - 1)) {
+        int flags = fcntl(aio->fildes, F_GETFL, 0);
+        if (flags != -1 && (flags & O_DIRECT)) {
+            return file_bounce(aio, pos, write);
+        }
+    }
+#endif /* O_DIRECT */
+    while (aio->offset < aio->nbytes) {
+        void* buf = aio->buf + aio->offset;
+        size_t todo = aio->nbytes - aio->offset;
+        off_t at = pos + aio->offset;
+        ssize_t len = write ? pwrite(aio->fildes, buf, todo, at) :
+            pread(aio->fildes, buf, todo, at);
+        if (len > 0) {
+            aio->offset += len;
+        } else if (len == -1 && errno == EINTR) {
+            continue;
+        } else {
+            return len == -1 ? errno : -1;
+        }
+    }
+    return 0;
+}
+
+#if defined(O_DIRECT)
+/* O_DIRECT needs buffer, position and length aligned, a misaligned buffer
+ * goes through an aligned copy; reads are widened to whole blocks, writes
+ * still need an aligned position and length */
+int file_bounce(iomp_aio_t aio, off_t pos, int write) {
+    const off_t mask = IOMP_FILE_ALIGN - 1;
+    off_t start = pos & ~mask;
+    off_t end = (pos + (off_t)aio->nbytes + mask) & ~mask;
+    size_t head = pos - start;
+    if (write && (head != 0 || (aio->nbytes & mask))) {
+        return EINVAL;
+    }
+    size_t size = end - start;
+    char* tmp = (char*)iomp_file_alloc(size);
+    if (!tmp) {
+        return errno;
+    }
+    if (write) {
+        memcpy(tmp, aio->buf, aio->nbytes);
+    }
+    size_t done = 0;
+    int error = 0;
+    while (done < size) {
+        ssize_t len = write ? pwrite(aio->fildes, tmp + done, size - done,
+                start + done) : pread(aio->fildes, tmp + done, size - done,
+                start + done);
+        if (len > 0) {
+            done += len;
+            if (!write && done < size && (done & mask)) {
+                /* short block, end of file */
+                break;
+            }
+        } else if (len == -1 && errno == EINTR) {
+            continue;
+        } else {
+            error = (len == -1 ? errno : -1);
+            break;
+        }
+    }
+    if (write) {
+        aio->offset = done;
+    } else {
+        aio->offset = done > head ? done - head : 0;
+        if (aio->offset > aio->nbytes) {
+            aio->offset = aio->nbytes;
+        }
+        memcpy(aio->buf, tmp + head, aio->offset);
+        error = (aio->offset == aio->nbytes ? 0 : error != 0 ? error : -1);
+    }
+    iomp_file_free(tmp);
+    return error;
+}
+#endif /* O_DIRECT */
+
+iomp_wrq_t wrq_get(iomp_t iomp, int fd) {
+    if (fd < 0) {
+        errno = EBADF;
+        return NULL;
+    }
+    if (fd >= iomp->nwrqs) {
+        int n = iomp->nwrqs > 0 ? iomp->nwrqs : 64;
+        while (n <= fd) {
+            n *= 2;
+        }
+        iomp_wrq_t* wrqs = (iomp_wrq_t*)realloc(iomp->wrqs, sizeof(*wrqs) * n);
+        if (!wrqs) {
+            IOMP_LOG(ERROR, "realloc fail: %s", strerror(errno));
+            return NULL;
+        }
+        memset(wrqs + iomp->nwrqs, 0, sizeof(*wrqs) * (n - iomp->nwrqs));
+        iomp->wrqs = wrqs;
+        iomp->nwrqs = n;
+    }
+    iomp_wrq_t q = iomp->wrqs[fd];
+    if (!q) {
+        q = (iomp_wrq_t)malloc(sizeof(*q));
+        if (!q) {
+            IOMP_LOG(ERROR, "malloc fail: %s", strerror(errno));
+            return NULL;
+        }
+        STAILQ_INIT(&q->jobs);
+        q->flush.aio = NULL;
+        q->flush.execute = do_flush;
+        q->flush.cancel = do_nothing;
+        q->flush.level = IOMP_PRIORITY_LEVEL(IOMP_PRIORITY_NORMAL);
+        q->flush.fildes = fd;
+        /* nbytes == 0, the backend only reports writability */
+        q->ready.fildes = fd;
+        q->ready.buf = q;
+        q->ready.nbytes = 0;
+        q->ready.offset = 0;
+#if !IOMP_COMPACT
+        q->ready.timeout_ms = -1;
+        q->ready.flags = 0;
+#endif /* IOMP_COMPACT */
+        q->ready.complete = wrq_ready;
+        q->ready.ring = NULL;
+        q->ready.priority = IOMP_PRIORITY_NORMAL;
+        q->ready.pacer = NULL;
+        q->iomp = iomp;
+        q->queue = NULL;
+        q->busy = 0;
+        q->timer.index = -1;
+        q->timer.job = &q->flush;
+        q->paced = NULL;
+        q->paced_rate = 0;
+        iomp->wrqs[fd] = q;
+    }
+    return q;
+}
+
+void wrq_flush(iomp_wrq_t q, iomp_queue_t queue) {
+    iomp_t iomp = q->iomp;
+    struct iovec iov[IOV_MAX];
+    size_t budget = IOMP_EVENT_BUDGET;
+    int nsyscall = IOMP_EVENT_SYSCALLS;
+    while (1) {
+        int iovcnt = 0;
+        size_t total = 0;
+        struct iomp_pacer* pacer = NULL;
+        iomp_aiojb_t job = NULL;
+        iomp_lock(iomp);
+        STAILQ_FOREACH(job, &q->jobs, entries) {
+            if (iovcnt == IOV_MAX || total >= IOMP_WRITEV_LIMIT) {
+                break;
+            }
+            iomp_aio_t aio = job->aio;
+            /* one pacer per writev */
+            if (iovcnt == 0) {
+                pacer = aio->pacer;
+            } else if (aio->pacer != pacer) {
+                break;
+            }
+            iov[iovcnt].iov_base = aio->buf + aio->offset;
+            iov[iovcnt].iov_len = aio->nbytes - aio->offset;
+            total += iov[iovcnt].iov_len;
+            iovcnt++;
+        }
+        if (iovcnt == 0) {
+            wrq_idle(iomp, q);
+            iomp_unlock(iomp);
+            return;
+        }
+        iomp_unlock(iomp);
+        /* no more than the budget left in one go, as on_write does */
+        size_t allowed = total < budget ? total : budget;
+        if (pacer) {
+            uint64_t wait = 0;
+            allowed = pacer_take(pacer, allowed, &wait);
+            if (allowed == 0) {
+                /* throttled, busy stays set so nothing overtakes us */
+                iomp_lock(iomp);
+                int error = timer_add(iomp, &q->timer, now_ns() + wait);
+                iomp_unlock(iomp);
+                if (error != 0) {
+                    wrq_abort(q, error);
+                }
+                return;
+            }
+#if defined(SO_MAX_PACING_RATE)
+            if ((pacer->flags & IOMP_PACE_KERNEL) &&
+                    (q->paced != pacer || q->paced_rate != pacer->rate)) {
+                unsigned int rate = pacer->rate > UINT_MAX ?
+                    UINT_MAX : (unsigned int)pacer->rate;
+                setsockopt(q->ready.fildes, SOL_SOCKET, SO_MAX_PACING_RATE,
+                        &rate, sizeof(rate));
+                q->paced = pacer;
+                q->paced_rate = pacer->rate;
+            }
+#endif /* SO_MAX_PACING_RATE */
+        }
+        if (allowed < total) {
+            size_t n = 0;
+            for (int i = 0; i < iovcnt; i++) {
+                if (n + iov[i].iov_len >= allowed) {
+                    iov[i].iov_len = allowed - n;
+                    iovcnt = i + 1;
+                    break;
+                }
+                n += iov[i].iov_len;
+            }
+        }
+        ssize_t len = IOMP_WRITEV(q->ready.fildes, iov, iovcnt);
+        if (pacer) {
+            pacer_refund(pacer, len > 0 ? allowed - len : allowed);
+        }
+        if (len == -1 && errno == EAGAIN) {
+            q->queue = queue;
+            if (iomp_queue_write(queue, &q->ready) == -1) {
+                wrq_abort(q, errno);
+            }
+            return;
+        } else if (len <= 0) {
+            wrq_abort(q, (len == -1 ? errno : -1));
+            return;
+        }
+        budget -= (size_t)len < budget ? (size_t)len : budget;
+        nsyscall--;
+        STAILQ_HEAD(, iomp_aiojb) done = STAILQ_HEAD_INITIALIZER(done);
+        iomp_lock(iomp);
+        while (len > 0) {
+            job = STAILQ_FIRST(&q->jobs);
+            iomp_aio_t aio = job->aio;
+            size_t todo = aio->nbytes - aio->offset;
+            if (len < todo) {
+                aio->offset += len;
+                break;
+            }
+            aio->offset = aio->nbytes;
+            len -= todo;
+            STAILQ_REMOVE_HEAD(&q->jobs, entries);
+            STAILQ_INSERT_TAIL(&done, job, entries);
+            discharge(iomp, aio);
+        }
+        iomp_unlock(iomp);
+        if (STAILQ_EMPTY(&done) && budget > 0 && nsyscall > 0) {
+            continue;
+        }
+        while (!STAILQ_EMPTY(&done)) {
+            job = STAILQ_FIRST(&done);
+            STAILQ_REMOVE_HEAD(&done, entries);
+            iomp_aio_t aio = job->aio;
+            free(job);
+            iomp_complete(aio, 0);
+        }
+        /* go to the back of the line, other jobs may be waiting, as
+         * they are once a big write used up the budget */
+        iomp_lock(iomp);
+        if (STAILQ_EMPTY(&q->jobs)) {
+            wrq_idle(iomp, q);
+        } else {
+            q->flush.level = STAILQ_FIRST(&q->jobs)->level;
+            do_post_locked(iomp, &q->flush);
+        }
+        iomp_unlock(iomp);
+        return;
+    }
+}
+
+void wrq_abort(iomp_wrq_t q, int error) {
+    iomp_t iomp = q->iomp;
+    iomp_lock(iomp);
+    STAILQ_HEAD(, iomp_aiojb) jobs = STAILQ_HEAD_INITIALIZER(jobs);
+    STAILQ_CONCAT(&jobs, &q->jobs);
+    wrq_idle(iomp, q);
+    iomp_unlock(iomp);
+    while (!STAILQ_EMPTY(&jobs)) {
+        iomp_aiojb_t job = STAILQ_FIRST(&jobs);
+        STAILQ_REMOVE_HEAD(&jobs, entries);
+        iomp_aio_t aio = job->aio;
+        free(job);
+        discharge(iomp, aio);
+        iomp_complete(aio, error);
+    }
+}
+
+/* locked, by whoever set busy; q must not be touched afterwards */
+void wrq_idle(iomp_t iomp, iomp_wrq_t q) {
+    q->busy = 0;
+    q->paced = NULL;
+#if IOMP_COMPACT
+    /* an idle connection keeps no write queue around */
+    iomp->wrqs[q->ready.fildes] = NULL;
+    free(q);
+#endif /* IOMP_COMPACT */
+}
+
+void wrq_ready(iomp_aio_t aio, int error) {
+    iomp_wrq_t q = IOMP_CONTAINER_OF(aio, struct iomp_wrq, ready);
+    if (error != 0) {
+        wrq_abort(q, error);
+        return;
+    }
+    wrq_flush(q, q->queue);
+}
+
+uint64_t now_ns() {
+    struct timespec ts = { 0, 0 };
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
 int get_ncpu() {
@@ -4,6 +4,8 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -35,6 +37,38 @@ extern "C" {
     } while (0)
 
 #define IOMP_EVENT_LIMIT 1024
+#define IOMP_EVENT_BUDGET (64 * 1024)
+#define IOMP_EVENT_SYSCALLS 16
+#define IOMP_WRITEV_LIMIT (256 * 1024)
+#define IOMP_FILE_THREADS 4
+#define IOMP_FILE_ALIGN 4096
+#define IOMP_ACCEPT_BATCH 64
+#define IOMP_ACCEPT_BACKOFF 100
+#define IOMP_FRAME_LIMIT (16 * 1024 * 1024)
+#define IOMP_FRAME_DELIM_MAX 16
+#define IOMP_SHM_FDS 5
+#define IOMP_TRACE_BATCH 1024
+
+#define IOMP_AIO_CRC32C 1
+
+#define IOMP_FRAME_BE 0
+#define IOMP_FRAME_LE 1
+
+#define IOMP_TRACE_MAGIC        0x54504d49
+#define IOMP_TRACE_VERSION      2
+#define IOMP_TRACE_COMPLETE     0
+#define IOMP_TRACE_READ         1
+#define IOMP_TRACE_WRITE        2
+#define IOMP_TRACE_PREAD        3
+#define IOMP_TRACE_PWRITE       4
+#define IOMP_TRACE_ACCEPT       5
+
+#define IOMP_PRIORITY_HIGH      1
+#define IOMP_PRIORITY_NORMAL    0
+#define IOMP_PRIORITY_LOW       -1
+#define IOMP_PRIORITY_LEVELS    3
+#define IOMP_PRIORITY_LEVEL(prio) \
+    ((prio) >= IOMP_PRIORITY_HIGH ? 0 : (prio) <= IOMP_PRIORITY_LOW ? 2 : 1)
 
 IOMP_API const char* iomp_now(char* buf, size_t bufsz);
 IOMP_API int iomp_writelog(int level, const char* fmt, ...);
@@ -45,6 +79,49 @@ typedef struct iomp_core* iomp_t;
 
 struct iomp_queue;
 
+struct iomp_ring;
+typedef struct iomp_ring* iomp_ring_t;
+
+struct iomp_framer;
+typedef struct iomp_framer* iomp_framer_t;
+
+struct iomp_shm;
+typedef struct iomp_shm* iomp_shm_t;
+
+/* Compact mode, for boxes holding a great many mostly idle connections;
+ * the library and everything using it must agree on IOMP_COMPACT. Aios
+ * shrink from 80 to 48 bytes on LP64 (nbytes below 4GB, no timeout_ms
+ * or flags, fields reordered so set them by name) and the write queue of
+ * an fd is released as soon as it drains, so an idle connection costs its
+ * aio plus one fd table entry. */
+#ifndef IOMP_COMPACT
+#define IOMP_COMPACT 0
+#endif /* IOMP_COMPACT */
+
+/* Loopback backend, for measuring the library on its own: built with
+ * IOMP_LOOPBACK=1 the workers park on in-process memory pipes instead of
+ * epoll or kqueue, readiness being posted by the other end, so nothing
+ * reaches the kernel but the wakeup of a sleeping worker. Only the library
+ * needs the flag, make IOMP_LOOPBACK=1 sets it; bench pingpong then runs
+ * over it. */
+#ifndef IOMP_LOOPBACK
+#define IOMP_LOOPBACK 0
+#endif /* IOMP_LOOPBACK */
+
+#if IOMP_COMPACT
+struct iomp_aio {
+    int fildes;
+    int priority;
+    void* buf;
+    uint32_t nbytes;
+    uint32_t offset;
+    void (*complete)(struct iomp_aio* aio, int error);
+    /* if set, the completion goes to this ring instead of complete */
+    struct iomp_ring* ring;
+    /* if set, writes are paced by it */
+    struct iomp_pacer* pacer;
+};
+#else
 struct iomp_aio {
     int fildes;
     void* buf;
@@ -52,29 +129,311 @@ struct iomp_aio {
     size_t offset;
     int timeout_ms;
     void (*complete)(struct iomp_aio* aio, int error);
+    /* if set, the completion goes to this ring instead of complete */
+    struct iomp_ring* ring;
+    int priority;
+    /* if set, writes are paced by it */
+    struct iomp_pacer* pacer;
+    /* IOMP_AIO_*, see iomp_crc32c */
+    int flags;
+    /* internal, the checksum of what a read got so far */
+    uint32_t crc;
 };
+#endif /* IOMP_COMPACT */
 typedef struct iomp_aio* iomp_aio_t;
 
+#define IOMP_PACE_KERNEL 1
+
+/* Token bucket for iomp_write, rate in bytes per second (0 unlimited) and
+ * up to burst bytes at once. Shared by every aio pointing at it, so one
+ * pacer per aio paces a stream and one for many paces a group.
+ * IOMP_PACE_KERNEL also sets SO_MAX_PACING_RATE where available, only for
+ * pacers used by a single socket. */
+struct iomp_pacer {
+    uint64_t rate;
+    size_t burst;
+    int flags;
+    /* internal */
+    int lock;
+    double tokens;
+    uint64_t stamp;
+};
+
+struct iomp_sockopt {
+    int level;
+    int name;
+    int value;
+};
+
+/* multishot accept, see iomp_accept_multishot */
+struct iomp_acceptor {
+    /* fildes is the listening socket, complete runs per connection */
+    struct iomp_aio aio;
+    const struct iomp_sockopt* opts;
+    int nopts;
+    /* the accepted connection, only valid inside complete */
+    int fd;
+    struct sockaddr_storage peer;
+    socklen_t peerlen;
+    /* internal */
+    struct iomp_aio listen;
+    int busy;
+    iomp_t iomp;
+};
+typedef struct iomp_acceptor* iomp_acceptor_t;
+
+struct iomp_completion {
+    iomp_aio_t aio;
+    int error;
+};
+
+/* trace file layout, see iomp_trace_open */
+struct iomp_trace_hdr {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t recsize;
+};
+
+struct iomp_trace_rec {
+    /* ns since iomp_trace_open, monotonic */
+    uint64_t stamp;
+    /* the aio address, pairs a completion with its submission */
+    uint64_t id;
+    /* asked for on submission, transferred on completion */
+    uint64_t nbytes;
+    int32_t fildes;
+    /* IOMP_TRACE_*, IOMP_TRACE_COMPLETE on completion */
+    uint16_t op;
+    /* the recording thread, numbered in order of first record */
+    uint16_t thread;
+    /* completion only */
+    int32_t error;
+    uint32_t reserved;
+};
+
 IOMP_API iomp_t iomp_new(int nthreads);
 IOMP_API void iomp_drop(iomp_t iomp);
+
+/* Polled mode: no internal threads and no locks, jobs and events only
+ * run inside iomp_poll/iomp_run on the caller's thread, and every other
+ * call except iomp_stop must come from that same thread.
+ * iomp_poll returns 1 if work is still pending, 0 if not, -1 on error.
+ * To nest it in another event loop, wait on iomp_fileno only after
+ * iomp_poll returned 0; it turns readable on new events or jobs. */
+IOMP_API iomp_t iomp_new_polled(void);
+IOMP_API int iomp_poll(iomp_t iomp, int timeout);
+IOMP_API int iomp_run(iomp_t iomp);
+IOMP_API void iomp_stop(iomp_t iomp);
+IOMP_API int iomp_fileno(iomp_t iomp);
+
+/* One read and one write may be pending on the same fd at once, and an
+ * fd must not be closed while either is. An aio with nbytes 0 (buf still
+ * non-NULL) completes once fildes turns readable, without reading. */
 IOMP_API void iomp_read(iomp_t iomp, iomp_aio_t aio);
 IOMP_API void iomp_write(iomp_t iomp, iomp_aio_t aio);
 IOMP_API void iomp_accept(iomp_t iomp, iomp_aio_t aio);
 
+/* An fd stays registered with the kernel between aios, so that parking
+ * it again costs nothing; before closing one that was read, written or
+ * connected through iomp, with nothing pending, forget it, or a later fd
+ * reusing the number may never be reported. Any thread may call it. */
+IOMP_API void iomp_forget(iomp_t iomp, int fd);
+
+/* Accepts on a worker, up to IOMP_ACCEPT_BATCH per wakeup, and calls
+ * complete once per connection with fd and peer filled in; the fd is
+ * already non-blocking and close-on-exec, with opts applied. Errors other
+ * than a dropped connection are passed to complete with fd -1, the
+ * acceptor stays armed until the listening socket is closed. Out of fds
+ * (EMFILE, ENFILE) it stops watching the listener for IOMP_ACCEPT_BACKOFF
+ * ms, the connections wait in the backlog meanwhile.
+ * Completion rings are not supported here. */
+IOMP_API void iomp_accept_multishot(iomp_t iomp, iomp_acceptor_t acc);
+
+/* Connects fildes, a non-blocking stream socket, to addr; complete runs
+ * once the handshake is over, with 0 or the error the socket reports.
+ * buf and nbytes are not used. Like a pending write, the connect parks
+ * on the fd, so no other write may be pending there meanwhile. */
+IOMP_API void iomp_connect(iomp_t iomp, iomp_aio_t aio,
+        const struct sockaddr* addr, socklen_t addrlen);
+
+/* Writes len bytes of buf to each of the n fds, from a single copy shared
+ * by all of them, through the same per-fd queues as iomp_write; buf may
+ * be reused once this returns. complete runs once, after the last fd is
+ * done, with errors[i] the outcome for fds[i] (0, an error, or -1 on
+ * shutdown), valid until it returns. The writes count against the
+ * admission limit like any other, so a full pool shows up as EBUSY.
+ * Returns 0, or an error if nothing was sent, complete is then not
+ * called. */
+IOMP_API int iomp_broadcast(iomp_t iomp, const int* fds, int n,
+        const void* buf, size_t len,
+        void (*complete)(void* arg, const int* errors, int n), void* arg);
+
+/* Admission control: once limit (0 means unbounded) normal and low
+ * priority aios are queued, new ones complete with EBUSY; high priority
+ * aios are always admitted. Workers pick jobs by strict priority unless
+ * weights are set, then each level gets that many picks per round. */
+IOMP_API void iomp_set_limit(iomp_t iomp, size_t limit);
+IOMP_API void iomp_set_weights(iomp_t iomp, int high, int normal, int low);
+
+/* Runs fn(arg, 0) on a worker, right away or after delay_ms, sharing the
+ * pool with I/O at normal priority. fn gets -1 instead if iomp shuts down
+ * first, or an error if the task could not be queued; either way it is
+ * called exactly once. In polled mode tasks run inside iomp_poll. */
+IOMP_API void iomp_post(iomp_t iomp, void (*fn)(void* arg, int error),
+        void* arg);
+IOMP_API void iomp_schedule(iomp_t iomp, int delay_ms,
+        void (*fn)(void* arg, int error), void* arg);
+
+/* burst 0 means 10ms worth of rate; throttled writes wait on a timer,
+ * which in polled mode only fires inside iomp_poll */
+IOMP_API void iomp_pacer_init(struct iomp_pacer* pacer, uint64_t rate,
+        size_t burst, int flags);
+
+/* Completion ring, an IOCP style alternative to callbacks on workers.
+ * Aios with a ring set are pushed into it without locks, and a single
+ * consumer thread drains them in batches; iomp_get_completions returns
+ * the number taken, waiting up to timeout ms (-1 forever) for the first.
+ * Capacity should cover the aios in flight, past it completions spill to
+ * a locked list at the cost of a malloc each. */
+IOMP_API iomp_ring_t iomp_ring_new(size_t capacity);
+IOMP_API void iomp_ring_drop(iomp_ring_t ring);
+IOMP_API int iomp_get_completions(iomp_ring_t ring,
+        struct iomp_completion* out, int max, int timeout);
+
+/* Speculative variants of iomp_read/iomp_write, the transfer is first
+ * attempted on the calling thread and only queued on EAGAIN.
+ * Returns 0 if the aio finished inline, EINPROGRESS if it was queued,
+ * otherwise the error complete would have been called with.
+ * complete is only called for queued aios. A write with a pacer is
+ * always queued. */
+IOMP_API int iomp_try_read(iomp_t iomp, iomp_aio_t aio);
+IOMP_API int iomp_try_write(iomp_t iomp, iomp_aio_t aio);
+
+/* Positional file I/O at pos, offset is the progress as usual. Runs on a
+ * separate pool of blocking threads (IOMP_FILE_THREADS unless set, started
+ * on first use), or inside iomp_poll in polled mode. Reaching the end of
+ * file before nbytes completes with -1.
+ * On O_DIRECT fds, buffers from iomp_file_alloc avoid a bounce copy;
+ * writes still need pos and nbytes aligned to IOMP_FILE_ALIGN. */
+IOMP_API void iomp_pread(iomp_t iomp, iomp_aio_t aio, off_t pos);
+IOMP_API void iomp_pwrite(iomp_t iomp, iomp_aio_t aio, off_t pos);
+IOMP_API void iomp_set_file_threads(iomp_t iomp, int nthreads);
+IOMP_API void* iomp_file_alloc(size_t size);
+IOMP_API void iomp_file_free(void* buf);
+
+/* Framed reads through a per-connection buffer, each call completes once
+ * with a single message: buf points into the framer and nbytes is the
+ * message length, valid until the next read on that framer.
+ * iomp_read_frame strips a hdrlen (1, 2, 4 or 8) byte length header in
+ * IOMP_FRAME_BE or IOMP_FRAME_LE order, iomp_read_until strips delim.
+ * Messages over IOMP_FRAME_LIMIT complete with EMSGSIZE. */
+IOMP_API iomp_framer_t iomp_framer_new(int fildes, size_t size);
+IOMP_API void iomp_framer_drop(iomp_framer_t f);
+IOMP_API void iomp_read_frame(iomp_t iomp, iomp_framer_t f, iomp_aio_t aio,
+        int hdrlen, int order);
+IOMP_API void iomp_read_until(iomp_t iomp, iomp_framer_t f, iomp_aio_t aio,
+        const void* delim, size_t dlen);
+
+/* Shared memory transport between two local processes (Linux only, ENOSYS
+ * elsewhere): a memfd holding one SPSC ring of capacity bytes per
+ * direction, with eventfds that are only signalled while the other side
+ * sleeps. iomp_shm_new returns one end; pass the IOMP_SHM_FDS fds from
+ * iomp_shm_fds to the peer (fork or SCM_RIGHTS), which gets the other end
+ * from iomp_shm_attach, the fds are duplicated there. iomp_shm_read and
+ * iomp_shm_write behave like iomp_read/iomp_write on a stream, one of
+ * each may be pending per end. Dropping either end, which must not
+ * happen with anything pending, closes both directions: what is left can
+ * still be read, then reads complete with -1 and writes with EPIPE. A
+ * copy of an end inherited across fork counts, so leave it alone. */
+IOMP_API iomp_shm_t iomp_shm_new(size_t capacity);
+IOMP_API iomp_shm_t iomp_shm_attach(const int* fds);
+IOMP_API void iomp_shm_fds(iomp_shm_t shm, int* fds);
+IOMP_API void iomp_shm_drop(iomp_shm_t shm);
+IOMP_API void iomp_shm_read(iomp_t iomp, iomp_shm_t shm, iomp_aio_t aio);
+IOMP_API void iomp_shm_write(iomp_t iomp, iomp_shm_t shm, iomp_aio_t aio);
+
+/* Two connected ends of a loopback pipe, capacity bytes each way, as fds
+ * only the loopback backend knows: read and write them through iomp_read,
+ * iomp_write and their try variants, framed reads included, and close
+ * them with iomp_loopback_close once nothing is pending. Closing one end
+ * works like a socket, the other reads what is left, then end of file,
+ * and its writes fail with EPIPE. Kernel fds can not be parked in such a
+ * build, so accept, connect and shm are out. Both return 0 or an error,
+ * ENOSYS unless the library was built with IOMP_LOOPBACK. */
+IOMP_API int iomp_loopback_pair(int* fds, size_t capacity);
+IOMP_API int iomp_loopback_close(int fd);
+
+/* Integrity stage: with IOMP_AIO_CRC32C in flags, the last 4 bytes of
+ * buf (counted in nbytes) carry a CRC32C of the rest, big endian.
+ * iomp_write and iomp_try_write fill them in on submission, iomp_read and
+ * iomp_try_read checksum each chunk as it comes in and complete with
+ * EBADMSG if the result does not match. An aio asking for it with nbytes
+ * below 4 completes with EINVAL. Not in compact mode, which has no flags.
+ * iomp_crc32c continues crc (0 to start) over len more bytes, using
+ * SSE4.2 where the CPU has it. */
+IOMP_API uint32_t iomp_crc32c(uint32_t crc, const void* data, size_t len);
+
+/* Workload capture for the whole process. While a trace is open, aios
+ * submitted through iomp_read, iomp_write, iomp_accept and their try and
+ * positional variants are recorded, as is every completion; records go
+ * to a buffer of IOMP_TRACE_BATCH per thread that is appended to path
+ * when full and on close. The file is an iomp_trace_hdr followed by
+ * per-thread batches of iomp_trace_rec: sort by stamp for inter-arrival
+ * times and pair each completion with the last submission of its id for
+ * latencies. Completions of iomp's own aios have no submission. Costs
+ * one load per aio while closed. iomp_trace_open returns 0 or an error,
+ * EBUSY if a trace is already open. See replay.c for playing one back. */
+IOMP_API int iomp_trace_open(const char* path);
+IOMP_API void iomp_trace_close(void);
+
 #ifdef __cplusplus
 }
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <fcntl.h>
 #include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 
 namespace iomp {
 
 class IOMultiPlexer;
 
+/* field by field, the layout depends on IOMP_COMPACT */
+inline ::iomp_aio make_aio(int fildes, void* buf, size_t nbytes,
+        int timeout, void (*complete)(::iomp_aio_t, int)) noexcept {
+    ::iomp_aio aio;
+    std::memset(&aio, 0, sizeof(aio));
+    aio.fildes = fildes;
+    aio.buf = buf;
+    aio.nbytes = nbytes;
+#if !IOMP_COMPACT
+    aio.timeout_ms = timeout;
+#endif /* IOMP_COMPACT */
+    aio.complete = complete;
+    return aio;
+}
+
 class AsyncIO : public ::iomp_aio {
 public:
     inline AsyncIO(int fildes, void* buf, size_t nbytes, int timeout = -1) noexcept:
-            ::iomp_aio({ fildes, buf, nbytes, 0, timeout, &AsyncIO::complete }) {
+            ::iomp_aio(make_aio(fildes, buf, nbytes, timeout,
+                    &AsyncIO::complete)) {
     }
     virtual ~AsyncIO() noexcept { }
     AsyncIO(const AsyncIO&) noexcept = delete;
@@ -91,11 +450,144 @@ private:
     }
 };
 
+/* Operation with its completion handler stored inline, no virtual call
+ * and no allocation; the handler is invoked as handler(int error).
+ * An Op may be moved or reused only while it is not in flight. */
+template <typename Handler>
+class Op : public ::iomp_aio {
+public:
+    inline Op(int fildes, void* buf, size_t nbytes, Handler handler,
+            int timeout = -1) noexcept:
+            ::iomp_aio(make_aio(fildes, buf, nbytes, timeout, &Op::dispatch)),
+            _handler(std::move(handler)) {
+    }
+    inline Op(Op&& rhs) noexcept:
+            ::iomp_aio(rhs), _handler(std::move(rhs._handler)) {
+    }
+    inline Op& operator=(Op&& rhs) noexcept {
+        ::iomp_aio::operator=(rhs);
+        _handler = std::move(rhs._handler);
+        return *this;
+    }
+    Op(const Op&) noexcept = delete;
+    Op& operator=(const Op&) noexcept = delete;
+public:
+    inline operator int() noexcept { return fildes; }
+    inline Handler& handler() noexcept { return _handler; }
+private:
+    static void dispatch(::iomp_aio_t aio, int error) noexcept {
+        auto self = static_cast<Op*>(aio);
+        self->_handler(error);
+    }
+private:
+    Handler _handler;
+};
+
+template <typename Handler>
+inline Op<typename std::decay<Handler>::type> make_op(int fildes,
+        void* buf, size_t nbytes, Handler&& handler, int timeout = -1) noexcept {
+    return Op<typename std::decay<Handler>::type>(fildes, buf, nbytes,
+            std::forward<Handler>(handler), timeout);
+}
+
+class CompletionRing {
+public:
+    inline explicit CompletionRing(size_t capacity) noexcept:
+        _ring(::iomp_ring_new(capacity)) { }
+    inline ~CompletionRing() noexcept {
+        if (_ring) {
+            ::iomp_ring_drop(_ring);
+        }
+    }
+    inline CompletionRing(CompletionRing&& rhs) noexcept: _ring(rhs._ring) {
+        rhs._ring = nullptr;
+    }
+    inline CompletionRing& operator=(CompletionRing&& rhs) noexcept {
+        std::swap(_ring, rhs._ring);
+        return *this;
+    }
+    CompletionRing(const CompletionRing&) noexcept = delete;
+    CompletionRing& operator=(const CompletionRing&) noexcept = delete;
+public:
+    inline explicit operator bool() noexcept { return _ring != nullptr; }
+    inline operator ::iomp_ring_t() noexcept { return _ring; }
+    inline int get(::iomp_completion* out, int max, int timeout = -1) noexcept {
+        return ::iomp_get_completions(_ring, out, max, timeout);
+    }
+private:
+    ::iomp_ring_t _ring;
+};
+
+class Framer {
+public:
+    inline explicit Framer(int fildes, size_t size = 0) noexcept:
+        _framer(::iomp_framer_new(fildes, size)) { }
+    inline ~Framer() noexcept {
+        ::iomp_framer_drop(_framer);
+    }
+    Framer(const Framer&) noexcept = delete;
+    Framer& operator=(const Framer&) noexcept = delete;
+    inline Framer(Framer&& rhs) noexcept: _framer(rhs._framer) {
+        rhs._framer = nullptr;
+    }
+    inline Framer& operator=(Framer&& rhs) noexcept {
+        std::swap(_framer, rhs._framer);
+        return *this;
+    }
+public:
+    inline explicit operator bool() noexcept { return _framer != nullptr; }
+    inline ::iomp_framer_t get() noexcept { return _framer; }
+private:
+    ::iomp_framer_t _framer;
+};
+
+/* Callable posted with IOMultiPlexer::post/schedule, owned by iomp until
+ * it ran; the handler is invoked as handler(int error). */
+template <typename Handler>
+class Task {
+public:
+    inline explicit Task(Handler handler) noexcept:
+        _handler(std::move(handler)) { }
+    static void dispatch(void* arg, int error) noexcept {
+        std::unique_ptr<Task> self(static_cast<Task*>(arg));
+        self->_handler(error);
+    }
+private:
+    Handler _handler;
+};
+
+class SharedMemory {
+public:
+    inline explicit SharedMemory(size_t capacity = 65536) noexcept:
+        _shm(::iomp_shm_new(capacity)) { }
+    inline explicit SharedMemory(const int* fds) noexcept:
+        _shm(::iomp_shm_attach(fds)) { }
+    inline ~SharedMemory() noexcept {
+        ::iomp_shm_drop(_shm);
+    }
+    SharedMemory(const SharedMemory&) noexcept = delete;
+    SharedMemory& operator=(const SharedMemory&) noexcept = delete;
+    inline SharedMemory(SharedMemory&& rhs) noexcept: _shm(rhs._shm) {
+        rhs._shm = nullptr;
+    }
+    inline SharedMemory& operator=(SharedMemory&& rhs) noexcept {
+        std::swap(_shm, rhs._shm);
+        return *this;
+    }
+public:
+    inline explicit operator bool() noexcept { return _shm != nullptr; }
+    inline ::iomp_shm_t get() noexcept { return _shm; }
+    inline void fds(int* fds) noexcept { ::iomp_shm_fds(_shm, fds); }
+private:
+    ::iomp_shm_t _shm;
+};
+
 class IOMultiPlexer {
 public:
     inline IOMultiPlexer() noexcept: IOMultiPlexer(0) { }
     inline explicit IOMultiPlexer(int nthread) noexcept:
         _iomp(::iomp_new(nthread)) { }
+    inline explicit IOMultiPlexer(::iomp_t iomp) noexcept: _iomp(iomp) { }
     inline ~IOMultiPlexer() noexcept {
         if (_iomp) {
             ::iomp_drop(_iomp);
@@ -109,9 +601,50 @@ public:
         rhs._iomp = nullptr;
         return *this;
     }
+public:
+    static inline IOMultiPlexer polled() noexcept {
+        return IOMultiPlexer(::iomp_new_polled());
+    }
 public:
     inline explicit operator bool() noexcept { return _iomp != nullptr; }
     inline operator ::iomp_t() noexcept { return _iomp; }
+    inline int poll(int timeout = -1) noexcept {
+        return ::iomp_poll(_iomp, timeout);
+    }
+    inline int run() noexcept {
+        return ::iomp_run(_iomp);
+    }
+    inline void stop() noexcept {
+        ::iomp_stop(_iomp);
+    }
+    inline int fileno() noexcept {
+        return ::iomp_fileno(_iomp);
+    }
+    inline void set_limit(size_t limit) noexcept {
+        ::iomp_set_limit(_iomp, limit);
+    }
+    inline void set_weights(int high, int normal, int low) noexcept {
+        ::iomp_set_weights(_iomp, high, normal, low);
+    }
+    inline void post(void (*fn)(void*, int), void* arg) noexcept {
+        ::iomp_post(_iomp, fn, arg);
+    }
+    template <typename Handler>
+    inline void post(Handler&& handler) {
+        typedef Task<typename std::decay<Handler>::type> T;
+        ::iomp_post(_iomp, &T::dispatch,
+                new T(std::forward<Handler>(handler)));
+    }
+    inline void schedule(int delay_ms, void (*fn)(void*, int),
+            void* arg) noexcept {
+        ::iomp_schedule(_iomp, delay_ms, fn, arg);
+    }
+    template <typename Handler>
+    inline void schedule(int delay_ms, Handler&& handler) {
+        typedef Task<typename std::decay<Handler>::type> T;
+        ::iomp_schedule(_iomp, delay_ms, &T::dispatch,
+                new T(std::forward<Handler>(handler)));
+    }
     inline void read(AsyncIO& aio) noexcept {
         ::iomp_read(_iomp, &aio);
     }
@@ -133,16 +666,1018 @@ public:
     inline void accept(AsyncIO& aio) noexcept {
         ::iomp_accept(_iomp, &aio);
     }
+    inline void forget(int fd) noexcept {
+        ::iomp_forget(_iomp, fd);
+    }
     inline void accept(AsyncIO* aio) {
         if (!aio) {
             throw std::invalid_argument("null pointer");
         }
         this->accept(*aio);
     }
+    inline void set_file_threads(int nthreads) noexcept {
+        ::iomp_set_file_threads(_iomp, nthreads);
+    }
+    inline void pread(::iomp_aio& aio, off_t pos) noexcept {
+        ::iomp_pread(_iomp, &aio, pos);
+    }
+    inline void pread(::iomp_aio* aio, off_t pos) {
+        if (!aio) {
+            throw std::invalid_argument("null pointer");
+        }
+        this->pread(*aio, pos);
+    }
+    inline void pwrite(::iomp_aio& aio, off_t pos) noexcept {
+        ::iomp_pwrite(_iomp, &aio, pos);
+    }
+    inline void pwrite(::iomp_aio* aio, off_t pos) {
+        if (!aio) {
+            throw std::invalid_argument("null pointer");
+        }
+        this->pwrite(*aio, pos);
+    }
+    inline void read_frame(Framer& framer, ::iomp_aio& aio, int hdrlen,
+            int order = IOMP_FRAME_BE) noexcept {
+        ::iomp_read_frame(_iomp, framer.get(), &aio, hdrlen, order);
+    }
+    inline void read_until(Framer& framer, ::iomp_aio& aio,
+            const void* delim, size_t dlen) noexcept {
+        ::iomp_read_until(_iomp, framer.get(), &aio, delim, dlen);
+    }
+    inline void read(SharedMemory& shm, ::iomp_aio& aio) noexcept {
+        ::iomp_shm_read(_iomp, shm.get(), &aio);
+    }
+    inline void write(SharedMemory& shm, ::iomp_aio& aio) noexcept {
+        ::iomp_shm_write(_iomp, shm.get(), &aio);
+    }
+    inline void accept_multishot(::iomp_acceptor& acc) noexcept {
+        ::iomp_accept_multishot(_iomp, &acc);
+    }
+    inline void connect(::iomp_aio& aio, const struct sockaddr* addr,
+            socklen_t addrlen) noexcept {
+        ::iomp_connect(_iomp, &aio, addr, addrlen);
+    }
+    inline int broadcast(const int* fds, int n, const void* buf, size_t len,
+            void (*fn)(void*, const int*, int), void* arg) noexcept {
+        return ::iomp_broadcast(_iomp, fds, n, buf, len, fn, arg);
+    }
+    /* handler(const int* errors, int n) */
+    template <typename Handler>
+    inline int broadcast(const int* fds, int n, const void* buf, size_t len,
+            Handler&& handler) {
+        typedef typename std::decay<Handler>::type H;
+        H* h = new H(std::forward<Handler>(handler));
+        int error = ::iomp_broadcast(_iomp, fds, n, buf, len,
+                [](void* arg, const int* errors, int n) {
+            std::unique_ptr<H> self(static_cast<H*>(arg));
+            (*self)(errors, n);
+        }, h);
+        if (error != 0) {
+            delete h;
+        }
+        return error;
+    }
+    inline int try_read(::iomp_aio& aio) noexcept {
+        return ::iomp_try_read(_iomp, &aio);
+    }
+    inline int try_write(::iomp_aio& aio) noexcept {
+        return ::iomp_try_write(_iomp, &aio);
+    }
+    template <typename Handler>
+    inline void read(Op<Handler>& op) noexcept {
+        ::iomp_read(_iomp, &op);
+    }
+    template <typename Handler>
+    inline void read(Op<Handler>* op) {
+        if (!op) {
+            throw std::invalid_argument("null pointer");
+        }
+        this->read(*op);
+    }
+    template <typename Handler>
+    inline void write(Op<Handler>& op) noexcept {
+        ::iomp_write(_iomp, &op);
+    }
+    template <typename Handler>
+    inline void write(Op<Handler>* op) {
+        if (!op) {
+            throw std::invalid_argument("null pointer");
+        }
+        this->write(*op);
+    }
+    template <typename Handler>
+    inline void accept(Op<Handler>& op) noexcept {
+        ::iomp_accept(_iomp, &op);
+    }
+    template <typename Handler>
+    inline void accept(Op<Handler>* op) {
+        if (!op) {
+            throw std::invalid_argument("null pointer");
+        }
+        this->accept(*op);
+    }
 private:
     ::iomp_t _iomp;
 };
 
+/* Buffered stream over one connection. Reads pull large chunks into a
+ * ring buffer and small reads are served from memory, writes collect in
+ * a buffer that goes out once it reaches flush_size or on flush().
+ * Handlers run on the calling thread when the data is already buffered,
+ * otherwise on a worker. There is a single reader: only one read may be
+ * outstanding at a time, the next one issued from its handler or once it
+ * has run; writes and flushes may come from any thread.
+ * With mirror set the ring is mapped twice back to back (Linux memfd),
+ * so a message that wraps around still comes out contiguous.
+ * Destroying the stream waits for the write that is out and for a read
+ * waiting on the socket, shutting the socket down for reading to get
+ * that one back; its handler is not called. */
+class Stream {
+public:
+    typedef std::function<void(int error, const char* data)> ReadHandler;
+    typedef std::function<void(int error)> FlushHandler;
+public:
+    inline Stream(IOMultiPlexer& iomp, int fildes, size_t capacity = 65536,
+            size_t flush_size = 16384, bool mirror = false):
+            _iomp(iomp), _fildes(fildes), _base(nullptr), _capacity(1),
+            _mapped(false), _head(0), _tail(0), _want(0), _dispatching(false),
+            _reading(0), _closing(false), _flush_size(flush_size),
+            _flushing(false), _finishing(0) {
+        while (_capacity < capacity) {
+            _capacity *= 2;
+        }
+        if (mirror) {
+            this->map();
+        }
+        if (!_base) {
+            _base = new char[_capacity];
+        }
+        _ready.reset(_fildes, _base);
+        _ready.self = this;
+        _out.reset(_fildes, nullptr);
+        _out.self = this;
+    }
+    /* the write, a parked read and flush handlers may still be on their
+     * way out of a worker */
+    inline ~Stream() noexcept {
+        {
+            std::unique_lock<std::mutex> lock(_wlock);
+            __atomic_store_n(&_closing, true, __ATOMIC_RELEASE);
+            if (_reading > 0) {
+                ::shutdown(_fildes, SHUT_RD);
+            }
+            while (_finishing > 0 || _reading > 0 || _flushing) {
+                _finished.wait(lock);
+            }
+        }
+        if (_mapped) {
+            ::munmap(_base, _capacity * 2);
+        } else {
+            delete[] _base;
+        }
+    }
+    Stream(const Stream&) noexcept = delete;
+    Stream& operator=(const Stream&) noexcept = delete;
+public:
+    inline int fileno() const noexcept { return _fildes; }
+    inline size_t capacity() const noexcept { return _capacity; }
+    inline size_t buffered() const noexcept { return _tail - _head; }
+    inline bool mirrored() const noexcept { return _mapped; }
+    /* handler gets nbytes contiguous bytes, valid until it returns */
+    inline void read(size_t nbytes, ReadHandler handler) {
+        if (nbytes > _capacity) {
+            handler(EMSGSIZE, nullptr);
+            return;
+        }
+        _want = nbytes;
+        _rhandler = std::move(handler);
+        if (!_dispatching) {
+            this->pump();
+        }
+    }
+    inline void write(const void* data, size_t nbytes) {
+        struct iovec iov;
+        iov.iov_base = const_cast<void*>(data);
+        iov.iov_len = nbytes;
+        this->write(&iov, 1);
+    }
+    /* the pieces stay together, whoever else is writing */
+    inline void write(const struct iovec* iov, int iovcnt) {
+        std::unique_lock<std::mutex> lock(_wlock);
+        for (int i = 0; i < iovcnt; i++) {
+            const char* p = static_cast<const char*>(iov[i].iov_base);
+            _wbuf.insert(_wbuf.end(), p, p + iov[i].iov_len);
+        }
+        if (!_flushing && _wbuf.size() >= _flush_size) {
+            this->send(lock);
+        }
+    }
+    /* handler runs once everything written so far is out */
+    inline void flush(FlushHandler handler = FlushHandler()) {
+        std::unique_lock<std::mutex> lock(_wlock);
+        if (handler) {
+            _fhandlers.push_back(std::move(handler));
+        }
+        if (!_flushing) {
+            if (_wbuf.empty()) {
+                this->finish(lock, 0);
+            } else {
+                this->send(lock);
+            }
+        }
+    }
+private:
+    struct Aio : public ::iomp_aio {
+        Stream* self;
+        inline void reset(int fd, void* data) noexcept {
+            std::memset(static_cast<::iomp_aio*>(this), 0, sizeof(::iomp_aio));
+            fildes = fd;
+            buf = data;
+        }
+    };
+private:
+    void map() noexcept {
+#if defined(__linux__)
+        long page = ::sysconf(_SC_PAGESIZE);
+        if (page > 0 && _capacity < static_cast<size_t>(page)) {
+            _capacity = page;
+        }
+        int fd = ::memfd_create("iomp_stream", MFD_CLOEXEC);
+        if (fd == -1) {
+            return;
+        }
+        char* base = nullptr;
+        if (::ftruncate(fd, _capacity) == 0) {
+            void* p = ::mmap(nullptr, _capacity * 2, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            base = (p == MAP_FAILED ? nullptr : static_cast<char*>(p));
+        }
+        if (base && (::mmap(base, _capacity, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+                ::mmap(base + _capacity, _capacity, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)) {
+            ::munmap(base, _capacity * 2);
+            base = nullptr;
+        }
+        ::close(fd);
+        if (base) {
+            _base = base;
+            _mapped = true;
+        }
+#endif /* __linux__ */
+    }
+    /* reads as much as fits, 0 on progress, otherwise EAGAIN or an error */
+    int fill() noexcept {
+        size_t used = _tail - _head;
+        size_t at = _tail & (_capacity - 1);
+        size_t room = _capacity - used;
+        struct iovec iov[2];
+        int niov = 1;
+        iov[0].iov_base = _base + at;
+        if (_mapped || at + room <= _capacity) {
+            iov[0].iov_len = room;
+        } else {
+            iov[0].iov_len = _capacity - at;
+            iov[1].iov_base = _base;
+            iov[1].iov_len = room - iov[0].iov_len;
+            niov = 2;
+        }
+        while (1) {
+            ssize_t len = ::readv(_fildes, iov, niov);
+            if (len > 0) {
+                _tail += len;
+                return 0;
+            }
+            if (len == -1 && errno == EINTR) {
+                continue;
+            }
+            return len == -1 ? errno : -1;
+        }
+    }
+    const char* view(size_t nbytes) {
+        size_t at = _head & (_capacity - 1);
+        if (_mapped || at + nbytes <= _capacity) {
+            return _base + at;
+        }
+        _scratch.resize(nbytes);
+        std::memcpy(_scratch.data(), _base + at, _capacity - at);
+        std::memcpy(_scratch.data() + (_capacity - at), _base,
+                nbytes - (_capacity - at));
+        return _scratch.data();
+    }
+    void pump() {
+        _dispatching = true;
+        while (_rhandler) {
+            if (_tail - _head < _want) {
+                int error = this->fill();
+                if (error == 0) {
+                    continue;
+                }
+                if (error == EAGAIN) {
+                    /* on_ready may pump on a worker before iomp_read returns */
+                    _dispatching = false;
+                    _ready.complete = &Stream::on_ready;
+                    {
+                        std::lock_guard<std::mutex> lock(_wlock);
+                        _reading++;
+                    }
+                    ::iomp_read(_iomp, &_ready);
+                    return;
+                }
+                /* the stream is left alone once an error handler runs,
+                 * which may well end its owner */
+                ReadHandler handler(std::move(_rhandler));
+                _rhandler = nullptr;
+                _dispatching = false;
+                handler(error, nullptr);
+                return;
+            }
+            size_t nbytes = _want;
+            ReadHandler handler(std::move(_rhandler));
+            _rhandler = nullptr;
+            handler(0, this->view(nbytes));
+            _head += nbytes;
+        }
+        _dispatching = false;
+    }
+    static void on_ready(::iomp_aio_t aio, int error) {
+        Stream* self = static_cast<Aio*>(aio)->self;
+        if (__atomic_load_n(&self->_closing, __ATOMIC_ACQUIRE)) {
+            self->unpark();
+            return;
+        }
+        if (error != 0) {
+            ReadHandler handler(std::move(self->_rhandler));
+            self->_rhandler = nullptr;
+            self->unpark();
+            handler(error, nullptr);
+            return;
+        }
+        self->pump();
+        self->unpark();
+    }
+    /* the last a parked read does with the stream */
+    void unpark() {
+        std::lock_guard<std::mutex> lock(_wlock);
+        if (--_reading == 0) {
+            _finished.notify_all();
+        }
+    }
+    /* hands the write buffer to iomp, called with _wlock held */
+    void send(std::unique_lock<std::mutex>& lock) {
+        _flushing = true;
+        _wout.swap(_wbuf);
+        _wbuf.clear();
+        _out.buf = _wout.data();
+        _out.nbytes = _wout.size();
+        _out.complete = &Stream::on_sent;
+        lock.unlock();
+        int error = ::iomp_try_write(_iomp, &_out);
+        if (error == EINPROGRESS) {
+            lock.lock();
+            return;
+        }
+        lock.lock();
+        this->sent(lock, error);
+    }
+    void sent(std::unique_lock<std::mutex>& lock, int error) {
+        _flushing = false;
+        if (error != 0) {
+            _wbuf.clear();
+            this->finish(lock, error);
+        } else if (!_wbuf.empty() &&
+                (!_fhandlers.empty() || _wbuf.size() >= _flush_size)) {
+            this->send(lock);
+        } else if (_wbuf.empty()) {
+            this->finish(lock, 0);
+        }
+    }
+    void finish(std::unique_lock<std::mutex>& lock, int error) {
+        std::vector<FlushHandler> handlers;
+        handlers.swap(_fhandlers);
+        _finishing++;
+        lock.unlock();
+        for (auto& handler : handlers) {
+            handler(error);
+        }
+        lock.lock();
+        if (--_finishing == 0) {
+            _finished.notify_all();
+        }
+    }
+    static void on_sent(::iomp_aio_t aio, int error) {
+        Stream* self = static_cast<Aio*>(aio)->self;
+        std::unique_lock<std::mutex> lock(self->_wlock);
+        self->sent(lock, error);
+        if (!self->_flushing) {
+            self->_finished.notify_all();
+        }
+    }
+private:
+    IOMultiPlexer& _iomp;
+    int _fildes;
+    char* _base;
+    size_t _capacity;
+    bool _mapped;
+    size_t _head;
+    size_t _tail;
+    size_t _want;
+    bool _dispatching;
+    ReadHandler _rhandler;
+    std::vector<char> _scratch;
+    Aio _ready;
+    /* parked reads not yet done with the stream, and the destructor
+     * waiting for them; both under _wlock, _closing read without */
+    int _reading;
+    bool _closing;
+    std::mutex _wlock;
+    std::vector<char> _wbuf;
+    std::vector<char> _wout;
+    std::vector<FlushHandler> _fhandlers;
+    size_t _flush_size;
+    bool _flushing;
+    int _finishing;
+    std::condition_variable _finished;
+    Aio _out;
+};
+
+/* Pipelined calls over one connection: any number may be in flight, the
+ * requests share the stream's coalesced writes and its one read loop
+ * matches each response to its call by id. Both ways a message is a 4
+ * byte big endian length of the rest, an 8 byte big endian id and the
+ * payload; the peer answers with the id of the request, in any order.
+ * Handlers run where the stream delivers the response, the payload only
+ * valid until they return. Once the connection fails every pending and
+ * later call completes with the error, -1 for end of file, and the
+ * futures with a std::system_error. Responses are bounded by capacity.
+ * shutdown() fails what is pending with ECANCELED and ends the read loop
+ * by shutting the socket down both ways, the fd stays open; destroying
+ * the channel does the same and waits for the loop and the last flush,
+ * so never from one of its own handlers. */
+class Channel {
+public:
+    typedef std::function<void(int error, const char* data,
+            size_t nbytes)> Handler;
+    static const size_t header_size = 12;
+public:
+    inline Channel(IOMultiPlexer& iomp, int fildes, size_t capacity = 65536,
+            size_t flush_size = 16384):
+            _stream(iomp, fildes, capacity, flush_size), _next(0), _error(0),
+            _closed(false), _sending(0), _count(0), _slots(16), _rid(0),
+            _want(0) {
+        this->next();
+    }
+    inline ~Channel() noexcept {
+        this->shutdown();
+        std::unique_lock<std::mutex> lock(_lock);
+        while (!_closed || __atomic_load_n(&_sending, __ATOMIC_ACQUIRE) > 0) {
+            _idle.wait(lock);
+        }
+    }
+    Channel(const Channel&) noexcept = delete;
+    Channel& operator=(const Channel&) noexcept = delete;
+public:
+    inline int fileno() const noexcept { return _stream.fileno(); }
+    inline bool closed() const noexcept {
+        return __atomic_load_n(&_closed, __ATOMIC_ACQUIRE);
+    }
+    inline size_t pending() noexcept {
+        std::lock_guard<std::mutex> lock(_lock);
+        return _count;
+    }
+    inline void shutdown() noexcept {
+        this->fail(ECANCELED);
+        ::shutdown(_stream.fileno(), SHUT_RDWR);
+    }
+    inline void call(const void* data, size_t nbytes, Handler handler) {
+        if (nbytes > UINT32_MAX - 8) {
+            handler(EMSGSIZE, nullptr, 0);
+            return;
+        }
+        std::unique_lock<std::mutex> lock(_lock);
+        if (_error != 0) {
+            int error = _error;
+            lock.unlock();
+            handler(error, nullptr, 0);
+            return;
+        }
+        uint64_t id = ++_next;
+        this->insert(id, std::move(handler));
+        __atomic_add_fetch(&_sending, 1, __ATOMIC_RELAXED);
+        lock.unlock();
+        unsigned char hdr[header_size];
+        encode(hdr, 8 + nbytes, 4);
+        encode(hdr + 4, id, 8);
+        struct iovec iov[2];
+        iov[0].iov_base = hdr;
+        iov[0].iov_len = sizeof(hdr);
+        iov[1].iov_base = const_cast<void*>(data);
+        iov[1].iov_len = nbytes;
+        _stream.write(iov, 2);
+        _stream.flush([this](int error) { this->flushed(error); });
+    }
+    inline std::future<std::string> call(const void* data, size_t nbytes) {
+        auto promise = std::make_shared<std::promise<std::string>>();
+        auto future = promise->get_future();
+        this->call(data, nbytes,
+                [promise](int error, const char* p, size_t n) {
+            if (error == 0) {
+                promise->set_value(std::string(p, n));
+            } else {
+                promise->set_exception(std::make_exception_ptr(
+                        std::system_error(error == -1 ? ECONNRESET : error,
+                                std::generic_category())));
+            }
+        });
+        return future;
+    }
+private:
+    struct Slot {
+        /* 0 if free */
+        uint64_t id;
+        Handler handler;
+    };
+private:
+    static void encode(unsigned char* p, uint64_t v, int n) noexcept {
+        for (int i = n - 1; i >= 0; i--, v >>= 8) {
+            p[i] = static_cast<unsigned char>(v);
+        }
+    }
+    static uint64_t decode(const char* p, int n) noexcept {
+        uint64_t v = 0;
+        for (int i = 0; i < n; i++) {
+            v = (v << 8) | static_cast<unsigned char>(p[i]);
+        }
+        return v;
+    }
+    /* the read loop, one header then one payload */
+    void next() {
+        _stream.read(header_size, [this](int error, const char* p) {
+            if (error != 0) {
+                this->close(error);
+                return;
+            }
+            uint64_t len = decode(p, 4);
+            if (len < 8 || len - 8 > _stream.capacity()) {
+                this->abort(len < 8 ? EPROTO : EMSGSIZE);
+                return;
+            }
+            _rid = decode(p + 4, 8);
+            _want = len - 8;
+            _stream.read(_want, [this](int error, const char* p) {
+                if (error != 0) {
+                    this->close(error);
+                    return;
+                }
+                this->reply(p);
+            });
+        });
+    }
+    void reply(const char* data) {
+        size_t nbytes = _want;
+        Handler handler;
+        {
+            std::lock_guard<std::mutex> lock(_lock);
+            this->take(_rid, handler);
+        }
+        if (handler) {
+            handler(0, data, nbytes);
+        } else {
+            IOMP_LOG(DEBUG, "no call %llu on fd %d",
+                    (unsigned long long)_rid, _stream.fileno());
+        }
+        this->next();
+    }
+    /* a bad response, the stream is still going on with the one before;
+     * it runs into end of file and closes the way any error does */
+    void abort(int error) {
+        this->fail(error);
+        ::shutdown(_stream.fileno(), SHUT_RDWR);
+        this->next();
+    }
+    /* once per call, the destructor waits for the last of them */
+    void flushed(int error) {
+        if (error != 0) {
+            this->fail(error);
+        }
+        if (__atomic_sub_fetch(&_sending, 1, __ATOMIC_ACQ_REL) == 0) {
+            std::lock_guard<std::mutex> lock(_lock);
+            _idle.notify_all();
+        }
+    }
+    /* the last the read loop does, the channel may be gone right after */
+    void close(int error) {
+        this->fail(error);
+        std::lock_guard<std::mutex> lock(_lock);
+        __atomic_store_n(&_closed, true, __ATOMIC_RELEASE);
+        _idle.notify_all();
+    }
+    void fail(int error) {
+        std::vector<Handler> handlers;
+        {
+            std::lock_guard<std::mutex> lock(_lock);
+            if (_error == 0) {
+                _error = error;
+            }
+            for (auto& slot : _slots) {
+                if (slot.id != 0) {
+                    handlers.push_back(std::move(slot.handler));
+                    slot.id = 0;
+                    slot.handler = nullptr;
+                }
+            }
+            _count = 0;
+        }
+        for (auto& handler : handlers) {
+            handler(error, nullptr, 0);
+        }
+    }
+    /* open addressing with linear probing; ids are sequential, so they
+     * index the table directly. Called with _lock held. */
+    void insert(uint64_t id, Handler&& handler) {
+        if ((_count + 1) * 2 > _slots.size()) {
+            std::vector<Slot> slots(_slots.size() * 2);
+            slots.swap(_slots);
+            for (auto& slot : slots) {
+                if (slot.id != 0) {
+                    this->place(slot.id, std::move(slot.handler));
+                }
+            }
+        }
+        this->place(id, std::move(handler));
+        _count++;
+    }
+    void place(uint64_t id, Handler&& handler) {
+        size_t mask = _slots.size() - 1;
+        size_t i = id & mask;
+        while (_slots[i].id != 0) {
+            i = (i + 1) & mask;
+        }
+        _slots[i].id = id;
+        _slots[i].handler = std::move(handler);
+    }
+    bool take(uint64_t id, Handler& handler) {
+        size_t mask = _slots.size() - 1;
+        size_t i = id & mask;
+        while (_slots[i].id != id) {
+            if (_slots[i].id == 0) {
+                return false;
+            }
+            i = (i + 1) & mask;
+        }
+        handler = std::move(_slots[i].handler);
+        /* shift later entries of the run back, no tombstones */
+        for (size_t j = (i + 1) & mask; _slots[j].id != 0; j = (j + 1) & mask) {
+            size_t home = _slots[j].id & mask;
+            if (i <= j ? (i < home && home <= j) : (i < home || home <= j)) {
+                continue;
+            }
+            _slots[i].id = _slots[j].id;
+            _slots[i].handler = std::move(_slots[j].handler);
+            i = j;
+        }
+        _slots[i].id = 0;
+        _slots[i].handler = nullptr;
+        _count--;
+        return true;
+    }
+private:
+    Stream _stream;
+    std::mutex _lock;
+    uint64_t _next;
+    int _error;
+    bool _closed;
+    /* calls whose flush handler has not run yet */
+    size_t _sending;
+    std::condition_variable _idle;
+    size_t _count;
+    std::vector<Slot> _slots;
+    /* the response being read, only touched by the read loop */
+    uint64_t _rid;
+    size_t _want;
+};
+
+/* Outbound connections kept per destination address. Idle connections sit
+ * on a lock free LIFO stack of up to max_idle, so the most recently used,
+ * warmest one goes out first; once more than min_idle are idle, those
+ * unused for idle_ms are closed from a timer on the workers. A destination
+ * keeps min_idle connections dialed ahead, from the first get() on.
+ * Look a destination up once, under a lock, and keep it: acquire and
+ * release on it take no locks. An idle connection is checked for a hang
+ * up (one MSG_PEEK) before it is handed out, and acquire dials through
+ * iomp when none is left, the handler then running on a worker with the
+ * error and -1 on failure. Release a connection with reusable false, or
+ * close it, once its state is unknown (an error, an unread response).
+ * Destinations live as long as the pool, the fds handed out are the
+ * caller's, to iomp_forget before closing them. */
+class ConnectionPool {
+public:
+    typedef std::function<void(int error, int fd)> Handler;
+    class Destination;
+public:
+    inline ConnectionPool(IOMultiPlexer& iomp, size_t min_idle = 0,
+            size_t max_idle = 8, int idle_ms = 60000,
+            const std::vector<::iomp_sockopt>& opts =
+                    std::vector<::iomp_sockopt>()):
+            _iomp(iomp), _min_idle(std::min(min_idle, max_idle)),
+            _max_idle(max_idle), _idle_ms(idle_ms), _opts(opts) { }
+    inline ~ConnectionPool() noexcept {
+        std::lock_guard<std::mutex> lock(_lock);
+        for (auto& dest : _dests) {
+            dest.second->shutdown();
+        }
+    }
+    ConnectionPool(const ConnectionPool&) noexcept = delete;
+    ConnectionPool& operator=(const ConnectionPool&) noexcept = delete;
+public:
+    inline Destination& get(const struct sockaddr* addr, socklen_t addrlen) {
+        std::string key(reinterpret_cast<const char*>(addr), addrlen);
+        std::lock_guard<std::mutex> lock(_lock);
+        auto it = _dests.find(key);
+        if (it != _dests.end()) {
+            return *it->second;
+        }
+        std::shared_ptr<Destination> dest(new Destination(*this, addr,
+                addrlen));
+        _dests.emplace(std::move(key), dest);
+        dest->start();
+        return *dest;
+    }
+    inline void acquire(const struct sockaddr* addr, socklen_t addrlen,
+            Handler handler) {
+        this->get(addr, addrlen).acquire(std::move(handler));
+    }
+public:
+    class Destination : public std::enable_shared_from_this<Destination> {
+    public:
+        inline ~Destination() noexcept {
+            this->drain();
+        }
+        Destination(const Destination&) noexcept = delete;
+        Destination& operator=(const Destination&) noexcept = delete;
+    public:
+        inline size_t idle() const noexcept {
+            return _nidle.load(std::memory_order_relaxed);
+        }
+        /* an idle connection or -1, never blocks nor dials */
+        inline int try_acquire() noexcept {
+            uint32_t i;
+            while ((i = pop(_idle)) != 0) {
+                _nidle.fetch_sub(1, std::memory_order_relaxed);
+                int fd = _nodes[i - 1].fd;
+                push(_free, i);
+                if (alive(fd)) {
+                    return fd;
+                }
+                this->discard(fd);
+            }
+            return -1;
+        }
+        inline void acquire(Handler handler) {
+            int fd = this->try_acquire();
+            this->warm();
+            if (fd != -1) {
+                handler(0, fd);
+            } else {
+                this->dial(std::move(handler));
+            }
+        }
+        inline void release(int fd, bool reusable = true) noexcept {
+            uint32_t i = 0;
+            if (reusable && !_closed.load(std::memory_order_acquire)) {
+                i = pop(_free);
+            }
+            if (i == 0) {
+                this->discard(fd);
+                return;
+            }
+            _nodes[i - 1].fd = fd;
+            _nodes[i - 1].stamp = now();
+            _nidle.fetch_add(1, std::memory_order_relaxed);
+            push(_idle, i);
+        }
+        /* dials until min_idle are idle or on their way */
+        inline void warm() {
+            size_t dialing = _dialing.load(std::memory_order_relaxed);
+            while (!_closed.load(std::memory_order_relaxed) &&
+                    this->idle() + dialing < _min_idle) {
+                if (_dialing.compare_exchange_weak(dialing, dialing + 1,
+                        std::memory_order_relaxed)) {
+                    this->dial(Handler());
+                    dialing = _dialing.load(std::memory_order_relaxed);
+                }
+            }
+        }
+    private:
+        friend class ConnectionPool;
+        struct Node {
+            int fd;
+            int64_t stamp;
+            std::atomic<uint32_t> next;
+        };
+        struct Dial : public ::iomp_aio {
+            std::shared_ptr<Destination> dest;
+            Handler handler;
+        };
+    private:
+        inline Destination(ConnectionPool& pool, const struct sockaddr* addr,
+                socklen_t addrlen):
+                _pool(pool), _iomp(pool._iomp), _min_idle(pool._min_idle),
+                _idle_ms(pool._idle_ms), _addrlen(addrlen),
+                _nodes(pool._max_idle), _idle(0), _free(0), _nidle(0), _dialing(0), _closed(false) {
+            std::memcpy(&_addr, addr, std::min<size_t>(addrlen, sizeof(_addr)));
+            for (size_t i = _nodes.size(); i > 0; i--) {
+                push(_free, i);
+            }
+        }
+        void start() {
+            this->warm();
+            if (_idle_ms > 0) {
+                this->schedule();
+            }
+        }
+        void shutdown() noexcept {
+            _closed.store(true, std::memory_order_release);
+            this->drain();
+        }
+        void drain() noexcept {
+            uint32_t i;
+            while ((i = pop(_idle)) != 0) {
+                _nidle.fetch_sub(1, std::memory_order_relaxed);
+                this->discard(_nodes[i - 1].fd);
+                push(_free, i);
+            }
+        }
+        /* heads are (tag << 32) | (index + 1), the tag keeps pops from
+         * mistaking a node that left and came back for an unchanged stack */
+        uint32_t pop(std::atomic<uint64_t>& head) noexcept {
+            uint64_t old = head.load(std::memory_order_acquire);
+            while (static_cast<uint32_t>(old) != 0) {
+                Node& node = _nodes[static_cast<uint32_t>(old) - 1];
+                uint64_t top = ((old >> 32) + 1) << 32 |
+                        node.next.load(std::memory_order_relaxed);
+                if (head.compare_exchange_weak(old, top,
+                        std::memory_order_acquire)) {
+                    return static_cast<uint32_t>(old);
+                }
+            }
+            return 0;
+        }
+        void push(std::atomic<uint64_t>& head, uint32_t i) noexcept {
+            uint64_t old = head.load(std::memory_order_relaxed);
+            uint64_t top;
+            do {
+                _nodes[i - 1].next.store(static_cast<uint32_t>(old),
+                        std::memory_order_relaxed);
+                top = ((old >> 32) + 1) << 32 | i;
+            } while (!head.compare_exchange_weak(old, top,
+                    std::memory_order_release, std::memory_order_relaxed));
+        }
+        void discard(int fd) noexcept {
+            ::iomp_forget(_iomp, fd);
+            ::close(fd);
+        }
+        static bool alive(int fd) noexcept {
+            char c;
+            ssize_t len = ::recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+            /* end of file, an error, or bytes nobody asked for */
+            return len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+        }
+        static int64_t now() noexcept {
+            return std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+        /* a null handler dials for the idle stack */
+        void dial(Handler handler) {
+            int fd = this->open();
+            if (fd == -1) {
+                this->dialed(handler, errno, -1);
+                return;
+            }
+            Dial* aio = new Dial();
+            std::memset(static_cast<::iomp_aio*>(aio), 0, sizeof(::iomp_aio));
+            aio->fildes = fd;
+            aio->complete = &Destination::on_connect;
+            aio->dest = this->shared_from_this();
+            aio->handler = std::move(handler);
+            ::iomp_connect(_iomp, aio,
+                    reinterpret_cast<const struct sockaddr*>(&_addr), _addrlen);
+        }
+        int open() noexcept {
+            int family = reinterpret_cast<const struct sockaddr*>(&_addr)->
+                    sa_family;
+#if defined(__linux__) || defined(__FreeBSD__)
+            int fd = ::socket(family, SOCK_STREAM | SOCK_NONBLOCK |
+                    SOCK_CLOEXEC, 0);
+#else
+            int fd = ::socket(family, SOCK_STREAM, 0);
+            if (fd != -1) {
+                ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+                ::fcntl(fd, F_SETFD, ::fcntl(fd, F_GETFD, 0) | FD_CLOEXEC);
+            }
+#endif
+            if (fd == -1) {
+                return -1;
+            }
+            for (auto& opt : _pool._opts) {
+                if (::setsockopt(fd, opt.level, opt.name,
+                        &opt.value, sizeof(opt.value)) == -1) {
+                    IOMP_LOG(WARNING, "setsockopt fail: %s", strerror(errno));
+                }
+            }
+            return fd;
+        }
+        static void on_connect(::iomp_aio_t aio, int error) {
+            std::unique_ptr<Dial> self(static_cast<Dial*>(aio));
+            int fd = self->fildes;
+            if (error != 0) {
+                self->dest->discard(fd);
+                fd = -1;
+            }
+            self->dest->dialed(self->handler, error, fd);
+        }
+        void dialed(Handler& handler, int error, int fd) {
+            if (handler) {
+                handler(error, fd);
+                return;
+            }
+            _dialing.fetch_sub(1, std::memory_order_relaxed);
+            if (error == 0) {
+                this->release(fd);
+            } else {
+                IOMP_LOG(WARNING, "warm up connect fail: %s",
+                        error == -1 ? "shutdown" : strerror(error));
+            }
+        }
+        void schedule() {
+            std::shared_ptr<Destination> self(this->shared_from_this());
+            ::iomp_schedule(_iomp, std::max(_idle_ms / 2, 1),
+                    &Task<std::function<void(int)>>::dispatch,
+                    new Task<std::function<void(int)>>([self](int error) {
+                if (error == 0 && !self->_closed.load(
+                        std::memory_order_acquire)) {
+                    self->evict();
+                    self->schedule();
+                }
+            }));
+        }
+        /* takes the whole stack, keeps the newest min_idle and the ones
+         * used within idle_ms, and puts those back oldest first; a pool
+         * only sees an empty stack for that long */
+        void evict() {
+            uint64_t old = _idle.load(std::memory_order_acquire);
+            while (!_idle.compare_exchange_weak(old, ((old >> 32) + 1) << 32,
+                    std::memory_order_acquire)) {
+            }
+            std::vector<uint32_t> keep;
+            int64_t deadline = now() - _idle_ms;
+            size_t taken = 0;
+            for (uint32_t i = static_cast<uint32_t>(old); i != 0; taken++) {
+                Node& node = _nodes[i - 1];
+                uint32_t next = node.next.load(std::memory_order_relaxed);
+                if (keep.size() < _min_idle || node.stamp > deadline) {
+                    keep.push_back(i);
+                } else {
+                    this->discard(node.fd);
+                    push(_free, i);
+                }
+                i = next;
+            }
+            _nidle.fetch_sub(taken - keep.size(), std::memory_order_relaxed);
+            for (auto it = keep.rbegin(); it != keep.rend(); ++it) {
+                push(_idle, *it);
+            }
+            if (taken > keep.size()) {
+                IOMP_LOG(DEBUG, "%zu idle connections evicted",
+                        taken - keep.size());
+            }
+        }
+    private:
+        /* only touched from the caller's side, timers and dials may
+         * outlive the pool */
+        ConnectionPool& _pool;
+        ::iomp_t _iomp;
+        size_t _min_idle;
+        int _idle_ms;
+        struct sockaddr_storage _addr;
+        socklen_t _addrlen;
+        std::vector<Node> _nodes;
+        std::atomic<uint64_t> _idle;
+        std::atomic<uint64_t> _free;
+        std::atomic<size_t> _nidle;
+        std::atomic<size_t> _dialing;
+        std::atomic<bool> _closed;
+    };
+private:
+    IOMultiPlexer& _iomp;
+    size_t _min_idle;
+    size_t _max_idle;
+    int _idle_ms;
+    std::vector<::iomp_sockopt> _opts;
+    std::mutex _lock;
+    std::map<std::string, std::shared_ptr<Destination>> _dests;
+};
+
 } /* namespace iomp */
 
 #endif /* __cplusplus */
@@ -0,0 +1,151 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "iomp_queue.h"
+#include "iomp.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define IOMP_CRC_SSE42 1
+#endif /* __x86_64__ */
+
+/* reflected Castagnoli polynomial */
+#define IOMP_CRC_POLY 0x82f63b78
+
+static uint32_t g_crc_table[8][256];
+static uint32_t (*g_crc_impl)(uint32_t crc, const unsigned char* p,
+        size_t len) = NULL;
+static pthread_once_t g_crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void);
+static uint32_t crc_sw(uint32_t crc, const unsigned char* p, size_t len);
+#if IOMP_CRC_SSE42
+static uint32_t crc_hw(uint32_t crc, const unsigned char* p, size_t len);
+#endif /* IOMP_CRC_SSE42 */
+
+uint32_t iomp_crc32c(uint32_t crc, const void* data, size_t len) {
+    pthread_once(&g_crc_once, crc_init);
+    return ~g_crc_impl(~crc, (const unsigned char*)data, len);
+}
+
+#if !IOMP_COMPACT
+
+int iomp_crc_start(iomp_aio_t aio, int write) {
+    if (!(aio->flags & IOMP_AIO_CRC32C)) {
+        return 0;
+    }
+    if (aio->nbytes < 4) {
+        return EINVAL;
+    }
+    unsigned char* trailer = (unsigned char*)aio->buf + aio->nbytes - 4;
+    if (!write) {
+        aio->crc = 0;
+        return 0;
+    }
+    uint32_t crc = iomp_crc32c(0, aio->buf, aio->nbytes - 4);
+    trailer[0] = crc >> 24;
+    trailer[1] = crc >> 16;
+    trailer[2] = crc >> 8;
+    trailer[3] = crc;
+    return 0;
+}
+
+void iomp_crc_feed(iomp_aio_t aio, const void* data, size_t len) {
+    size_t pos = (const char*)data - (const char*)aio->buf;
+    size_t end = aio->nbytes - 4;
+    if (pos >= end) {
+        return;
+    }
+    aio->crc = iomp_crc32c(aio->crc, data, len < end - pos ? len : end - pos);
+}
+
+int iomp_crc_check(iomp_aio_t aio) {
+    const unsigned char* trailer =
+            (const unsigned char*)aio->buf + aio->nbytes - 4;
+    uint32_t crc = (uint32_t)trailer[0] << 24 | (uint32_t)trailer[1] << 16 |
+            (uint32_t)trailer[2] << 8 | trailer[3];
+    if (crc != aio->crc) {
+        IOMP_LOG(WARNING, "crc mismatch on fd %d", aio->fildes);
+        return EBADMSG;
+    }
+    return 0;
+}
+
+#endif /* IOMP_COMPACT */
+
+void crc_init(void) {
+    for (int i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; j++) {
+            crc = (crc >> 1) ^ (IOMP_CRC_POLY & -(crc & 1));
+        }
+        g_crc_table[0][i] = crc;
+    }
+    for (int i = 0; i < 256; i++) {
+        for (int k = 1; k < 8; k++) {
+            uint32_t crc = g_crc_table[k - 1][i];
+            g_crc_table[k][i] = (crc >> 8) ^ g_crc_table[0][crc & 0xff];
+        }
+    }
+    g_crc_impl = crc_sw;
+#if IOMP_CRC_SSE42
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        g_crc_impl = crc_hw;
+    }
+#endif /* IOMP_CRC_SSE42 */
+}
+
+/* slicing by 8 on little endian, a byte at a time elsewhere */
+uint32_t crc_sw(uint32_t crc, const unsigned char* p, size_t len) {
+    while (len > 0 && ((uintptr_t)p & 7) != 0) {
+        crc = (crc >> 8) ^ g_crc_table[0][(crc ^ *p++) & 0xff];
+        len--;
+    }
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (len >= 8) {
+        uint32_t lo = 0;
+        uint32_t hi = 0;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = g_crc_table[7][lo & 0xff] ^ g_crc_table[6][(lo >> 8) & 0xff] ^
+                g_crc_table[5][(lo >> 16) & 0xff] ^ g_crc_table[4][lo >> 24] ^
+                g_crc_table[3][hi & 0xff] ^ g_crc_table[2][(hi >> 8) & 0xff] ^
+                g_crc_table[1][(hi >> 16) & 0xff] ^ g_crc_table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+#endif /* __BYTE_ORDER__ */
+    while (len > 0) {
+        crc = (crc >> 8) ^ g_crc_table[0][(crc ^ *p++) & 0xff];
+        len--;
+    }
+    return crc;
+}
+
+#if IOMP_CRC_SSE42
+__attribute__((target("sse4.2")))
+uint32_t crc_hw(uint32_t crc, const unsigned char* p, size_t len) {
+    while (len > 0 && ((uintptr_t)p & 7) != 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+        len--;
+    }
+    uint64_t crc64 = crc;
+    while (len >= 8) {
+        uint64_t v = 0;
+        memcpy(&v, p, 8);
+        crc64 = _mm_crc32_u64(crc64, v);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)crc64;
+    while (len > 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+        len--;
+    }
+    return crc;
+}
+#endif /* IOMP_CRC_SSE42 */
@@ -1,10 +1,12 @@
 #include "iomp.h"
 
-#if defined(__linux__)
+#if defined(__linux__) && !IOMP_LOOPBACK
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/epoll.h>
@@ -12,15 +14,55 @@
 #include <sys/socket.h>
 #include "iomp_queue.h"
 
+/* an aio that used up its budget, continued after the other events */
+struct iomp_pending {
+    iomp_aio_t aio;
+    uint32_t events;
+};
+
+/* fds stay registered between aios and only interest changes reach the
+ * kernel; ready keeps edges that came in while nothing was pending */
+struct iomp_fdent {
+    iomp_aio_t rd;
+    iomp_aio_t wr;
+    uint32_t interest;
+    uint32_t ready;
+};
+
+/* epoll data: 0 is the interrupt, odd values are table fds, anything
+ * else an accept aio */
+#define FD_DATA(fd) (((uint64_t)(fd) << 1) | 1)
+
+/* fds forgotten since the last park, past that many the whole table is */
+#define FD_FORGET_MAX 64
+
 struct iomp_queue {
     int epfd;
     int intr[2];
     int nevents;
+    struct iomp_pending* pend;
+    int npend;
+    int maxpend;
+    /* entry i is fd i * nshards + shard */
+    struct iomp_fdent* fds;
+    int nfds;
+    int shard;
+    int nshards;
+    /* from iomp_queue_forget on any thread, applied on the next park */
+    int forget_lock;
+    int nforgot;
+    int forgot[FD_FORGET_MAX];
     struct epoll_event evs[];
 };
 
-static void on_read(iomp_queue_t q, iomp_aio_t aio);
-static void on_write(iomp_queue_t q, iomp_aio_t aio);
+static struct iomp_fdent* fd_get(iomp_queue_t q, int fd);
+static void fd_forgotten(iomp_queue_t q);
+static int fd_park(iomp_queue_t q, iomp_aio_t aio, uint32_t dir);
+static void fd_done(iomp_queue_t q, iomp_aio_t aio, uint32_t dir);
+static void fd_event(iomp_queue_t q, int fd, uint32_t events);
+static int on_event(iomp_queue_t q, iomp_aio_t aio, uint32_t events);
+static int on_read(iomp_queue_t q, iomp_aio_t aio, size_t budget);
+static int on_write(iomp_queue_t q, iomp_aio_t aio, size_t budget);
 
 iomp_queue_t iomp_queue_new(int nevents) {
     if (nevents <= 0) {
@@ -33,6 +75,15 @@ iomp_queue_t iomp_queue_new(int nevents) {
         return NULL;
     }
     q->nevents = nevents;
+    q->pend = NULL;
+    q->npend = 0;
+    q->maxpend = 0;
+    q->fds = NULL;
+    q->nfds = 0;
+    q->shard = 0;
+    q->nshards = 1;
+    q->forget_lock = 0;
+    q->nforgot = 0;
     q->epfd = epoll_create(1);
     if (q->epfd == -1) {
         IOMP_LOG(ERROR, "epoll_create fail: %s", strerror(errno));
@@ -48,7 +99,9 @@ iomp_queue_t iomp_queue_new(int nevents) {
     //fcntl(q->intr[0], F_SETFL, fcntl(q->intr[0], F_GETFL, 0) | O_NONBLOCK);
     int sndbuf = sizeof(int);
     setsockopt(q->intr[1], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
-    struct epoll_event epev = { EPOLLIN | EPOLLONESHOT, { NULL } };
+    struct epoll_event epev;
+    epev.events = EPOLLIN | EPOLLONESHOT;
+    epev.data.u64 = 0;
     if (epoll_ctl(q->epfd, EPOLL_CTL_ADD, q->intr[0], &epev) == -1) {
         IOMP_LOG(ERROR, "epoll_event fail: %s", strerror(errno));
         close(q->intr[1]);
@@ -67,48 +120,62 @@ void iomp_queue_drop(iomp_queue_t q) {
     close(q->intr[1]);
     close(q->intr[0]);
     close(q->epfd);
+    free(q->pend);
+    free(q->fds);
     free(q);
 }
 
 int iomp_queue_read(iomp_queue_t q, iomp_aio_t aio) {
-    if (!q || !aio || !aio->complete || !aio->buf) {
+    if (!q || !aio || (!aio->complete && !aio->ring) || !aio->buf) {
         errno = EINVAL;
         return -1;
     }
-    struct epoll_event epev = { EPOLLIN | EPOLLET, { aio } };
-    return epoll_ctl(q->epfd, EPOLL_CTL_ADD, aio->fildes, &epev);
+    return fd_park(q, aio, EPOLLIN);
 }
 
 int iomp_queue_write(iomp_queue_t q, iomp_aio_t aio) {
-    if (!q || !aio || !aio->complete || !aio->buf) {
+    if (!q || !aio || (!aio->complete && !aio->ring) || !aio->buf) {
         errno = EINVAL;
         return -1;
     }
-    struct epoll_event epev = { EPOLLOUT | EPOLLET, { aio } };
-    return epoll_ctl(q->epfd, EPOLL_CTL_ADD, aio->fildes, &epev);
+    return fd_park(q, aio, EPOLLOUT);
 }
 
 int iomp_queue_accept(iomp_queue_t q, struct iomp_aio* aio) {
-    if (!q || !aio || !aio->complete || aio->buf) {
+    if (!q || !aio || (!aio->complete && !aio->ring) || aio->buf) {
         errno = EINVAL;
         return -1;
     }
-    struct epoll_event epev = { EPOLLIN, { aio } };
+    struct epoll_event epev;
+    epev.events = EPOLLIN;
+    epev.data.u64 = 0;
+    epev.data.ptr = aio;
     return epoll_ctl(q->epfd, EPOLL_CTL_ADD, aio->fildes, &epev);
 }
 
+int iomp_queue_unaccept(iomp_queue_t q, struct iomp_aio* aio) {
+    if (!q || !aio) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct epoll_event epev = { 0, { NULL } };
+    return epoll_ctl(q->epfd, EPOLL_CTL_DEL, aio->fildes, &epev);
+}
+
 int iomp_queue_run(iomp_queue_t q, int timeout) {
     if (!q) {
         errno = EINVAL;
         return -1;
     }
-    int rv = epoll_wait(q->epfd, q->evs, q->nevents, timeout);
+    int rv = epoll_wait(q->epfd, q->evs, q->nevents,
+            q->npend > 0 ? 0 : timeout);
     if (rv == -1) {
         return rv;
     }
+    int npend = q->npend;
     for (int i = 0; i < rv; i++) {
         struct epoll_event* epev = q->evs + i;
-        if (epev->data.ptr == NULL) {
+        if (epev->data.u64 == 0) {
             int buf = 0;
             read(q->intr[0], &buf, sizeof(buf));
             //IOMP_LOG(DEBUG, "interrupted %d", q->epfd);
@@ -116,19 +183,28 @@ int iomp_queue_run(iomp_queue_t q, int timeout) {
             epoll_ctl(q->epfd, EPOLL_CTL_MOD, q->intr[0], epev);
             continue;
         }
-        iomp_aio_t aio = (iomp_aio_t)epev->data.ptr;
-        if (!aio->buf) {
-            aio->complete(aio, 0);
+        if (epev->data.u64 & 1) {
+            fd_event(q, (int)(epev->data.u64 >> 1), epev->events);
             continue;
         }
-        if (epev->events & EPOLLIN) {
-            on_read(q, aio);
-        }
-        if (epev->events & EPOLLOUT) {
-            on_write(q, aio);
-        }
+        iomp_complete((iomp_aio_t)epev->data.ptr, 0);
     }
-    return 0;
+    /* one more slice for each aio left over from the last round */
+    for (int i = 0; i < npend; i++) {
+        struct iomp_pending pend = q->pend[i];
+        on_event(q, pend.aio, pend.events);
+    }
+    q->npend -= npend;
+    memmove(q->pend, q->pend + npend, sizeof(*q->pend) * q->npend);
+    return q->npend;
+}
+
+int iomp_queue_fileno(iomp_queue_t q) {
+    if (!q) {
+        errno = EINVAL;
+        return -1;
+    }
+    return q->epfd;
 }
 
 void iomp_queue_interrupt(iomp_queue_t q) {
@@ -139,55 +215,266 @@ void iomp_queue_interrupt(iomp_queue_t q) {
     write(q->intr[1], &buf, sizeof(buf));
 }
 
-void on_read(iomp_queue_t q, iomp_aio_t aio) {
+void iomp_queue_shard(iomp_queue_t q, int index, int count) {
+    if (!q || count <= 0 || index < 0 || index >= count || q->nfds > 0) {
+        return;
+    }
+    q->shard = index;
+    q->nshards = count;
+}
+
+void iomp_queue_forget(iomp_queue_t q, int fd) {
+    if (!q || fd < 0) {
+        return;
+    }
+    /* a dup would keep the registration alive past close */
+    struct epoll_event epev = { 0, { NULL } };
+    epoll_ctl(q->epfd, EPOLL_CTL_DEL, fd, &epev);
+    while (__atomic_exchange_n(&q->forget_lock, 1, __ATOMIC_ACQUIRE)) {
+    }
+    if (q->nforgot < FD_FORGET_MAX) {
+        q->forgot[q->nforgot] = fd;
+    }
+    __atomic_store_n(&q->nforgot, q->nforgot + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&q->forget_lock, 0, __ATOMIC_RELEASE);
+}
+
+void fd_forgotten(iomp_queue_t q) {
+    while (__atomic_exchange_n(&q->forget_lock, 1, __ATOMIC_ACQUIRE)) {
+    }
+    int n = q->nforgot;
+    q->nforgot = 0;
+    for (int i = 0; i < n && i < FD_FORGET_MAX; i++) {
+        int fd = q->forgot[i];
+        if (fd % q->nshards == q->shard && fd / q->nshards < q->nfds) {
+            q->fds[fd / q->nshards].interest = 0;
+            q->fds[fd / q->nshards].ready = 0;
+        }
+    }
+    __atomic_store_n(&q->forget_lock, 0, __ATOMIC_RELEASE);
+    /* too many to list, start over with everything idle */
+    for (int i = 0; n > FD_FORGET_MAX && i < q->nfds; i++) {
+        if (!q->fds[i].rd && !q->fds[i].wr) {
+            q->fds[i].interest = 0;
+            q->fds[i].ready = 0;
+        }
+    }
+}
+
+struct iomp_fdent* fd_get(iomp_queue_t q, int fd) {
+    if (fd < 0) {
+        errno = EBADF;
+        return NULL;
+    }
+    if (fd % q->nshards != q->shard) {
+        IOMP_LOG(ERROR, "fd %d parked outside its shard", fd);
+        errno = EXDEV;
+        return NULL;
+    }
+    int slot = fd / q->nshards;
+    if (slot >= q->nfds) {
+        int n = q->nfds > 0 ? q->nfds : 64;
+        while (n <= slot) {
+            n *= 2;
+        }
+        struct iomp_fdent* fds = (struct iomp_fdent*)realloc(
+                q->fds, sizeof(*fds) * n);
+        if (!fds) {
+            IOMP_LOG(ERROR, "realloc fail: %s", strerror(errno));
+            return NULL;
+        }
+        memset(fds + q->nfds, 0, sizeof(*fds) * (n - q->nfds));
+        q->fds = fds;
+        q->nfds = n;
+    }
+    return q->fds + slot;
+}
+
+int fd_park(iomp_queue_t q, iomp_aio_t aio, uint32_t dir) {
+    if (__atomic_load_n(&q->nforgot, __ATOMIC_ACQUIRE) > 0) {
+        fd_forgotten(q);
+    }
+    struct iomp_fdent* ent = fd_get(q, aio->fildes);
+    if (!ent) {
+        return -1;
+    }
+    iomp_aio_t* slot = (dir == EPOLLIN ? &ent->rd : &ent->wr);
+    if (*slot) {
+        errno = EEXIST;
+        return -1;
+    }
+    /* the kernel already reports dir unless the fd was forgotten or left
+     * alone for two edges; one that came while nothing was pending may
+     * still be unread, the MOD has it reported again */
+    uint32_t interest = ent->interest | dir;
+    if (interest != ent->interest || (ent->ready & dir)) {
+        struct epoll_event epev;
+        epev.events = interest | EPOLLET;
+        epev.data.u64 = FD_DATA(aio->fildes);
+        int rv = epoll_ctl(q->epfd, EPOLL_CTL_MOD, aio->fildes, &epev);
+        if (rv == -1 && errno == ENOENT) {
+            rv = epoll_ctl(q->epfd, EPOLL_CTL_ADD, aio->fildes, &epev);
+        }
+        if (rv == -1) {
+            return -1;
+        }
+        ent->interest = interest;
+        ent->ready = 0;
+    }
+    *slot = aio;
+    return 0;
+}
+
+void fd_done(iomp_queue_t q, iomp_aio_t aio, uint32_t dir) {
+    struct iomp_fdent* ent = q->fds + aio->fildes / q->nshards;
+    if (dir == EPOLLIN) {
+        ent->rd = NULL;
+    } else {
+        ent->wr = NULL;
+    }
+}
+
+void fd_event(iomp_queue_t q, int fd, uint32_t events) {
+    int slot = fd / q->nshards;
+    if (slot >= q->nfds) {
+        return;
+    }
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        events |= EPOLLIN | EPOLLOUT;
+    }
+    events &= q->fds[slot].interest;
+    struct iomp_fdent* ent = q->fds + slot;
+    if (!ent->rd && !ent->wr) {
+        if (ent->ready & events) {
+            /* nobody came back for the last edge either, the fd is
+             * left alone or closed; stop the wakeups here */
+            struct epoll_event epev = { 0, { NULL } };
+            epoll_ctl(q->epfd, EPOLL_CTL_DEL, fd, &epev);
+            ent->interest = 0;
+            ent->ready = 0;
+        } else {
+            ent->ready |= events;
+        }
+        return;
+    }
+    /* the table may move under callbacks, look the entry up again */
+    for (int i = 0; i < 2; i++) {
+        uint32_t dir = (i == 0 ? EPOLLIN : EPOLLOUT);
+        if (!(events & dir)) {
+            continue;
+        }
+        ent = q->fds + slot;
+        iomp_aio_t aio = (dir == EPOLLIN ? ent->rd : ent->wr);
+        if (!aio) {
+            ent->ready |= dir;
+            continue;
+        }
+        int queued = 0;
+        for (int j = 0; j < q->npend; j++) {
+            if (q->pend[j].aio == aio) {
+                queued = 1;
+                break;
+            }
+        }
+        if (!queued) {
+            on_event(q, aio, dir);
+        }
+    }
+}
+
+int on_event(iomp_queue_t q, iomp_aio_t aio, uint32_t events) {
+    int more = 0;
+    if (events & EPOLLIN) {
+        more = on_read(q, aio, IOMP_EVENT_BUDGET);
+    }
+    if (events & EPOLLOUT) {
+        more = on_write(q, aio, IOMP_EVENT_BUDGET);
+    }
+    if (!more) {
+        return 0;
+    }
+    if (q->npend == q->maxpend) {
+        int n = q->maxpend > 0 ? q->maxpend * 2 : 16;
+        struct iomp_pending* pend = (struct iomp_pending*)realloc(
+                q->pend, sizeof(*pend) * n);
+        if (!pend) {
+            IOMP_LOG(ERROR, "realloc fail: %s", strerror(errno));
+            if (events & EPOLLIN) {
+                on_read(q, aio, SIZE_MAX);
+            } else {
+                on_write(q, aio, SIZE_MAX);
+            }
+            return 0;
+        }
+        q->pend = pend;
+        q->maxpend = n;
+    }
+    q->pend[q->npend].aio = aio;
+    q->pend[q->npend].events = events & (EPOLLIN | EPOLLOUT);
+    q->npend++;
+    return 1;
+}
+
+int on_read(iomp_queue_t q, iomp_aio_t aio, size_t budget) {
     void* buf = aio->buf + aio->offset;
     size_t todo = aio->nbytes - aio->offset;
+    int nsyscall = (budget == SIZE_MAX ? INT_MAX : IOMP_EVENT_SYSCALLS);
     while (todo > 0) {
-        ssize_t len = read(aio->fildes, buf, todo);
+        if (budget == 0 || nsyscall-- == 0) {
+            aio->offset = aio->nbytes - todo;
+            return 1;
+        }
+        ssize_t len = read(aio->fildes, buf, todo < budget ? todo : budget);
         if (len > 0) {
+            IOMP_CRC_FEED(aio, buf, len);
             buf += len;
             todo -= len;
+            budget -= len;
         } else if (len == -1 && errno == EAGAIN) {
             aio->offset = aio->nbytes - todo;
-            return;
+            return 0;
         } else {
             aio->offset = aio->nbytes - todo;
-            struct epoll_event epev = { EPOLLIN, { NULL } };
-            epoll_ctl(q->epfd, EPOLL_CTL_DEL, aio->fildes, &epev);
-            aio->complete(aio, len == -1 ? errno : -1);
-            return;
+            fd_done(q, aio, EPOLLIN);
+            iomp_complete(aio, len == -1 ? errno : -1);
+            return 0;
         }
     }
     aio->offset = aio->nbytes;
-    struct epoll_event epev = { EPOLLIN, { NULL } };
-    epoll_ctl(q->epfd, EPOLL_CTL_DEL, aio->fildes, &epev);
-    aio->complete(aio, 0);
+    fd_done(q, aio, EPOLLIN);
+    iomp_complete(aio, IOMP_CRC_CHECK(aio));
+    return 0;
 }
 
-void on_write(iomp_queue_t q, iomp_aio_t aio) {
+int on_write(iomp_queue_t q, iomp_aio_t aio, size_t budget) {
     void* buf = aio->buf + aio->offset;
     size_t todo = aio->nbytes - aio->offset;
+    int nsyscall = (budget == SIZE_MAX ? INT_MAX : IOMP_EVENT_SYSCALLS);
     while (todo > 0) {
-        ssize_t len = write(aio->fildes, buf, todo);
+        if (budget == 0 || nsyscall-- == 0) {
+            aio->offset = aio->nbytes - todo;
+            return 1;
+        }
+        ssize_t len = write(aio->fildes, buf, todo < budget ? todo : budget);
         if (len > 0) {
             buf += len;
             todo -= len;
+            budget -= len;
         } else if (len == -1 && errno == EAGAIN) {
             aio->offset = aio->nbytes - todo;
-            return;
+            return 0;
         } else {
             aio->offset = aio->nbytes - todo;
-            struct epoll_event epev = { EPOLLOUT, { NULL } };
-            epoll_ctl(q->epfd, EPOLL_CTL_DEL, aio->fildes, &epev);
-            aio->complete(aio, len == -1 ? errno : -1);
-            return;
+            fd_done(q, aio, EPOLLOUT);
+            iomp_complete(aio, len == -1 ? errno : -1);
+            return 0;
         }
     }
     aio->offset = aio->nbytes;
-    struct epoll_event epev = { EPOLLOUT, { NULL } };
-    epoll_ctl(q->epfd, EPOLL_CTL_DEL, aio->fildes, &epev);
-    aio->complete(aio, 0);
+    fd_done(q, aio, EPOLLOUT);
+    iomp_complete(aio, 0);
+    return 0;
 }
 
-#endif /* __linux__ */
+#endif /* __linux__ && !IOMP_LOOPBACK */
 
@@ -0,0 +1,350 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#define IOMP_FRAME_AVX2 1
+#endif /* __x86_64__ */
+#if defined(__SSE2__) || IOMP_FRAME_AVX2
+#include <immintrin.h>
+#endif /* __SSE2__ || IOMP_FRAME_AVX2 */
+#include "iomp_queue.h"
+#include "iomp.h"
+
+#define IOMP_CONTAINER_OF(ptr, type, member) \
+    ((type*)((char*)(ptr) - offsetof(type, member)))
+
+#define IOMP_FRAME_HEADER   0
+#define IOMP_FRAME_DELIM    1
+
+/* per-connection read buffer, unparsed bytes live in [head, tail) */
+struct iomp_framer {
+    int fildes;
+    char* buf;
+    size_t size;
+    size_t head;
+    size_t tail;
+    /* bytes of the last message, dropped on the next read */
+    size_t consumed;
+    /* where the delimiter search resumes, relative to head */
+    size_t scanned;
+    int kind;
+    int hdrlen;
+    int order;
+    char delim[IOMP_FRAME_DELIM_MAX];
+    size_t dlen;
+    iomp_aio_t aio;
+    iomp_queue_t queue;
+    /* readiness only, nbytes 0 */
+    struct iomp_aio ready;
+};
+
+static int frame_submit(iomp_t iomp, iomp_framer_t f, iomp_aio_t aio);
+static void frame_start(void* arg, iomp_queue_t q);
+static void frame_ready(iomp_aio_t aio, int error);
+static void frame_step(iomp_framer_t f);
+static int frame_parse(iomp_framer_t f, int* error);
+static int frame_reserve(iomp_framer_t f, size_t need);
+static void frame_done(iomp_framer_t f, int error);
+static const char* scan_byte(const char* p, const char* end, char c);
+static void scan_init(void);
+static const char* scan_sse(const char* p, const char* end, char c);
+#if IOMP_FRAME_AVX2
+static const char* scan_avx2(const char* p, const char* end, char c);
+#endif /* IOMP_FRAME_AVX2 */
+
+static const char* (*g_scan_impl)(const char* p, const char* end,
+        char c) = NULL;
+static pthread_once_t g_scan_once = PTHREAD_ONCE_INIT;
+
+iomp_framer_t iomp_framer_new(int fildes, size_t size) {
+    if (fildes < 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    iomp_framer_t f = (iomp_framer_t)malloc(sizeof(*f));
+    if (!f) {
+        IOMP_LOG(ERROR, "malloc fail: %s", strerror(errno));
+        return NULL;
+    }
+    f->size = size > 0 ? size : 4096;
+    f->buf = (char*)malloc(f->size);
+    if (!f->buf) {
+        IOMP_LOG(ERROR, "malloc fail: %s", strerror(errno));
+        free(f);
+        return NULL;
+    }
+    f->fildes = fildes;
+    f->head = 0;
+    f->tail = 0;
+    f->consumed = 0;
+    f->scanned = 0;
+    f->kind = IOMP_FRAME_HEADER;
+    f->hdrlen = 0;
+    f->order = IOMP_FRAME_BE;
+    f->dlen = 0;
+    f->aio = NULL;
+    f->queue = NULL;
+    memset(&f->ready, 0, sizeof(f->ready));
+    f->ready.fildes = fildes;
+    f->ready.buf = f->buf;
+    f->ready.nbytes = 0;
+    f->ready.complete = frame_ready;
+    return f;
+}
+
+void iomp_framer_drop(iomp_framer_t f) {
+    if (!f) {
+        return;
+    }
+    free(f->buf);
+    free(f);
+}
+
+void iomp_read_frame(iomp_t iomp, iomp_framer_t f, iomp_aio_t aio,
+        int hdrlen, int order) {
+    if (!aio || (!aio->complete && !aio->ring)) {
+        IOMP_LOG(ERROR, "invalid argument");
+        return;
+    }
+    if (!iomp || !f || (hdrlen != 1 && hdrlen != 2 && hdrlen != 4 &&
+            hdrlen != 8) || (order != IOMP_FRAME_BE && order != IOMP_FRAME_LE)) {
+        iomp_complete(aio, EINVAL);
+        return;
+    }
+    f->kind = IOMP_FRAME_HEADER;
+    f->hdrlen = hdrlen;
+    f->order = order;
+    int error = frame_submit(iomp, f, aio);
+    if (error != 0) {
+        iomp_complete(aio, error);
+    }
+}
+
+void iomp_read_until(iomp_t iomp, iomp_framer_t f, iomp_aio_t aio,
+        const void* delim, size_t dlen) {
+    if (!aio || (!aio->complete && !aio->ring)) {
+        IOMP_LOG(ERROR, "invalid argument");
+        return;
+    }
+    if (!iomp || !f || !delim || dlen == 0 || dlen > IOMP_FRAME_DELIM_MAX) {
+        iomp_complete(aio, EINVAL);
+        return;
+    }
+    if (f->kind != IOMP_FRAME_DELIM || f->dlen != dlen ||
+            memcmp(f->delim, delim, dlen) != 0) {
+        f->scanned = 0;
+    }
+    f->kind = IOMP_FRAME_DELIM;
+    memcpy(f->delim, delim, dlen);
+    f->dlen = dlen;
+    int error = frame_submit(iomp, f, aio);
+    if (error != 0) {
+        iomp_complete(aio, error);
+    }
+}
+
+int frame_submit(iomp_t iomp, iomp_framer_t f, iomp_aio_t aio) {
+    aio->fildes = f->fildes;
+    aio->offset = 0;
+    f->aio = aio;
+    f->ready.priority = aio->priority;
+    /* a buffered message still completes on a worker, never inline */
+    return iomp_defer(iomp, f->fildes, aio->priority, frame_start, f);
+}
+
+void frame_start(void* arg, iomp_queue_t q) {
+    iomp_framer_t f = (iomp_framer_t)arg;
+    if (!q) {
+        frame_done(f, -1);
+        return;
+    }
+    f->queue = q;
+    frame_step(f);
+}
+
+void frame_ready(iomp_aio_t aio, int error) {
+    iomp_framer_t f = IOMP_CONTAINER_OF(aio, struct iomp_framer, ready);
+    if (error != 0) {
+        frame_done(f, error);
+        return;
+    }
+    frame_step(f);
+}
+
+void frame_step(iomp_framer_t f) {
+    f->head += f->consumed;
+    f->consumed = 0;
+    if (f->head == f->tail) {
+        f->head = 0;
+        f->tail = 0;
+    }
+    while (1) {
+        int error = 0;
+        if (frame_parse(f, &error) || error != 0) {
+            frame_done(f, error);
+            return;
+        }
+        if (f->tail == f->size) {
+            error = frame_reserve(f, f->tail - f->head + 1);
+            if (error != 0) {
+                frame_done(f, error);
+                return;
+            }
+        }
+        ssize_t len = IOMP_READ(f->fildes, f->buf + f->tail, f->size - f->tail);
+        if (len > 0) {
+            f->tail += len;
+        } else if (len == -1 && errno == EINTR) {
+            continue;
+        } else if (len == -1 && errno == EAGAIN) {
+            /* park on the worker queue we were started on */
+            f->ready.buf = f->buf;
+            if (iomp_queue_read(f->queue, &f->ready) == -1) {
+                frame_done(f, errno);
+            }
+            return;
+        } else {
+            frame_done(f, len == -1 ? errno : -1);
+            return;
+        }
+    }
+}
+
+/* returns 1 with the message in aio, 0 if more bytes are needed */
+int frame_parse(iomp_framer_t f, int* error) {
+    iomp_aio_t aio = f->aio;
+    const char* data = f->buf + f->head;
+    size_t avail = f->tail - f->head;
+    if (f->kind == IOMP_FRAME_HEADER) {
+        if (avail < (size_t)f->hdrlen) {
+            return 0;
+        }
+        const unsigned char* p = (const unsigned char*)data;
+        uint64_t len = 0;
+        for (int i = 0; i < f->hdrlen; i++) {
+            int k = (f->order == IOMP_FRAME_BE ? i : f->hdrlen - 1 - i);
+            len = (len << 8) | p[k];
+        }
+        if (len > IOMP_FRAME_LIMIT) {
+            *error = EMSGSIZE;
+            return 0;
+        }
+        size_t total = f->hdrlen + (size_t)len;
+        if (avail < total) {
+            *error = frame_reserve(f, total);
+            return 0;
+        }
+        aio->buf = (void*)(data + f->hdrlen);
+        aio->nbytes = (size_t)len;
+        aio->offset = aio->nbytes;
+        f->consumed = total;
+        return 1;
+    }
+    if (avail < f->dlen) {
+        return 0;
+    }
+    const char* end = data + avail - f->dlen + 1;
+    const char* p = data + f->scanned;
+    while ((p = scan_byte(p, end, f->delim[0])) != NULL) {
+        if (memcmp(p, f->delim, f->dlen) == 0) {
+            aio->buf = (void*)data;
+            aio->nbytes = p - data;
+            aio->offset = aio->nbytes;
+            f->consumed = aio->nbytes + f->dlen;
+            f->scanned = 0;
+            return 1;
+        }
+        p++;
+    }
+    f->scanned = end - data;
+    if (avail >= IOMP_FRAME_LIMIT) {
+        *error = EMSGSIZE;
+    }
+    return 0;
+}
+
+/* makes room for need unparsed bytes, moving them to the front first */
+int frame_reserve(iomp_framer_t f, size_t need) {
+    if (f->size - f->head >= need) {
+        return 0;
+    }
+    if (f->head > 0) {
+        memmove(f->buf, f->buf + f->head, f->tail - f->head);
+        f->tail -= f->head;
+        f->head = 0;
+    }
+    if (need <= f->size) {
+        return 0;
+    }
+    size_t n = f->size;
+    while (n < need) {
+        n *= 2;
+    }
+    char* buf = (char*)realloc(f->buf, n);
+    if (!buf) {
+        IOMP_LOG(ERROR, "realloc fail: %s", strerror(errno));
+        return ENOMEM;
+    }
+    f->buf = buf;
+    f->size = n;
+    return 0;
+}
+
+void frame_done(iomp_framer_t f, int error) {
+    iomp_aio_t aio = f->aio;
+    f->aio = NULL;
+    iomp_complete(aio, error);
+}
+
+const char* scan_byte(const char* p, const char* end, char c) {
+    pthread_once(&g_scan_once, scan_init);
+    return g_scan_impl(p, end, c);
+}
+
+void scan_init(void) {
+    g_scan_impl = scan_sse;
+#if IOMP_FRAME_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        g_scan_impl = scan_avx2;
+    }
+#endif /* IOMP_FRAME_AVX2 */
+}
+
+/* 16 bytes at a time where SSE2 is there, x86_64 always, else memchr */
+const char* scan_sse(const char* p, const char* end, char c) {
+#if defined(__SSE2__)
+    __m128i v16 = _mm_set1_epi8(c);
+    while (end - p >= 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)p);
+        unsigned m = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(x, v16));
+        if (m) {
+            return p + __builtin_ctz(m);
+        }
+        p += 16;
+    }
+#endif /* __SSE2__ */
+    if (p >= end) {
+        return NULL;
+    }
+    return (const char*)memchr(p, c, end - p);
+}
+
+#if IOMP_FRAME_AVX2
+__attribute__((target("avx2")))
+const char* scan_avx2(const char* p, const char* end, char c) {
+    __m256i v32 = _mm256_set1_epi8(c);
+    while (end - p >= 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)p);
+        unsigned m = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, v32));
+        if (m) {
+            return p + __builtin_ctz(m);
+        }
+        p += 32;
+    }
+    return scan_sse(p, end, c);
+}
+#endif /* IOMP_FRAME_AVX2 */
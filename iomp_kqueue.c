@@ -1,10 +1,12 @@
 #include "iomp.h"
 
-#if defined(__BSD__)
+#if defined(__BSD__) && !IOMP_LOOPBACK
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/event.h>
@@ -13,15 +15,57 @@
 #include <sys/socket.h>
 #include "iomp_queue.h"
 
+/* an aio that used up its budget, continued after the other events */
+struct iomp_pending {
+    iomp_aio_t aio;
+    int16_t filter;
+};
+
+/* fds stay registered between aios and only interest changes reach the
+ * kernel; ready keeps edges that came in while nothing was pending */
+struct iomp_fdent {
+    iomp_aio_t rd;
+    iomp_aio_t wr;
+    int interest;
+    int ready;
+};
+
+#define FD_RD 1
+#define FD_WR 2
+#define FD_DIR(filter) ((filter) == EVFILT_READ ? FD_RD : FD_WR)
+
+/* fds forgotten since the last park, past that many the whole table is */
+#define FD_FORGET_MAX 64
+
+/* kevent udata: NULL is the interrupt, the queue itself marks table fds,
+ * anything else is an accept aio */
 struct iomp_queue {
     int kqfd;
     int intr[2];
     int nevents;
+    struct iomp_pending* pend;
+    int npend;
+    int maxpend;
+    /* entry i is fd i * nshards + shard */
+    struct iomp_fdent* fds;
+    int nfds;
+    int shard;
+    int nshards;
+    /* from iomp_queue_forget on any thread, applied on the next park */
+    int forget_lock;
+    int nforgot;
+    int forgot[FD_FORGET_MAX];
     struct kevent evs[];
 };
 
-static void on_read(iomp_queue_t q, iomp_aio_t aio);
-static void on_write(iomp_queue_t q, iomp_aio_t aio);
+static struct iomp_fdent* fd_get(iomp_queue_t q, int fd);
+static void fd_forgotten(iomp_queue_t q);
+static int fd_park(iomp_queue_t q, iomp_aio_t aio, int16_t filter);
+static void fd_done(iomp_queue_t q, iomp_aio_t aio, int16_t filter);
+static void fd_event(iomp_queue_t q, int fd, int16_t filter);
+static int on_event(iomp_queue_t q, iomp_aio_t aio, int16_t filter);
+static int on_read(iomp_queue_t q, iomp_aio_t aio, size_t budget);
+static int on_write(iomp_queue_t q, iomp_aio_t aio, size_t budget);
 
 iomp_queue_t iomp_queue_new(int nevents) {
     if (nevents <= 0) {
@@ -34,6 +78,15 @@ iomp_queue_t iomp_queue_new(int nevents) {
         return NULL;
     }
     q->nevents = nevents;
+    q->pend = NULL;
+    q->npend = 0;
+    q->maxpend = 0;
+    q->fds = NULL;
+    q->nfds = 0;
+    q->shard = 0;
+    q->nshards = 1;
+    q->forget_lock = 0;
+    q->nforgot = 0;
     q->kqfd = kqueue();
     if (q->kqfd == -1) {
         IOMP_LOG(ERROR, "kqueue fail: %s", strerror(errno));
@@ -70,31 +123,29 @@ void iomp_queue_drop(iomp_queue_t q) {
     close(q->intr[1]);
     close(q->intr[0]);
     close(q->kqfd);
+    free(q->pend);
+    free(q->fds);
     free(q);
 }
 
 int iomp_queue_read(iomp_queue_t q, iomp_aio_t aio) {
-    if (!q || !aio || !aio->complete || !aio->buf) {
+    if (!q || !aio || (!aio->complete && !aio->ring) || !aio->buf) {
         errno = EINVAL;
         return -1;
     }
-    struct kevent kqev;
-    EV_SET(&kqev, aio->fildes, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, aio);
-    return kevent(q->kqfd, &kqev, 1, NULL, 0, NULL);
+    return fd_park(q, aio, EVFILT_READ);
 }
 
 int iomp_queue_write(iomp_queue_t q, iomp_aio_t aio) {
-    if (!q || !aio || !aio->complete || !aio->buf) {
+    if (!q || !aio || (!aio->complete && !aio->ring) || !aio->buf) {
         errno = EINVAL;
         return -1;
     }
-    struct kevent kqev;
-    EV_SET(&kqev, aio->fildes, EVFILT_WRITE, EV_ADD | EV_CLEAR, 0, 0, aio);
-    return kevent(q->kqfd, &kqev, 1, NULL, 0, NULL);
+    return fd_park(q, aio, EVFILT_WRITE);
 }
 
 int iomp_queue_accept(iomp_queue_t q, struct iomp_aio* aio) {
-    if (!q || !aio || !aio->complete || aio->buf) {
+    if (!q || !aio || (!aio->complete && !aio->ring) || aio->buf) {
         errno = EINVAL;
         return -1;
     }
@@ -103,17 +154,31 @@ int iomp_queue_accept(iomp_queue_t q, struct iomp_aio* aio) {
     return kevent(q->kqfd, &kqev, 1, NULL, 0, NULL);
 }
 
+int iomp_queue_unaccept(iomp_queue_t q, struct iomp_aio* aio) {
+    if (!q || !aio) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct kevent kqev;
+    EV_SET(&kqev, aio->fildes, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    return kevent(q->kqfd, &kqev, 1, NULL, 0, NULL);
+}
+
 int iomp_queue_run(iomp_queue_t q, int timeout) {
     if (!q) {
         errno = EINVAL;
         return -1;
     }
+    if (q->npend > 0) {
+        timeout = 0;
+    }
     struct timespec ts = { timeout / 1000, (timeout % 1000) * 1000000 };
     int rv = kevent(q->kqfd, NULL, 0, q->evs, q->nevents,
             timeout >= 0 ? &ts : NULL);
     if (rv == -1) {
         return rv;
     }
+    int npend = q->npend;
     for (int i = 0; i < rv; i++) {
         struct kevent* kqev = q->evs + i;
         if (kqev->udata == NULL) {
@@ -124,19 +189,28 @@ int iomp_queue_run(iomp_queue_t q, int timeout) {
             kevent(q->kqfd, kqev, 1, NULL, 0, NULL);
             continue;
         }
-        iomp_aio_t aio = (iomp_aio_t)kqev->udata;
-        if (!aio->buf) {
-            aio->complete(aio, 0);
+        if (kqev->udata == (void*)q) {
+            fd_event(q, (int)kqev->ident, kqev->filter);
             continue;
         }
-        if (kqev->filter == EVFILT_READ) {
-            on_read(q, aio);
-        }
-        if (kqev->filter == EVFILT_WRITE) {
-            on_write(q, aio);
-        }
+        iomp_complete((iomp_aio_t)kqev->udata, 0);
     }
-    return 0;
+    /* one more slice for each aio left over from the last round */
+    for (int i = 0; i < npend; i++) {
+        struct iomp_pending pend = q->pend[i];
+        on_event(q, pend.aio, pend.filter);
+    }
+    q->npend -= npend;
+    memmove(q->pend, q->pend + npend, sizeof(*q->pend) * q->npend);
+    return q->npend;
+}
+
+int iomp_queue_fileno(iomp_queue_t q) {
+    if (!q) {
+        errno = EINVAL;
+        return -1;
+    }
+    return q->kqfd;
 }
 
 void iomp_queue_interrupt(iomp_queue_t q) {
@@ -147,59 +221,242 @@ void iomp_queue_interrupt(iomp_queue_t q) {
     write(q->intr[1], &buf, sizeof(buf));
 }
 
-void on_read(iomp_queue_t q, iomp_aio_t aio) {
+void iomp_queue_shard(iomp_queue_t q, int index, int count) {
+    if (!q || count <= 0 || index < 0 || index >= count || q->nfds > 0) {
+        return;
+    }
+    q->shard = index;
+    q->nshards = count;
+}
+
+void iomp_queue_forget(iomp_queue_t q, int fd) {
+    if (!q || fd < 0) {
+        return;
+    }
+    /* close drops the knotes of the fd, dup or not, only the table
+     * needs to hear of it */
+    while (__atomic_exchange_n(&q->forget_lock, 1, __ATOMIC_ACQUIRE)) {
+    }
+    if (q->nforgot < FD_FORGET_MAX) {
+        q->forgot[q->nforgot] = fd;
+    }
+    __atomic_store_n(&q->nforgot, q->nforgot + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&q->forget_lock, 0, __ATOMIC_RELEASE);
+}
+
+void fd_forgotten(iomp_queue_t q) {
+    while (__atomic_exchange_n(&q->forget_lock, 1, __ATOMIC_ACQUIRE)) {
+    }
+    int n = q->nforgot;
+    q->nforgot = 0;
+    for (int i = 0; i < n && i < FD_FORGET_MAX; i++) {
+        int fd = q->forgot[i];
+        if (fd % q->nshards == q->shard && fd / q->nshards < q->nfds) {
+            q->fds[fd / q->nshards].interest = 0;
+            q->fds[fd / q->nshards].ready = 0;
+        }
+    }
+    __atomic_store_n(&q->forget_lock, 0, __ATOMIC_RELEASE);
+    /* too many to list, start over with everything idle */
+    for (int i = 0; n > FD_FORGET_MAX && i < q->nfds; i++) {
+        if (!q->fds[i].rd && !q->fds[i].wr) {
+            q->fds[i].interest = 0;
+            q->fds[i].ready = 0;
+        }
+    }
+}
+
+struct iomp_fdent* fd_get(iomp_queue_t q, int fd) {
+    if (fd < 0) {
+        errno = EBADF;
+        return NULL;
+    }
+    if (fd % q->nshards != q->shard) {
+        IOMP_LOG(ERROR, "fd %d parked outside its shard", fd);
+        errno = EXDEV;
+        return NULL;
+    }
+    int slot = fd / q->nshards;
+    if (slot >= q->nfds) {
+        int n = q->nfds > 0 ? q->nfds : 64;
+        while (n <= slot) {
+            n *= 2;
+        }
+        struct iomp_fdent* fds = (struct iomp_fdent*)realloc(
+                q->fds, sizeof(*fds) * n);
+        if (!fds) {
+            IOMP_LOG(ERROR, "realloc fail: %s", strerror(errno));
+            return NULL;
+        }
+        memset(fds + q->nfds, 0, sizeof(*fds) * (n - q->nfds));
+        q->fds = fds;
+        q->nfds = n;
+    }
+    return q->fds + slot;
+}
+
+int fd_park(iomp_queue_t q, iomp_aio_t aio, int16_t filter) {
+    if (__atomic_load_n(&q->nforgot, __ATOMIC_ACQUIRE) > 0) {
+        fd_forgotten(q);
+    }
+    struct iomp_fdent* ent = fd_get(q, aio->fildes);
+    if (!ent) {
+        return -1;
+    }
+    int dir = FD_DIR(filter);
+    iomp_aio_t* slot = (dir == FD_RD ? &ent->rd : &ent->wr);
+    if (*slot) {
+        errno = EEXIST;
+        return -1;
+    }
+    /* the kernel already reports dir unless the fd was forgotten or left
+     * alone for two edges; one that came while nothing was pending may
+     * still be unread, the EV_ADD has it reported again */
+    if (!(ent->interest & dir) || (ent->ready & dir)) {
+        struct kevent kqev;
+        EV_SET(&kqev, aio->fildes, filter, EV_ADD | EV_CLEAR, 0, 0, q);
+        if (kevent(q->kqfd, &kqev, 1, NULL, 0, NULL) == -1) {
+            return -1;
+        }
+        ent->interest |= dir;
+        ent->ready &= ~dir;
+    }
+    *slot = aio;
+    return 0;
+}
+
+void fd_done(iomp_queue_t q, iomp_aio_t aio, int16_t filter) {
+    struct iomp_fdent* ent = q->fds + aio->fildes / q->nshards;
+    if (filter == EVFILT_READ) {
+        ent->rd = NULL;
+    } else {
+        ent->wr = NULL;
+    }
+}
+
+void fd_event(iomp_queue_t q, int fd, int16_t filter) {
+    int slot = fd / q->nshards;
+    if (slot >= q->nfds) {
+        return;
+    }
+    int dir = FD_DIR(filter);
+    struct iomp_fdent* ent = q->fds + slot;
+    iomp_aio_t aio = (dir == FD_RD ? ent->rd : ent->wr);
+    if (!aio) {
+        if (!ent->rd && !ent->wr && (ent->ready & dir)) {
+            /* nobody came back for the last edge either, the fd is
+             * left alone or closed; stop the wakeups here */
+            struct kevent kqev;
+            EV_SET(&kqev, fd, filter, EV_DELETE, 0, 0, NULL);
+            kevent(q->kqfd, &kqev, 1, NULL, 0, NULL);
+            ent->interest &= ~dir;
+            ent->ready &= ~dir;
+        } else {
+            ent->ready |= dir;
+        }
+        return;
+    }
+    for (int j = 0; j < q->npend; j++) {
+        if (q->pend[j].aio == aio) {
+            return;
+        }
+    }
+    on_event(q, aio, filter);
+}
+
+int on_event(iomp_queue_t q, iomp_aio_t aio, int16_t filter) {
+    int more = 0;
+    if (filter == EVFILT_READ) {
+        more = on_read(q, aio, IOMP_EVENT_BUDGET);
+    }
+    if (filter == EVFILT_WRITE) {
+        more = on_write(q, aio, IOMP_EVENT_BUDGET);
+    }
+    if (!more) {
+        return 0;
+    }
+    if (q->npend == q->maxpend) {
+        int n = q->maxpend > 0 ? q->maxpend * 2 : 16;
+        struct iomp_pending* pend = (struct iomp_pending*)realloc(
+                q->pend, sizeof(*pend) * n);
+        if (!pend) {
+            IOMP_LOG(ERROR, "realloc fail: %s", strerror(errno));
+            if (filter == EVFILT_READ) {
+                on_read(q, aio, SIZE_MAX);
+            } else {
+                on_write(q, aio, SIZE_MAX);
+            }
+            return 0;
+        }
+        q->pend = pend;
+        q->maxpend = n;
+    }
+    q->pend[q->npend].aio = aio;
+    q->pend[q->npend].filter = filter;
+    q->npend++;
+    return 1;
+}
+
+int on_read(iomp_queue_t q, iomp_aio_t aio, size_t budget) {
     void* buf = aio->buf + aio->offset;
     size_t todo = aio->nbytes - aio->offset;
+    int nsyscall = (budget == SIZE_MAX ? INT_MAX : IOMP_EVENT_SYSCALLS);
     while (todo > 0) {
-        ssize_t len = read(aio->fildes, buf, todo);
+        if (budget == 0 || nsyscall-- == 0) {
+            aio->offset = aio->nbytes - todo;
+            return 1;
+        }
+        ssize_t len = read(aio->fildes, buf, todo < budget ? todo : budget);
         if (len > 0) {
+            IOMP_CRC_FEED(aio, buf, len);
             buf += len;
             todo -= len;
+            budget -= len;
         } else if (len == -1 && errno == EAGAIN) {
             aio->offset = aio->nbytes - todo;
-            return;
+            return 0;
         } else {
             aio->offset = aio->nbytes - todo;
-            struct kevent kqev;
-            EV_SET(&kqev, aio->fildes, EVFILT_READ, EV_DELETE, 0, 0, NULL);
-            kevent(q->kqfd, &kqev, 1, NULL, 0, NULL);
-            aio->complete(aio, len == -1 ? errno : -1);
-            return;
+            fd_done(q, aio, EVFILT_READ);
+            iomp_complete(aio, len == -1 ? errno : -1);
+            return 0;
         }
     }
     aio->offset = aio->nbytes;
-    struct kevent kqev;
-    EV_SET(&kqev, aio->fildes, EVFILT_READ, EV_DELETE, 0, 0, NULL);
-    kevent(q->kqfd, &kqev, 1, NULL, 0, NULL);
-    aio->complete(aio, 0);
+    fd_done(q, aio, EVFILT_READ);
+    iomp_complete(aio, IOMP_CRC_CHECK(aio));
+    return 0;
 }
 
-void on_write(iomp_queue_t q, iomp_aio_t aio) {
+int on_write(iomp_queue_t q, iomp_aio_t aio, size_t budget) {
     void* buf = aio->buf + aio->offset;
     size_t todo = aio->nbytes - aio->offset;
+    int nsyscall = (budget == SIZE_MAX ? INT_MAX : IOMP_EVENT_SYSCALLS);
     while (todo > 0) {
-        ssize_t len = write(aio->fildes, buf, todo);
+        if (budget == 0 || nsyscall-- == 0) {
+            aio->offset = aio->nbytes - todo;
+            return 1;
+        }
+        ssize_t len = write(aio->fildes, buf, todo < budget ? todo : budget);
         if (len > 0) {
             buf += len;
             todo -= len;
+            budget -= len;
         } else if (len == -1 && errno == EAGAIN) {
             aio->offset = aio->nbytes - todo;
-            return;
+            return 0;
         } else {
             aio->offset = aio->nbytes - todo;
-            struct kevent kqev;
-            EV_SET(&kqev, aio->fildes, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
-            kevent(q->kqfd, &kqev, 1, NULL, 0, NULL);
-            aio->complete(aio, len == -1 ? errno : -1);
-            return;
+            fd_done(q, aio, EVFILT_WRITE);
+            iomp_complete(aio, len == -1 ? errno : -1);
+            return 0;
         }
     }
     aio->offset = aio->nbytes;
-    struct kevent kqev;
-    EV_SET(&kqev, aio->fildes, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
-    kevent(q->kqfd, &kqev, 1, NULL, 0, NULL);
-    aio->complete(aio, 0);
+    fd_done(q, aio, EVFILT_WRITE);
+    iomp_complete(aio, 0);
+    return 0;
 }
 
-#endif /* __BSD__ */
+#endif /* __BSD__ && !IOMP_LOOPBACK */
 
@@ -0,0 +1,681 @@
+#include "iomp.h"
+
+#if IOMP_LOOPBACK
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "iomp_queue.h"
+
+#define LO_IN 1
+#define LO_OUT 2
+
+/* fds of loopback ends index a table of this size */
+#define LO_MAXFDS 65536
+/* an entry only goes away under the lock of its stripe */
+#define LO_STRIPES 64
+
+/* both ends of a pipe pair under one lock; ring i is read by fds[i] and
+ * written by the other end */
+struct iomp_lopair {
+    pthread_mutex_t lock;
+    /* one per open end and one per lo_get not yet put */
+    int refs;
+    int fds[2];
+    int closed[2];
+    size_t capacity;
+    char* bufs[2];
+    size_t heads[2];
+    size_t tails[2];
+    /* queues to tell once fds[i] turns readable or writable, one shot */
+    iomp_queue_t rdq[2];
+    iomp_queue_t wrq[2];
+};
+
+struct iomp_loevent {
+    int fd;
+    int dir;
+};
+
+struct iomp_fdent {
+    iomp_aio_t rd;
+    iomp_aio_t wr;
+};
+
+struct iomp_queue {
+    pthread_mutex_t lock;
+    /* posted by the ends, taken up to nevents per round; a parked aio has
+     * at most one event here, room is made when it parks */
+    struct iomp_loevent* evs;
+    int nevs;
+    int maxevs;
+    int nparked;
+    int nevents;
+    /* the pipe only carries a byte while this is set */
+    int signalled;
+    int intr[2];
+    /* entry i is fd i * nshards + shard */
+    struct iomp_fdent* fds;
+    int nfds;
+    int shard;
+    int nshards;
+    struct iomp_loevent taken[];
+};
+
+static struct iomp_lopair* g_lo_fds[LO_MAXFDS];
+static pthread_mutex_t g_lo_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_lo_stripes[LO_STRIPES];
+static pthread_once_t g_lo_once = PTHREAD_ONCE_INIT;
+
+static void lo_init(void);
+static struct iomp_lopair* lo_get(int fd, int* side);
+static void lo_put(struct iomp_lopair* p);
+static int lo_arm(iomp_queue_t q, int fd, int dir);
+static void lo_disarm(iomp_queue_t q, int fd);
+static void lo_post(iomp_queue_t q, int fd, int dir);
+static void lo_signal(iomp_queue_t q);
+static struct iomp_fdent* fd_get(iomp_queue_t q, int fd);
+static int fd_park(iomp_queue_t q, iomp_aio_t aio, int dir);
+static void fd_done(iomp_queue_t q, iomp_aio_t aio, int dir);
+static void fd_event(iomp_queue_t q, int fd, int dir);
+static void on_read(iomp_queue_t q, iomp_aio_t aio);
+static void on_write(iomp_queue_t q, iomp_aio_t aio);
+
+int iomp_loopback_pair(int* fds, size_t capacity) {
+    if (!fds) {
+        return EINVAL;
+    }
+    size_t size = 4096;
+    while (size < capacity) {
+        size *= 2;
+    }
+    struct iomp_lopair* p = (struct iomp_lopair*)calloc(1, sizeof(*p));
+    if (!p) {
+        return errno;
+    }
+    p->capacity = size;
+    p->bufs[0] = (char*)malloc(size);
+    p->bufs[1] = (char*)malloc(size);
+    if (!p->bufs[0] || !p->bufs[1]) {
+        int error = errno;
+        free(p->bufs[0]);
+        free(p->bufs[1]);
+        free(p);
+        return error;
+    }
+    pthread_once(&g_lo_once, lo_init);
+    pthread_mutex_init(&p->lock, NULL);
+    p->refs = 2;
+    int n = 0;
+    pthread_mutex_lock(&g_lo_lock);
+    for (int fd = 0; fd < LO_MAXFDS && n < 2; fd++) {
+        if (!g_lo_fds[fd]) {
+            p->fds[n++] = fd;
+        }
+    }
+    if (n == 2) {
+        __atomic_store_n(g_lo_fds + p->fds[0], p, __ATOMIC_RELEASE);
+        __atomic_store_n(g_lo_fds + p->fds[1], p, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&g_lo_lock);
+    if (n < 2) {
+        pthread_mutex_destroy(&p->lock);
+        free(p->bufs[0]);
+        free(p->bufs[1]);
+        free(p);
+        return EMFILE;
+    }
+    fds[0] = p->fds[0];
+    fds[1] = p->fds[1];
+    return 0;
+}
+
+int iomp_loopback_close(int fd) {
+    if (fd < 0 || fd >= LO_MAXFDS) {
+        return EBADF;
+    }
+    pthread_once(&g_lo_once, lo_init);
+    pthread_mutex_t* stripe = g_lo_stripes + fd % LO_STRIPES;
+    pthread_mutex_lock(stripe);
+    struct iomp_lopair* p = g_lo_fds[fd];
+    if (p) {
+        __atomic_store_n(g_lo_fds + fd, NULL, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(stripe);
+    if (!p) {
+        return EBADF;
+    }
+    int i = (p->fds[1] == fd);
+    pthread_mutex_lock(&p->lock);
+    p->closed[i] = 1;
+    p->rdq[i] = NULL;
+    p->wrq[i] = NULL;
+    /* the other end reads what is left, then end of file, and fails
+     * its writes */
+    int j = 1 - i;
+    if (p->rdq[j]) {
+        lo_post(p->rdq[j], p->fds[j], LO_IN);
+        p->rdq[j] = NULL;
+    }
+    if (p->wrq[j]) {
+        lo_post(p->wrq[j], p->fds[j], LO_OUT);
+        p->wrq[j] = NULL;
+    }
+    pthread_mutex_unlock(&p->lock);
+    /* the end's own reference, workers that got it earlier keep theirs */
+    lo_put(p);
+    return 0;
+}
+
+ssize_t iomp_lo_read(int fd, void* buf, size_t nbytes) {
+    int i = 0;
+    struct iomp_lopair* p = lo_get(fd, &i);
+    if (!p) {
+        errno = EBADF;
+        return -1;
+    }
+    pthread_mutex_lock(&p->lock);
+    size_t avail = p->tails[i] - p->heads[i];
+    if (avail == 0) {
+        int eof = p->closed[1 - i];
+        pthread_mutex_unlock(&p->lock);
+        lo_put(p);
+        if (eof || nbytes == 0) {
+            return 0;
+        }
+        errno = EAGAIN;
+        return -1;
+    }
+    size_t len = nbytes < avail ? nbytes : avail;
+    size_t at = p->heads[i] & (p->capacity - 1);
+    size_t first = p->capacity - at < len ? p->capacity - at : len;
+    memcpy(buf, p->bufs[i] + at, first);
+    memcpy((char*)buf + first, p->bufs[i], len - first);
+    p->heads[i] += len;
+    /* room for the writer of ring i */
+    if (p->wrq[1 - i]) {
+        lo_post(p->wrq[1 - i], p->fds[1 - i], LO_OUT);
+        p->wrq[1 - i] = NULL;
+    }
+    pthread_mutex_unlock(&p->lock);
+    lo_put(p);
+    return len;
+}
+
+ssize_t iomp_lo_write(int fd, const void* buf, size_t nbytes) {
+    struct iovec iov;
+    iov.iov_base = (void*)buf;
+    iov.iov_len = nbytes;
+    return iomp_lo_writev(fd, &iov, 1);
+}
+
+ssize_t iomp_lo_writev(int fd, const struct iovec* iov, int iovcnt) {
+    int i = 0;
+    struct iomp_lopair* p = lo_get(fd, &i);
+    if (!p) {
+        errno = EBADF;
+        return -1;
+    }
+    int j = 1 - i;
+    pthread_mutex_lock(&p->lock);
+    if (p->closed[j]) {
+        pthread_mutex_unlock(&p->lock);
+        lo_put(p);
+        errno = EPIPE;
+        return -1;
+    }
+    size_t room = p->capacity - (p->tails[j] - p->heads[j]);
+    size_t len = 0;
+    for (int k = 0; k < iovcnt && len < room; k++) {
+        size_t n = iov[k].iov_len < room - len ? iov[k].iov_len : room - len;
+        size_t at = (p->tails[j] + len) & (p->capacity - 1);
+        size_t first = p->capacity - at < n ? p->capacity - at : n;
+        memcpy(p->bufs[j] + at, iov[k].iov_base, first);
+        memcpy(p->bufs[j], (char*)iov[k].iov_base + first, n - first);
+        len += n;
+    }
+    if (len == 0 && room == 0) {
+        pthread_mutex_unlock(&p->lock);
+        lo_put(p);
+        errno = EAGAIN;
+        return -1;
+    }
+    p->tails[j] += len;
+    if (len > 0 && p->rdq[j]) {
+        lo_post(p->rdq[j], p->fds[j], LO_IN);
+        p->rdq[j] = NULL;
+    }
+    pthread_mutex_unlock(&p->lock);
+    lo_put(p);
+    return len;
+}
+
+iomp_queue_t iomp_queue_new(int nevents) {
+    if (nevents <= 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    iomp_queue_t q = (iomp_queue_t)malloc(
+            sizeof(*q) + sizeof(struct iomp_loevent) * nevents);
+    if (!q) {
+        return NULL;
+    }
+    q->evs = NULL;
+    q->nevs = 0;
+    q->maxevs = 0;
+    q->nparked = 0;
+    q->nevents = nevents;
+    q->signalled = 0;
+    q->fds = NULL;
+    q->nfds = 0;
+    q->shard = 0;
+    q->nshards = 1;
+    /* for blocking and iomp_fileno only, written at most once a round
+     * however many events come in */
+    if (pipe(q->intr) == -1) {
+        IOMP_LOG(ERROR, "pipe fail: %s", strerror(errno));
+        free(q);
+        return NULL;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(q->intr[i], F_SETFL, fcntl(q->intr[i], F_GETFL, 0) | O_NONBLOCK);
+        fcntl(q->intr[i], F_SETFD, fcntl(q->intr[i], F_GETFD, 0) | FD_CLOEXEC);
+    }
+    pthread_mutex_init(&q->lock, NULL);
+    return q;
+}
+
+void iomp_queue_drop(iomp_queue_t q) {
+    if (!q) {
+        return;
+    }
+    /* the ends must not post to a queue that is gone */
+    for (int i = 0; i < q->nfds; i++) {
+        if (q->fds[i].rd || q->fds[i].wr) {
+            lo_disarm(q, i * q->nshards + q->shard);
+        }
+    }
+    close(q->intr[1]);
+    close(q->intr[0]);
+    pthread_mutex_destroy(&q->lock);
+    free(q->evs);
+    free(q->fds);
+    free(q);
+}
+
+int iomp_queue_read(iomp_queue_t q, iomp_aio_t aio) {
+    if (!q || !aio || (!aio->complete && !aio->ring) || !aio->buf) {
+        errno = EINVAL;
+        return -1;
+    }
+    return fd_park(q, aio, LO_IN);
+}
+
+int iomp_queue_write(iomp_queue_t q, iomp_aio_t aio) {
+    if (!q || !aio || (!aio->complete && !aio->ring) || !aio->buf) {
+        errno = EINVAL;
+        return -1;
+    }
+    return fd_park(q, aio, LO_OUT);
+}
+
+int iomp_queue_accept(iomp_queue_t q, struct iomp_aio* aio) {
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+int iomp_queue_unaccept(iomp_queue_t q, struct iomp_aio* aio) {
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+int iomp_queue_run(iomp_queue_t q, int timeout) {
+    if (!q) {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&q->lock);
+    if (q->nevs == 0 && !q->signalled && timeout != 0) {
+        pthread_mutex_unlock(&q->lock);
+        struct pollfd pfd;
+        pfd.fd = q->intr[0];
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, timeout) == -1) {
+            return -1;
+        }
+        pthread_mutex_lock(&q->lock);
+    }
+    if (q->signalled) {
+        char buf[8];
+        while (read(q->intr[0], buf, sizeof(buf)) > 0) {
+        }
+        q->signalled = 0;
+    }
+    int n = q->nevs < q->nevents ? q->nevs : q->nevents;
+    if (n > 0) {
+        memcpy(q->taken, q->evs, sizeof(*q->evs) * n);
+        q->nevs -= n;
+        memmove(q->evs, q->evs + n, sizeof(*q->evs) * q->nevs);
+    }
+    pthread_mutex_unlock(&q->lock);
+    for (int i = 0; i < n; i++) {
+        fd_event(q, q->taken[i].fd, q->taken[i].dir);
+    }
+    pthread_mutex_lock(&q->lock);
+    int left = q->nevs;
+    pthread_mutex_unlock(&q->lock);
+    return left;
+}
+
+int iomp_queue_fileno(iomp_queue_t q) {
+    if (!q) {
+        errno = EINVAL;
+        return -1;
+    }
+    return q->intr[0];
+}
+
+void iomp_queue_interrupt(iomp_queue_t q) {
+    if (!q) {
+        return;
+    }
+    pthread_mutex_lock(&q->lock);
+    lo_signal(q);
+    pthread_mutex_unlock(&q->lock);
+}
+
+void iomp_queue_shard(iomp_queue_t q, int index, int count) {
+    if (!q || count <= 0 || index < 0 || index >= count || q->nfds > 0) {
+        return;
+    }
+    q->shard = index;
+    q->nshards = count;
+}
+
+/* pipes hold no registration, closing one already unhooks it */
+void iomp_queue_forget(iomp_queue_t q, int fd) {
+}
+
+void lo_init(void) {
+    for (int i = 0; i < LO_STRIPES; i++) {
+        pthread_mutex_init(g_lo_stripes + i, NULL);
+    }
+}
+
+/* the pair stays until lo_put, even if the end is closed meanwhile */
+struct iomp_lopair* lo_get(int fd, int* side) {
+    if (fd < 0 || fd >= LO_MAXFDS ||
+            !__atomic_load_n(g_lo_fds + fd, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+    pthread_mutex_t* stripe = g_lo_stripes + fd % LO_STRIPES;
+    pthread_mutex_lock(stripe);
+    struct iomp_lopair* p = __atomic_load_n(g_lo_fds + fd, __ATOMIC_ACQUIRE);
+    if (p) {
+        __atomic_add_fetch(&p->refs, 1, __ATOMIC_RELAXED);
+        *side = (p->fds[1] == fd);
+    }
+    pthread_mutex_unlock(stripe);
+    return p;
+}
+
+void lo_put(struct iomp_lopair* p) {
+    if (__atomic_sub_fetch(&p->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+    pthread_mutex_destroy(&p->lock);
+    free(p->bufs[0]);
+    free(p->bufs[1]);
+    free(p);
+}
+
+/* posts right away if the end is ready already */
+int lo_arm(iomp_queue_t q, int fd, int dir) {
+    int i = 0;
+    struct iomp_lopair* p = lo_get(fd, &i);
+    if (!p) {
+        errno = EBADF;
+        return -1;
+    }
+    int j = 1 - i;
+    pthread_mutex_lock(&p->lock);
+    int ready = (dir == LO_IN) ?
+            (p->tails[i] != p->heads[i] || p->closed[j]) :
+            (p->closed[j] || p->tails[j] - p->heads[j] < p->capacity);
+    if (ready) {
+        lo_post(q, fd, dir);
+    } else if (dir == LO_IN) {
+        p->rdq[i] = q;
+    } else {
+        p->wrq[i] = q;
+    }
+    pthread_mutex_unlock(&p->lock);
+    lo_put(p);
+    return 0;
+}
+
+void lo_disarm(iomp_queue_t q, int fd) {
+    int i = 0;
+    struct iomp_lopair* p = lo_get(fd, &i);
+    if (!p) {
+        return;
+    }
+    pthread_mutex_lock(&p->lock);
+    if (p->rdq[i] == q) {
+        p->rdq[i] = NULL;
+    }
+    if (p->wrq[i] == q) {
+        p->wrq[i] = NULL;
+    }
+    pthread_mutex_unlock(&p->lock);
+    lo_put(p);
+}
+
+/* fd_park made room for it */
+void lo_post(iomp_queue_t q, int fd, int dir) {
+    pthread_mutex_lock(&q->lock);
+    q->evs[q->nevs].fd = fd;
+    q->evs[q->nevs].dir = dir;
+    q->nevs++;
+    lo_signal(q);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* called with q->lock held */
+void lo_signal(iomp_queue_t q) {
+    if (q->signalled) {
+        return;
+    }
+    q->signalled = 1;
+    char c = 0;
+    if (write(q->intr[1], &c, 1) == -1 && errno != EAGAIN) {
+        IOMP_LOG(WARNING, "write fail: %s", strerror(errno));
+    }
+}
+
+struct iomp_fdent* fd_get(iomp_queue_t q, int fd) {
+    if (fd < 0) {
+        errno = EBADF;
+        return NULL;
+    }
+    if (fd % q->nshards != q->shard) {
+        IOMP_LOG(ERROR, "fd %d parked outside its shard", fd);
+        errno = EXDEV;
+        return NULL;
+    }
+    int slot = fd / q->nshards;
+    if (slot >= q->nfds) {
+        int n = q->nfds > 0 ? q->nfds : 64;
+        while (n <= slot) {
+            n *= 2;
+        }
+        struct iomp_fdent* fds = (struct iomp_fdent*)realloc(
+                q->fds, sizeof(*fds) * n);
+        if (!fds) {
+            IOMP_LOG(ERROR, "realloc fail: %s", strerror(errno));
+            return NULL;
+        }
+        memset(fds + q->nfds, 0, sizeof(*fds) * (n - q->nfds));
+        q->fds = fds;
+        q->nfds = n;
+    }
+    return q->fds + slot;
+}
+
+int fd_park(iomp_queue_t q, iomp_aio_t aio, int dir) {
+    struct iomp_fdent* ent = fd_get(q, aio->fildes);
+    if (!ent) {
+        return -1;
+    }
+    iomp_aio_t* slot = (dir == LO_IN ? &ent->rd : &ent->wr);
+    if (*slot) {
+        errno = EEXIST;
+        return -1;
+    }
+    if (q->nparked == q->maxevs) {
+        int n = q->maxevs > 0 ? q->maxevs * 2 : 64;
+        pthread_mutex_lock(&q->lock);
+        struct iomp_loevent* evs = (struct iomp_loevent*)realloc(
+                q->evs, sizeof(*evs) * n);
+        if (evs) {
+            q->evs = evs;
+            q->maxevs = n;
+        }
+        pthread_mutex_unlock(&q->lock);
+        if (!evs) {
+            IOMP_LOG(ERROR, "realloc fail: %s", strerror(errno));
+            return -1;
+        }
+    }
+    *slot = aio;
+    q->nparked++;
+    if (lo_arm(q, aio->fildes, dir) == -1) {
+        *slot = NULL;
+        q->nparked--;
+        return -1;
+    }
+    return 0;
+}
+
+void fd_done(iomp_queue_t q, iomp_aio_t aio, int dir) {
+    struct iomp_fdent* ent = q->fds + aio->fildes / q->nshards;
+    if (dir == LO_IN) {
+        ent->rd = NULL;
+    } else {
+        ent->wr = NULL;
+    }
+    q->nparked--;
+}
+
+/* every parked aio has exactly one arm or event outstanding */
+void fd_event(iomp_queue_t q, int fd, int dir) {
+    int slot = fd / q->nshards;
+    if (slot >= q->nfds) {
+        return;
+    }
+    struct iomp_fdent* ent = q->fds + slot;
+    iomp_aio_t aio = (dir == LO_IN ? ent->rd : ent->wr);
+    if (!aio) {
+        return;
+    }
+    if (dir == LO_IN) {
+        on_read(q, aio);
+    } else {
+        on_write(q, aio);
+    }
+}
+
+void on_read(iomp_queue_t q, iomp_aio_t aio) {
+    void* buf = aio->buf + aio->offset;
+    size_t todo = aio->nbytes - aio->offset;
+    size_t budget = IOMP_EVENT_BUDGET;
+    int nsyscall = IOMP_EVENT_SYSCALLS;
+    while (todo > 0) {
+        if (budget == 0 || nsyscall-- == 0) {
+            /* the rest of it after the other events */
+            aio->offset = aio->nbytes - todo;
+            lo_post(q, aio->fildes, LO_IN);
+            return;
+        }
+        ssize_t len = iomp_lo_read(aio->fildes, buf,
+                todo < budget ? todo : budget);
+        if (len > 0) {
+            IOMP_CRC_FEED(aio, buf, len);
+            buf += len;
+            todo -= len;
+            budget -= len;
+        } else if (len == -1 && errno == EAGAIN) {
+            aio->offset = aio->nbytes - todo;
+            if (lo_arm(q, aio->fildes, LO_IN) == -1) {
+                fd_done(q, aio, LO_IN);
+                iomp_complete(aio, errno);
+            }
+            return;
+        } else {
+            aio->offset = aio->nbytes - todo;
+            fd_done(q, aio, LO_IN);
+            iomp_complete(aio, len == -1 ? errno : -1);
+            return;
+        }
+    }
+    aio->offset = aio->nbytes;
+    fd_done(q, aio, LO_IN);
+    iomp_complete(aio, IOMP_CRC_CHECK(aio));
+}
+
+void on_write(iomp_queue_t q, iomp_aio_t aio) {
+    void* buf = aio->buf + aio->offset;
+    size_t todo = aio->nbytes - aio->offset;
+    size_t budget = IOMP_EVENT_BUDGET;
+    int nsyscall = IOMP_EVENT_SYSCALLS;
+    while (todo > 0) {
+        if (budget == 0 || nsyscall-- == 0) {
+            aio->offset = aio->nbytes - todo;
+            lo_post(q, aio->fildes, LO_OUT);
+            return;
+        }
+        ssize_t len = iomp_lo_write(aio->fildes, buf,
+                todo < budget ? todo : budget);
+        if (len > 0) {
+            buf += len;
+            todo -= len;
+            budget -= len;
+        } else if (len == -1 && errno == EAGAIN) {
+            aio->offset = aio->nbytes - todo;
+            if (lo_arm(q, aio->fildes, LO_OUT) == -1) {
+                fd_done(q, aio, LO_OUT);
+                iomp_complete(aio, errno);
+            }
+            return;
+        } else {
+            aio->offset = aio->nbytes - todo;
+            fd_done(q, aio, LO_OUT);
+            iomp_complete(aio, len == -1 ? errno : -1);
+            return;
+        }
+    }
+    aio->offset = aio->nbytes;
+    fd_done(q, aio, LO_OUT);
+    iomp_complete(aio, 0);
+}
+
+#else /* IOMP_LOOPBACK */
+
+int iomp_loopback_pair(int* fds, size_t capacity) {
+    return ENOSYS;
+}
+
+int iomp_loopback_close(int fd) {
+    return ENOSYS;
+}
+
+#endif /* IOMP_LOOPBACK */
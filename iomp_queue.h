@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <sys/types.h>
 
 struct iomp_queue;
 typedef struct iomp_queue* iomp_queue_t;
@@ -14,9 +15,72 @@ struct iomp_aio;
 int iomp_queue_read(iomp_queue_t q, struct iomp_aio* aio);
 int iomp_queue_write(iomp_queue_t q, struct iomp_aio* aio);
 int iomp_queue_accept(iomp_queue_t q, struct iomp_aio* aio);
+int iomp_queue_unaccept(iomp_queue_t q, struct iomp_aio* aio);
 
+/* returns the number of aios left over from this round, these are
+ * continued by the next call, which then does not block */
 int iomp_queue_run(iomp_queue_t q, int timeout);
 void iomp_queue_interrupt(iomp_queue_t q);
+int iomp_queue_fileno(iomp_queue_t q);
+
+/* only fds with fd % count == index may be parked on q, its fd table then
+ * holds just those; set before the first park, the default is 0 of 1 */
+void iomp_queue_shard(iomp_queue_t q, int index, int count);
+
+/* registrations outlive aios, so an fd must be forgotten before it is
+ * closed with nothing pending; safe from any thread, the table of q
+ * catches up on its next park */
+void iomp_queue_forget(iomp_queue_t q, int fd);
+
+void iomp_complete(struct iomp_aio* aio, int error);
+
+/* integrity stage, see IOMP_AIO_CRC32C: iomp_crc_start seals a write or
+ * resets a read and returns 0 or EINVAL, reads feed each chunk they got
+ * and complete with the check once done */
+#if IOMP_COMPACT
+#define IOMP_CRC_START(aio, write) 0
+#define IOMP_CRC_FEED(aio, data, len) ((void)0)
+#define IOMP_CRC_CHECK(aio) 0
+#else
+int iomp_crc_start(struct iomp_aio* aio, int write);
+void iomp_crc_feed(struct iomp_aio* aio, const void* data, size_t len);
+int iomp_crc_check(struct iomp_aio* aio);
+#define IOMP_CRC_START(aio, write) iomp_crc_start(aio, write)
+#define IOMP_CRC_FEED(aio, data, len) \
+    do { \
+        if ((aio)->flags & IOMP_AIO_CRC32C) { \
+            iomp_crc_feed(aio, data, len); \
+        } \
+    } while (0)
+#define IOMP_CRC_CHECK(aio) \
+    (((aio)->flags & IOMP_AIO_CRC32C) ? iomp_crc_check(aio) : 0)
+#endif /* IOMP_COMPACT */
+
+/* socket I/O of the core, which the loopback backend serves from memory */
+#if IOMP_LOOPBACK
+struct iovec;
+ssize_t iomp_lo_read(int fd, void* buf, size_t nbytes);
+ssize_t iomp_lo_write(int fd, const void* buf, size_t nbytes);
+ssize_t iomp_lo_writev(int fd, const struct iovec* iov, int iovcnt);
+#define IOMP_READ iomp_lo_read
+#define IOMP_WRITE iomp_lo_write
+#define IOMP_WRITEV iomp_lo_writev
+#else
+#define IOMP_READ read
+#define IOMP_WRITE write
+#define IOMP_WRITEV writev
+#endif /* IOMP_LOOPBACK */
+
+/* workload capture hooks, see iomp_trace_open; op is IOMP_TRACE_* */
+void iomp_trace_submit(struct iomp_aio* aio, int op);
+void iomp_trace_complete(struct iomp_aio* aio, int error);
+
+/* runs fn on a worker with that worker's queue, or with NULL if the job
+ * got cancelled on shutdown; returns 0 or an error. fildes is what fn
+ * parks on that queue, -1 if nothing; in compact mode it picks the worker */
+struct iomp_core;
+int iomp_defer(struct iomp_core* iomp, int fildes, int priority,
+        void (*fn)(void* arg, iomp_queue_t q), void* arg);
 
 #if 0
 struct iomp_evlist;
@@ -0,0 +1,245 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/queue.h>
+#include "iomp_queue.h"
+#include "iomp.h"
+
+#define IOMP_CACHELINE 64
+
+struct iomp_ring_slot {
+    size_t seq;
+    struct iomp_completion c;
+};
+
+/* a completion that found the ring full */
+struct iomp_ring_spill {
+    STAILQ_ENTRY(iomp_ring_spill) entries;
+    struct iomp_completion c;
+};
+
+/* bounded multi-producer, single-consumer ring, the consumer only takes
+ * the mutex to sleep and producers only take it to wake a sleeper */
+struct iomp_ring {
+    size_t mask;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* under lock, taken after the slots; while spilled is set producers
+     * append here rather than get ahead of it in the ring */
+    STAILQ_HEAD(, iomp_ring_spill) spills;
+    char pad0[IOMP_CACHELINE];
+    size_t head;
+    char pad1[IOMP_CACHELINE - sizeof(size_t)];
+    size_t tail;
+    int waiting;
+    int spilled;
+    char pad2[IOMP_CACHELINE - sizeof(size_t) - 2 * sizeof(int)];
+    struct iomp_ring_slot slots[];
+};
+
+static void ring_push(iomp_ring_t ring, iomp_aio_t aio, int error);
+static void ring_spill(iomp_ring_t ring, iomp_aio_t aio, int error);
+static int ring_pop(iomp_ring_t ring,
+        struct iomp_completion* out, int max, int locked);
+
+iomp_ring_t iomp_ring_new(size_t capacity) {
+    if (capacity == 0 || capacity > SIZE_MAX / 2) {
+        errno = EINVAL;
+        return NULL;
+    }
+    size_t n = 1;
+    while (n < capacity) {
+        n *= 2;
+    }
+    iomp_ring_t ring = NULL;
+    int rv = posix_memalign((void**)&ring, IOMP_CACHELINE,
+            sizeof(*ring) + sizeof(struct iomp_ring_slot) * n);
+    if (rv != 0) {
+        IOMP_LOG(ERROR, "posix_memalign fail: %s", strerror(rv));
+        errno = rv;
+        return NULL;
+    }
+    ring->mask = n - 1;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->waiting = 0;
+    ring->spilled = 0;
+    STAILQ_INIT(&ring->spills);
+    for (size_t i = 0; i < n; i++) {
+        ring->slots[i].seq = i;
+    }
+    rv = pthread_mutex_init(&ring->lock, NULL);
+    if (rv != 0) {
+        IOMP_LOG(ERROR, "pthread_mutex_init fail: %s", strerror(rv));
+        free(ring);
+        errno = rv;
+        return NULL;
+    }
+    rv = pthread_cond_init(&ring->cond, NULL);
+    if (rv != 0) {
+        IOMP_LOG(ERROR, "pthread_cond_init fail: %s", strerror(rv));
+        pthread_mutex_destroy(&ring->lock);
+        free(ring);
+        errno = rv;
+        return NULL;
+    }
+    return ring;
+}
+
+void iomp_ring_drop(iomp_ring_t ring) {
+    if (!ring) {
+        return;
+    }
+    while (!STAILQ_EMPTY(&ring->spills)) {
+        struct iomp_ring_spill* sp = STAILQ_FIRST(&ring->spills);
+        STAILQ_REMOVE_HEAD(&ring->spills, entries);
+        free(sp);
+    }
+    pthread_cond_destroy(&ring->cond);
+    pthread_mutex_destroy(&ring->lock);
+    free(ring);
+}
+
+int iomp_get_completions(iomp_ring_t ring,
+        struct iomp_completion* out, int max, int timeout) {
+    if (!ring || !out || max <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    int n = ring_pop(ring, out, max, 0);
+    if (n > 0 || timeout == 0) {
+        return n;
+    }
+    struct timespec ts = { 0, 0 };
+    if (timeout > 0) {
+        struct timeval tv = { 0, 0 };
+        gettimeofday(&tv, NULL);
+        ts.tv_sec = tv.tv_sec + timeout / 1000;
+        ts.tv_nsec = tv.tv_usec * 1000 + (timeout % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+    }
+    pthread_mutex_lock(&ring->lock);
+    __atomic_store_n(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    while ((n = ring_pop(ring, out, max, 1)) == 0) {
+        int rv = timeout > 0 ?
+            pthread_cond_timedwait(&ring->cond, &ring->lock, &ts) :
+            pthread_cond_wait(&ring->cond, &ring->lock);
+        if (rv == ETIMEDOUT) {
+            n = ring_pop(ring, out, max, 1);
+            break;
+        }
+    }
+    __atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&ring->lock);
+    return n;
+}
+
+void iomp_complete(iomp_aio_t aio, int error) {
+    /* before complete, which may well submit the aio again */
+    iomp_trace_complete(aio, error);
+    if (aio->ring) {
+        ring_push(aio->ring, aio, error);
+    } else {
+        aio->complete(aio, error);
+    }
+}
+
+void ring_push(iomp_ring_t ring, iomp_aio_t aio, int error) {
+    if (__atomic_load_n(&ring->spilled, __ATOMIC_ACQUIRE)) {
+        ring_spill(ring, aio, error);
+        return;
+    }
+    size_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    struct iomp_ring_slot* slot = NULL;
+    while (1) {
+        slot = ring->slots + (pos & ring->mask);
+        size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, 1,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (dif < 0) {
+            /* full, the consumer is behind and may well be this thread,
+             * polling or failing a submission */
+            ring_spill(ring, aio, error);
+            return;
+        } else {
+            pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        }
+    }
+    slot->c.aio = aio;
+    slot->c.error = error;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->waiting, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&ring->lock);
+        pthread_cond_signal(&ring->cond);
+        pthread_mutex_unlock(&ring->lock);
+    }
+}
+
+void ring_spill(iomp_ring_t ring, iomp_aio_t aio, int error) {
+    struct iomp_ring_spill* sp =
+        (struct iomp_ring_spill*)malloc(sizeof(*sp));
+    while (!sp) {
+        /* nowhere to put it, nothing else to do but wait for room */
+        IOMP_LOG(ERROR, "malloc fail: %s", strerror(errno));
+        sched_yield();
+        sp = (struct iomp_ring_spill*)malloc(sizeof(*sp));
+    }
+    sp->c.aio = aio;
+    sp->c.error = error;
+    pthread_mutex_lock(&ring->lock);
+    STAILQ_INSERT_TAIL(&ring->spills, sp, entries);
+    __atomic_store_n(&ring->spilled, 1, __ATOMIC_RELEASE);
+    if (ring->waiting) {
+        pthread_cond_signal(&ring->cond);
+    }
+    pthread_mutex_unlock(&ring->lock);
+}
+
+int ring_pop(iomp_ring_t ring,
+        struct iomp_completion* out, int max, int locked) {
+    size_t pos = ring->tail;
+    int n = 0;
+    while (n < max) {
+        struct iomp_ring_slot* slot = ring->slots + (pos & ring->mask);
+        size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq != pos + 1) {
+            break;
+        }
+        out[n++] = slot->c;
+        __atomic_store_n(&slot->seq, pos + ring->mask + 1, __ATOMIC_RELEASE);
+        pos++;
+    }
+    ring->tail = pos;
+    if (n == max || !__atomic_load_n(&ring->spilled, __ATOMIC_ACQUIRE)) {
+        return n;
+    }
+    if (!locked) {
+        pthread_mutex_lock(&ring->lock);
+    }
+    while (n < max && !STAILQ_EMPTY(&ring->spills)) {
+        struct iomp_ring_spill* sp = STAILQ_FIRST(&ring->spills);
+        STAILQ_REMOVE_HEAD(&ring->spills, entries);
+        out[n++] = sp->c;
+        free(sp);
+    }
+    if (STAILQ_EMPTY(&ring->spills)) {
+        __atomic_store_n(&ring->spilled, 0, __ATOMIC_RELEASE);
+    }
+    if (!locked) {
+        pthread_mutex_unlock(&ring->lock);
+    }
+    return n;
+}
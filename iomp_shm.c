@@ -0,0 +1,441 @@
+#if defined(__linux__)
+#define _GNU_SOURCE /* memfd_create */
+#endif /* __linux__ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "iomp_queue.h"
+#include "iomp.h"
+
+#if defined(__linux__)
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+#define IOMP_SHM_MAGIC  0x696f6d70
+#define IOMP_SHM_LINE   64
+
+/* one direction in the shared segment, counters only grow; producer and
+ * consumer each own a cache line, the wait flags are only touched by a
+ * side about to sleep and by the other side waking it */
+struct iomp_shm_ring {
+    uint64_t head;
+    char pad0[IOMP_SHM_LINE - sizeof(uint64_t)];
+    uint64_t tail;
+    char pad1[IOMP_SHM_LINE - sizeof(uint64_t)];
+    uint32_t rwait;
+    uint32_t wwait;
+    char pad2[IOMP_SHM_LINE - 2 * sizeof(uint32_t)];
+};
+
+/* start of the segment, ring data follows: ring 0 carries side 0 to
+ * side 1, ring 1 the way back */
+struct iomp_shm_ctl {
+    uint32_t magic;
+    uint32_t closed;
+    uint64_t capacity;
+    char pad[IOMP_SHM_LINE - 2 * sizeof(uint32_t) - sizeof(uint64_t)];
+    struct iomp_shm_ring rings[2];
+};
+
+/* fds: the segment, then the data and space eventfds of each ring */
+#define IOMP_SHM_SEGMENT        0
+#define IOMP_SHM_DATA(ring)     (1 + (ring) * 2)
+#define IOMP_SHM_SPACE(ring)    (2 + (ring) * 2)
+
+/* the one read or write in flight on an endpoint */
+struct iomp_shm_op {
+    iomp_shm_t shm;
+    struct iomp_shm_ring* ring;
+    char* data;
+    int write;
+    /* eventfd this side sleeps on, and the one the peer sleeps on */
+    int waitfd;
+    int wakefd;
+    iomp_aio_t aio;
+    iomp_queue_t queue;
+    /* readiness only, nbytes 0 */
+    struct iomp_aio ready;
+};
+
+struct iomp_shm {
+    int fds[IOMP_SHM_FDS];
+    struct iomp_shm_ctl* ctl;
+    size_t mapsz;
+    size_t capacity;
+    struct iomp_shm_op rd;
+    struct iomp_shm_op wr;
+};
+
+#define IOMP_CONTAINER_OF(ptr, type, member) \
+    ((type*)((char*)(ptr) - offsetof(type, member)))
+
+static iomp_shm_t shm_map(const int* fds, int side, int create,
+        size_t capacity);
+static void shm_op_init(iomp_shm_t shm, struct iomp_shm_op* op, int ring,
+        int write);
+static void shm_submit(iomp_t iomp, struct iomp_shm_op* op, iomp_aio_t aio);
+static void shm_start(void* arg, iomp_queue_t q);
+static void shm_ready(iomp_aio_t aio, int error);
+static void shm_step(struct iomp_shm_op* op);
+static size_t shm_avail(struct iomp_shm_op* op, size_t capacity);
+static void shm_copy(struct iomp_shm_op* op, size_t n);
+static void shm_wake(struct iomp_shm_op* op, uint32_t* flag);
+static void shm_done(struct iomp_shm_op* op, int error);
+
+iomp_shm_t iomp_shm_new(size_t capacity) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t n = page;
+    while (n < capacity) {
+        n *= 2;
+    }
+    int fds[IOMP_SHM_FDS];
+    for (int i = 0; i < IOMP_SHM_FDS; i++) {
+        fds[i] = -1;
+    }
+    fds[IOMP_SHM_SEGMENT] = memfd_create("iomp_shm", MFD_CLOEXEC);
+    if (fds[IOMP_SHM_SEGMENT] == -1) {
+        IOMP_LOG(ERROR, "memfd_create fail: %s", strerror(errno));
+        return NULL;
+    }
+    iomp_shm_t shm = NULL;
+    size_t mapsz = sizeof(struct iomp_shm_ctl) + 2 * n;
+    if (ftruncate(fds[IOMP_SHM_SEGMENT], mapsz) == -1) {
+        IOMP_LOG(ERROR, "ftruncate fail: %s", strerror(errno));
+        goto out;
+    }
+    for (int i = 1; i < IOMP_SHM_FDS; i++) {
+        fds[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fds[i] == -1) {
+            IOMP_LOG(ERROR, "eventfd fail: %s", strerror(errno));
+            goto out;
+        }
+    }
+    shm = shm_map(fds, 0, 1, n);
+out:
+    if (!shm) {
+        int err = errno;
+        for (int i = 0; i < IOMP_SHM_FDS; i++) {
+            if (fds[i] != -1) {
+                close(fds[i]);
+            }
+        }
+        errno = err;
+    }
+    return shm;
+}
+
+iomp_shm_t iomp_shm_attach(const int* fds) {
+    if (!fds) {
+        errno = EINVAL;
+        return NULL;
+    }
+    int dups[IOMP_SHM_FDS];
+    for (int i = 0; i < IOMP_SHM_FDS; i++) {
+        dups[i] = fcntl(fds[i], F_DUPFD_CLOEXEC, 0);
+        if (dups[i] == -1) {
+            IOMP_LOG(ERROR, "dup fail: %s", strerror(errno));
+            int err = errno;
+            while (i-- > 0) {
+                close(dups[i]);
+            }
+            errno = err;
+            return NULL;
+        }
+    }
+    iomp_shm_t shm = shm_map(dups, 1, 0, 0);
+    if (!shm) {
+        int err = errno;
+        for (int i = 0; i < IOMP_SHM_FDS; i++) {
+            close(dups[i]);
+        }
+        errno = err;
+    }
+    return shm;
+}
+
+void iomp_shm_fds(iomp_shm_t shm, int* fds) {
+    if (!shm || !fds) {
+        return;
+    }
+    memcpy(fds, shm->fds, sizeof(shm->fds));
+}
+
+void iomp_shm_drop(iomp_shm_t shm) {
+    if (!shm) {
+        return;
+    }
+    /* both peer ops may be asleep, wake them to see closed */
+    __atomic_store_n(&shm->ctl->closed, 1, __ATOMIC_SEQ_CST);
+    uint64_t one = 1;
+    if (write(shm->rd.wakefd, &one, sizeof(one)) == -1 ||
+            write(shm->wr.wakefd, &one, sizeof(one)) == -1) {
+        IOMP_LOG(WARNING, "eventfd write fail: %s", strerror(errno));
+    }
+    munmap(shm->ctl, shm->mapsz);
+    /* the eventfds an op waited on stay registered with its worker */
+    if (shm->rd.queue) {
+        iomp_queue_forget(shm->rd.queue, shm->rd.waitfd);
+    }
+    if (shm->wr.queue) {
+        iomp_queue_forget(shm->wr.queue, shm->wr.waitfd);
+    }
+    for (int i = 0; i < IOMP_SHM_FDS; i++) {
+        close(shm->fds[i]);
+    }
+    free(shm);
+}
+
+void iomp_shm_read(iomp_t iomp, iomp_shm_t shm, iomp_aio_t aio) {
+    if (!aio || (!aio->complete && !aio->ring)) {
+        IOMP_LOG(ERROR, "invalid argument");
+        return;
+    }
+    if (!iomp || !shm || !aio->buf) {
+        iomp_complete(aio, EINVAL);
+        return;
+    }
+    shm_submit(iomp, &shm->rd, aio);
+}
+
+void iomp_shm_write(iomp_t iomp, iomp_shm_t shm, iomp_aio_t aio) {
+    if (!aio || (!aio->complete && !aio->ring)) {
+        IOMP_LOG(ERROR, "invalid argument");
+        return;
+    }
+    if (!iomp || !shm || !aio->buf) {
+        iomp_complete(aio, EINVAL);
+        return;
+    }
+    shm_submit(iomp, &shm->wr, aio);
+}
+
+iomp_shm_t shm_map(const int* fds, int side, int create, size_t capacity) {
+    size_t mapsz = sizeof(struct iomp_shm_ctl) + 2 * capacity;
+    if (!create) {
+        struct stat st;
+        if (fstat(fds[IOMP_SHM_SEGMENT], &st) == -1) {
+            IOMP_LOG(ERROR, "fstat fail: %s", strerror(errno));
+            return NULL;
+        }
+        mapsz = (size_t)st.st_size;
+    }
+    void* base = mmap(NULL, mapsz, PROT_READ | PROT_WRITE, MAP_SHARED,
+            fds[IOMP_SHM_SEGMENT], 0);
+    if (base == MAP_FAILED) {
+        IOMP_LOG(ERROR, "mmap fail: %s", strerror(errno));
+        return NULL;
+    }
+    struct iomp_shm_ctl* ctl = (struct iomp_shm_ctl*)base;
+    if (create) {
+        /* a fresh memfd reads as zeros, only the header needs filling */
+        ctl->capacity = capacity;
+        __atomic_store_n(&ctl->magic, IOMP_SHM_MAGIC, __ATOMIC_RELEASE);
+    } else {
+        capacity = ctl->capacity;
+        if (__atomic_load_n(&ctl->magic, __ATOMIC_ACQUIRE) != IOMP_SHM_MAGIC ||
+                mapsz != sizeof(struct iomp_shm_ctl) + 2 * capacity) {
+            IOMP_LOG(ERROR, "not an iomp segment");
+            munmap(base, mapsz);
+            errno = EINVAL;
+            return NULL;
+        }
+    }
+    iomp_shm_t shm = (iomp_shm_t)malloc(sizeof(*shm));
+    if (!shm) {
+        IOMP_LOG(ERROR, "malloc fail: %s", strerror(errno));
+        munmap(base, mapsz);
+        return NULL;
+    }
+    memcpy(shm->fds, fds, sizeof(shm->fds));
+    shm->ctl = ctl;
+    shm->mapsz = mapsz;
+    shm->capacity = capacity;
+    shm_op_init(shm, &shm->rd, 1 - side, 0);
+    shm_op_init(shm, &shm->wr, side, 1);
+    return shm;
+}
+
+void shm_op_init(iomp_shm_t shm, struct iomp_shm_op* op, int ring,
+        int write) {
+    op->shm = shm;
+    op->ring = &shm->ctl->rings[ring];
+    op->data = (char*)(shm->ctl + 1) + ring * shm->capacity;
+    op->write = write;
+    if (write) {
+        op->waitfd = shm->fds[IOMP_SHM_SPACE(ring)];
+        op->wakefd = shm->fds[IOMP_SHM_DATA(ring)];
+    } else {
+        op->waitfd = shm->fds[IOMP_SHM_DATA(ring)];
+        op->wakefd = shm->fds[IOMP_SHM_SPACE(ring)];
+    }
+    op->aio = NULL;
+    op->queue = NULL;
+    memset(&op->ready, 0, sizeof(op->ready));
+    op->ready.fildes = op->waitfd;
+    op->ready.buf = op;
+    op->ready.nbytes = 0;
+    op->ready.complete = shm_ready;
+}
+
+void shm_submit(iomp_t iomp, struct iomp_shm_op* op, iomp_aio_t aio) {
+    aio->offset = 0;
+    op->aio = aio;
+    op->ready.priority = aio->priority;
+    int error = iomp_defer(iomp, op->waitfd, aio->priority, shm_start, op);
+    if (error != 0) {
+        op->aio = NULL;
+        iomp_complete(aio, error);
+    }
+}
+
+void shm_start(void* arg, iomp_queue_t q) {
+    struct iomp_shm_op* op = (struct iomp_shm_op*)arg;
+    if (!q) {
+        shm_done(op, -1);
+        return;
+    }
+    op->queue = q;
+    shm_step(op);
+}
+
+void shm_ready(iomp_aio_t aio, int error) {
+    struct iomp_shm_op* op = IOMP_CONTAINER_OF(aio, struct iomp_shm_op, ready);
+    if (error != 0) {
+        shm_done(op, error);
+        return;
+    }
+    uint64_t n = 0;
+    if (read(op->waitfd, &n, sizeof(n)) == -1 && errno != EAGAIN) {
+        shm_done(op, errno);
+        return;
+    }
+    shm_step(op);
+}
+
+void shm_step(struct iomp_shm_op* op) {
+    iomp_aio_t aio = op->aio;
+    struct iomp_shm_ring* ring = op->ring;
+    uint32_t* mine = op->write ? &ring->wwait : &ring->rwait;
+    uint32_t* peer = op->write ? &ring->rwait : &ring->wwait;
+    size_t capacity = op->shm->capacity;
+    while (aio->offset < aio->nbytes) {
+        if (op->write &&
+                __atomic_load_n(&op->shm->ctl->closed, __ATOMIC_ACQUIRE)) {
+            shm_done(op, EPIPE);
+            return;
+        }
+        size_t avail = shm_avail(op, capacity);
+        if (avail > 0) {
+            size_t todo = aio->nbytes - aio->offset;
+            shm_copy(op, avail < todo ? avail : todo);
+            shm_wake(op, peer);
+            continue;
+        }
+        if (!op->write &&
+                __atomic_load_n(&op->shm->ctl->closed, __ATOMIC_ACQUIRE)) {
+            shm_done(op, -1);
+            return;
+        }
+        /* announce the sleep, then look again so a peer that missed the
+         * flag cannot have slipped data or space in unnoticed */
+        __atomic_store_n(mine, 1, __ATOMIC_SEQ_CST);
+        if (shm_avail(op, capacity) > 0 ||
+                __atomic_load_n(&op->shm->ctl->closed, __ATOMIC_SEQ_CST)) {
+            __atomic_store_n(mine, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (iomp_queue_read(op->queue, &op->ready) == -1) {
+            __atomic_store_n(mine, 0, __ATOMIC_RELAXED);
+            shm_done(op, errno);
+        }
+        return;
+    }
+    shm_done(op, 0);
+}
+
+size_t shm_avail(struct iomp_shm_op* op, size_t capacity) {
+    struct iomp_shm_ring* ring = op->ring;
+    if (op->write) {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+        return capacity - (size_t)(ring->tail - head);
+    }
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+    return (size_t)(tail - ring->head);
+}
+
+/* moves n bytes between the aio and the ring, then publishes them */
+void shm_copy(struct iomp_shm_op* op, size_t n) {
+    iomp_aio_t aio = op->aio;
+    struct iomp_shm_ring* ring = op->ring;
+    size_t capacity = op->shm->capacity;
+    uint64_t* own = op->write ? &ring->tail : &ring->head;
+    size_t at = (size_t)(*own & (capacity - 1));
+    size_t first = capacity - at < n ? capacity - at : n;
+    char* p = (char*)aio->buf + aio->offset;
+    if (op->write) {
+        memcpy(op->data + at, p, first);
+        memcpy(op->data, p + first, n - first);
+    } else {
+        memcpy(p, op->data + at, first);
+        memcpy(p + first, op->data, n - first);
+    }
+    aio->offset += n;
+    __atomic_store_n(own, *own + n, __ATOMIC_RELEASE);
+}
+
+/* kicks the peer only if it announced it is going to sleep */
+void shm_wake(struct iomp_shm_op* op, uint32_t* flag) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(flag, __ATOMIC_RELAXED) == 0 ||
+            __atomic_exchange_n(flag, 0, __ATOMIC_ACQ_REL) == 0) {
+        return;
+    }
+    uint64_t one = 1;
+    if (write(op->wakefd, &one, sizeof(one)) == -1) {
+        IOMP_LOG(WARNING, "eventfd write fail: %s", strerror(errno));
+    }
+}
+
+void shm_done(struct iomp_shm_op* op, int error) {
+    iomp_aio_t aio = op->aio;
+    op->aio = NULL;
+    iomp_complete(aio, error);
+}
+
+#else /* __linux__ */
+
+iomp_shm_t iomp_shm_new(size_t capacity) {
+    errno = ENOSYS;
+    return NULL;
+}
+
+iomp_shm_t iomp_shm_attach(const int* fds) {
+    errno = ENOSYS;
+    return NULL;
+}
+
+void iomp_shm_fds(iomp_shm_t shm, int* fds) {
+}
+
+void iomp_shm_drop(iomp_shm_t shm) {
+}
+
+void iomp_shm_read(iomp_t iomp, iomp_shm_t shm, iomp_aio_t aio) {
+    if (aio) {
+        iomp_complete(aio, ENOSYS);
+    }
+}
+
+void iomp_shm_write(iomp_t iomp, iomp_shm_t shm, iomp_aio_t aio) {
+    if (aio) {
+        iomp_complete(aio, ENOSYS);
+    }
+}
+
+#endif /* __linux__ */
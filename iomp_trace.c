@@ -0,0 +1,209 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/queue.h>
+#include "iomp_queue.h"
+#include "iomp.h"
+
+/* one per recording thread, only ever touched under its lock, which the
+ * owner takes per record and iomp_trace_close takes to flush it */
+struct iomp_tbuf {
+    LIST_ENTRY(iomp_tbuf) entries;
+    int lock;
+    uint16_t thread;
+    int nrecs;
+    struct iomp_trace_rec recs[IOMP_TRACE_BATCH];
+};
+
+static int g_trace_fd = -1;
+static uint64_t g_trace_base = 0;
+static uint16_t g_trace_threads = 0;
+static pthread_mutex_t g_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(, iomp_tbuf) g_trace_bufs =
+        LIST_HEAD_INITIALIZER(g_trace_bufs);
+static pthread_key_t g_trace_key;
+static pthread_once_t g_trace_once = PTHREAD_ONCE_INIT;
+
+static void trace_init(void);
+static void trace_add(iomp_aio_t aio, int op, uint64_t nbytes, int error);
+static struct iomp_tbuf* tbuf_get(void);
+static void tbuf_drop(void* arg);
+static void tbuf_flush(struct iomp_tbuf* b, int fd);
+static void tbuf_lock(struct iomp_tbuf* b);
+static void tbuf_unlock(struct iomp_tbuf* b);
+static uint64_t trace_now(void);
+
+int iomp_trace_open(const char* path) {
+    if (!path) {
+        return EINVAL;
+    }
+    pthread_once(&g_trace_once, trace_init);
+    pthread_mutex_lock(&g_trace_lock);
+    if (g_trace_fd != -1) {
+        pthread_mutex_unlock(&g_trace_lock);
+        return EBUSY;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd == -1) {
+        int error = errno;
+        IOMP_LOG(ERROR, "open %s fail: %s", path, strerror(error));
+        pthread_mutex_unlock(&g_trace_lock);
+        return error;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    struct iomp_trace_hdr hdr;
+    hdr.magic = IOMP_TRACE_MAGIC;
+    hdr.version = IOMP_TRACE_VERSION;
+    hdr.recsize = sizeof(struct iomp_trace_rec);
+    if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+        int error = errno;
+        IOMP_LOG(ERROR, "write %s fail: %s", path, strerror(error));
+        close(fd);
+        pthread_mutex_unlock(&g_trace_lock);
+        return error;
+    }
+    g_trace_base = trace_now();
+    __atomic_store_n(&g_trace_fd, fd, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&g_trace_lock);
+    return 0;
+}
+
+void iomp_trace_close(void) {
+    pthread_mutex_lock(&g_trace_lock);
+    int fd = g_trace_fd;
+    if (fd == -1) {
+        pthread_mutex_unlock(&g_trace_lock);
+        return;
+    }
+    /* recorders check the fd under their buffer lock, so once a buffer
+     * was flushed here nothing more lands in it for this trace */
+    __atomic_store_n(&g_trace_fd, -1, __ATOMIC_RELEASE);
+    struct iomp_tbuf* b = NULL;
+    LIST_FOREACH(b, &g_trace_bufs, entries) {
+        tbuf_lock(b);
+        tbuf_flush(b, fd);
+        tbuf_unlock(b);
+    }
+    close(fd);
+    pthread_mutex_unlock(&g_trace_lock);
+}
+
+void iomp_trace_submit(iomp_aio_t aio, int op) {
+    if (__atomic_load_n(&g_trace_fd, __ATOMIC_RELAXED) == -1) {
+        return;
+    }
+    trace_add(aio, op, aio->nbytes, 0);
+}
+
+void iomp_trace_complete(iomp_aio_t aio, int error) {
+    if (__atomic_load_n(&g_trace_fd, __ATOMIC_RELAXED) == -1) {
+        return;
+    }
+    trace_add(aio, IOMP_TRACE_COMPLETE, aio->offset, error);
+}
+
+void trace_init(void) {
+    int rv = pthread_key_create(&g_trace_key, tbuf_drop);
+    if (rv != 0) {
+        IOMP_LOG(ERROR, "pthread_key_create fail: %s", strerror(rv));
+    }
+}
+
+void trace_add(iomp_aio_t aio, int op, uint64_t nbytes, int error) {
+    uint64_t stamp = trace_now();
+    struct iomp_tbuf* b = tbuf_get();
+    if (!b) {
+        return;
+    }
+    tbuf_lock(b);
+    int fd = __atomic_load_n(&g_trace_fd, __ATOMIC_ACQUIRE);
+    if (fd != -1) {
+        struct iomp_trace_rec* rec = b->recs + b->nrecs++;
+        rec->stamp = stamp - g_trace_base;
+        rec->id = (uint64_t)(uintptr_t)aio;
+        rec->fildes = aio->fildes;
+        rec->nbytes = nbytes;
+        rec->op = op;
+        rec->thread = b->thread;
+        rec->error = error;
+        rec->reserved = 0;
+        if (b->nrecs == IOMP_TRACE_BATCH) {
+            tbuf_flush(b, fd);
+        }
+    }
+    tbuf_unlock(b);
+}
+
+struct iomp_tbuf* tbuf_get(void) {
+    struct iomp_tbuf* b = (struct iomp_tbuf*)pthread_getspecific(g_trace_key);
+    if (b) {
+        return b;
+    }
+    b = (struct iomp_tbuf*)malloc(sizeof(*b));
+    if (!b) {
+        IOMP_LOG(ERROR, "malloc fail: %s", strerror(errno));
+        return NULL;
+    }
+    b->lock = 0;
+    b->nrecs = 0;
+    int rv = pthread_setspecific(g_trace_key, b);
+    if (rv != 0) {
+        IOMP_LOG(ERROR, "pthread_setspecific fail: %s", strerror(rv));
+        free(b);
+        return NULL;
+    }
+    pthread_mutex_lock(&g_trace_lock);
+    b->thread = g_trace_threads++;
+    LIST_INSERT_HEAD(&g_trace_bufs, b, entries);
+    pthread_mutex_unlock(&g_trace_lock);
+    return b;
+}
+
+/* on thread exit */
+void tbuf_drop(void* arg) {
+    struct iomp_tbuf* b = (struct iomp_tbuf*)arg;
+    pthread_mutex_lock(&g_trace_lock);
+    LIST_REMOVE(b, entries);
+    if (g_trace_fd != -1) {
+        tbuf_flush(b, g_trace_fd);
+    }
+    pthread_mutex_unlock(&g_trace_lock);
+    free(b);
+}
+
+void tbuf_flush(struct iomp_tbuf* b, int fd) {
+    if (b->nrecs == 0) {
+        return;
+    }
+    /* O_APPEND keeps whole batches of different threads apart */
+    size_t len = sizeof(struct iomp_trace_rec) * b->nrecs;
+    ssize_t rv = write(fd, b->recs, len);
+    if (rv != (ssize_t)len) {
+        IOMP_LOG(WARNING, "trace write fail: %s",
+                rv == -1 ? strerror(errno) : "short write");
+    }
+    b->nrecs = 0;
+}
+
+void tbuf_lock(struct iomp_tbuf* b) {
+    /* only contended by a flush, which may sit in write for a while */
+    while (__atomic_exchange_n(&b->lock, 1, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+}
+
+void tbuf_unlock(struct iomp_tbuf* b) {
+    __atomic_store_n(&b->lock, 0, __ATOMIC_RELEASE);
+}
+
+uint64_t trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
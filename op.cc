@@ -0,0 +1,255 @@
+/* Drives iomp::Op: a ping pong against an echoing peer, each side an Op
+ * resubmitted from its own handler, must see every reply intact and
+ * allocate nothing on the way; the handler state must be reachable
+ * through handler(). Then an Op holding a move only handler is moved
+ * before it is submitted, and a read on a hung up socket must hand its
+ * handler an error.
+ * Exits non zero on any mismatch; needs a build without IOMP_LOOPBACK.
+ * usage: op [round trips] */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "iomp.h"
+
+static std::atomic<long> g_news(0);
+
+void* operator new(size_t size) {
+    g_news.fetch_add(1, std::memory_order_relaxed);
+    void* p = malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+static bool read_full(int fd, void* buf, size_t nbytes) {
+    char* p = static_cast<char*>(buf);
+    while (nbytes > 0) {
+        ssize_t n = ::read(fd, p, nbytes);
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        nbytes -= n;
+    }
+    return true;
+}
+
+class Pinger;
+
+struct Wrote {
+    Pinger* self;
+    long calls;
+    void operator()(int error);
+};
+
+struct Got {
+    Pinger* self;
+    void operator()(int error);
+};
+
+static_assert(!std::is_polymorphic<iomp::Op<Got>>::value,
+        "an Op completes without virtual dispatch");
+
+/* writes the round number, reads it back, and again */
+class Pinger {
+public:
+    Pinger(iomp::IOMultiPlexer& iomp, int fd, long n):
+            _iomp(iomp), _n(n), _round(0), _bad(0), _done(false),
+            _write(fd, &_out, sizeof(_out), Wrote{ this, 0 }),
+            _read(fd, &_in, sizeof(_in), Got{ this }) {}
+    void start() { this->ping(); }
+    bool done() const { return _done.load(std::memory_order_acquire); }
+    long rounds() const { return _round; }
+    long bad() const { return _bad; }
+    long writes() { return _write.handler().calls; }
+private:
+    friend struct Wrote;
+    friend struct Got;
+    void ping() {
+        _out = static_cast<uint64_t>(_round) * 0x9e3779b97f4a7c15ull;
+        _in = 0;
+        _iomp.write(_write);
+    }
+    void wrote(int error) {
+        if (error != 0) {
+            this->fail();
+            return;
+        }
+        _iomp.read(_read);
+    }
+    void got(int error) {
+        if (error != 0) {
+            this->fail();
+            return;
+        }
+        _bad += _in != _out;
+        if (++_round < _n) {
+            this->ping();
+        } else {
+            _done.store(true, std::memory_order_release);
+        }
+    }
+    void fail() {
+        _bad++;
+        _done.store(true, std::memory_order_release);
+    }
+private:
+    iomp::IOMultiPlexer& _iomp;
+    long _n;
+    long _round;
+    long _bad;
+    std::atomic<bool> _done;
+    uint64_t _out;
+    uint64_t _in;
+    iomp::Op<Wrote> _write;
+    iomp::Op<Got> _read;
+};
+
+void Wrote::operator()(int error) {
+    calls++;
+    self->wrote(error);
+}
+
+void Got::operator()(int error) {
+    self->got(error);
+}
+
+static void wait_for(const std::atomic<bool>& flag) {
+    for (int i = 0; i < 10000 && !flag.load(std::memory_order_acquire); i++) {
+        usleep(1000);
+    }
+}
+
+static int pingpong(iomp::IOMultiPlexer& iomp, long n) {
+    int sv[2];
+    if (socketpair(AF_LOCAL, SOCK_STREAM, 0, sv) != 0) {
+        perror("socketpair");
+        return 1;
+    }
+    fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+    std::thread echo([&] {
+        uint64_t v;
+        while (read_full(sv[1], &v, sizeof(v)) &&
+                ::write(sv[1], &v, sizeof(v)) == sizeof(v)) {
+        }
+    });
+    Pinger pinger(iomp, sv[0], n);
+    long news = g_news.load();
+    pinger.start();
+    for (int i = 0; i < 30000 && !pinger.done(); i++) {
+        usleep(1000);
+    }
+    news = g_news.load() - news;
+    int failed = !pinger.done() || pinger.rounds() != n || pinger.bad() ||
+            pinger.writes() != n || news != 0;
+    printf("ping pong: %ld of %ld round trips, %ld writes, %ld bad, "
+            "%ld allocations, %s\n", pinger.rounds(), n, pinger.writes(),
+            pinger.bad(), news, failed ? "FAIL" : "ok");
+    shutdown(sv[1], SHUT_RDWR);
+    echo.join();
+    iomp.forget(sv[0]);
+    close(sv[0]);
+    close(sv[1]);
+    return failed;
+}
+
+/* a move only handler, moved along with its Op while idle */
+struct Token {
+    std::atomic<bool>* done;
+    std::atomic<int>* seen;
+    std::unique_ptr<int> value;
+    void operator()(int error) {
+        *seen = error == 0 ? *value : -1;
+        *done = true;
+    }
+};
+
+static int moved(iomp::IOMultiPlexer& iomp) {
+    int sv[2];
+    if (socketpair(AF_LOCAL, SOCK_STREAM, 0, sv) != 0) {
+        perror("socketpair");
+        return 1;
+    }
+    fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+    std::atomic<bool> done(false);
+    std::atomic<int> seen(0);
+    char c = 'x';
+    auto first = iomp::make_op(sv[0], &c, 1, Token{ &done, &seen,
+            std::unique_ptr<int>(new int(42)) });
+    auto second = std::move(first);
+    iomp.write(second);
+    wait_for(done);
+    char got = 0;
+    int failed = seen != 42 || !read_full(sv[1], &got, 1) || got != 'x';
+    printf("moved: handler saw %d, %s\n", seen.load(), failed ? "FAIL" : "ok");
+    iomp.forget(sv[0]);
+    close(sv[0]);
+    close(sv[1]);
+    return failed;
+}
+
+static int hung_up(iomp::IOMultiPlexer& iomp) {
+    int sv[2];
+    if (socketpair(AF_LOCAL, SOCK_STREAM, 0, sv) != 0) {
+        perror("socketpair");
+        return 1;
+    }
+    fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+    std::atomic<bool> done(false);
+    std::atomic<int> error(0);
+    char buf[16];
+    auto op = iomp::make_op(sv[0], buf, sizeof(buf), [&](int e) {
+        error = e;
+        done = true;
+    });
+    iomp.read(op);
+    close(sv[1]);
+    wait_for(done);
+    int failed = !done || error == 0;
+    printf("hung up: error %d, %s\n", error.load(), failed ? "FAIL" : "ok");
+    iomp.forget(sv[0]);
+    close(sv[0]);
+    return failed;
+}
+
+int main(int argc, char* argv[]) {
+    long n = argc > 1 ? atol(argv[1]) : 100000;
+    if (n <= 0) {
+        fprintf(stderr, "usage: %s [round trips]\n", argv[0]);
+        return 2;
+    }
+    int probe[2];
+    if (iomp_loopback_pair(probe, 0) == 0) {
+        iomp_loopback_close(probe[0]);
+        iomp_loopback_close(probe[1]);
+        fprintf(stderr, "the ops need kernel sockets, "
+                "build without IOMP_LOOPBACK\n");
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    iomp::IOMultiPlexer iomp(2);
+    int failed = pingpong(iomp, n);
+    failed |= moved(iomp);
+    failed |= hung_up(iomp);
+    return failed;
+}
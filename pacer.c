@@ -0,0 +1,210 @@
+/* Checks that paced writes keep to their rate: one aio with its own
+ * pacer, then one pacer shared by writes on two sockets, then a paced
+ * iomp_try_write, which must be queued rather than go out at full speed,
+ * and the single aio again in polled mode. Past the first burst the
+ * bytes have to take total / rate seconds, give or take; the peers read
+ * as fast as they can.
+ * Exits non zero on any mismatch.
+ * usage: pacer [bytes per second] */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include "iomp.h"
+
+#define BURST       (16 * 1024)
+#define SOCKETS     2
+
+struct conn {
+    int fds[2];
+    pthread_t peer;
+    size_t nbytes;
+    struct iomp_aio aio;
+};
+
+static volatile int ndone = 0;
+static volatile int nfailed = 0;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void on_write(iomp_aio_t aio, int error) {
+    if (error != 0) {
+        __atomic_add_fetch(&nfailed, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&ndone, 1, __ATOMIC_RELEASE);
+}
+
+static void* drain(void* arg) {
+    struct conn* c = (struct conn*)arg;
+    char buf[65536];
+    size_t got = 0;
+    while (got < c->nbytes) {
+        ssize_t n = read(c->fds[1], buf, sizeof(buf));
+        if (n <= 0) {
+            break;
+        }
+        got += n;
+    }
+    return NULL;
+}
+
+static int conn_open(struct conn* c, const char* buf, size_t nbytes,
+        struct iomp_pacer* pacer) {
+    if (socketpair(AF_LOCAL, SOCK_STREAM, 0, c->fds) != 0) {
+        perror("socketpair");
+        return -1;
+    }
+    fcntl(c->fds[0], F_SETFL, fcntl(c->fds[0], F_GETFL) | O_NONBLOCK);
+    c->nbytes = nbytes;
+    memset(&c->aio, 0, sizeof(c->aio));
+    c->aio.fildes = c->fds[0];
+    c->aio.buf = (void*)buf;
+    c->aio.nbytes = nbytes;
+    c->aio.pacer = pacer;
+    c->aio.complete = on_write;
+    pthread_create(&c->peer, NULL, drain, c);
+    return 0;
+}
+
+static void conn_close(iomp_t iomp, struct conn* c) {
+    pthread_join(c->peer, NULL);
+    iomp_forget(iomp, c->fds[0]);
+    close(c->fds[0]);
+    close(c->fds[1]);
+}
+
+/* what the rate allows for total bytes past the first burst */
+static int check(const char* name, double took, size_t total, uint64_t rate) {
+    double want = (double)(total - BURST) / rate;
+    int bad = nfailed != 0 || took < want * 0.9 || took > want * 1.5 + 0.05;
+    printf("%s: %zu bytes in %.3f s, wanted %.3f s, %s\n", name, total,
+            took, want, bad ? "FAIL" : "ok");
+    return bad;
+}
+
+static void wait_done(iomp_t polled, int n) {
+    while (__atomic_load_n(&ndone, __ATOMIC_ACQUIRE) < n) {
+        if (polled) {
+            iomp_poll(polled, 10);
+        } else {
+            usleep(1000);
+        }
+    }
+}
+
+/* one aio, one pacer, on workers or on the caller's thread */
+static int single(iomp_t iomp, int polled, const char* buf, size_t nbytes,
+        uint64_t rate) {
+    struct iomp_pacer pacer;
+    iomp_pacer_init(&pacer, rate, BURST, 0);
+    struct conn c;
+    ndone = 0;
+    nfailed = 0;
+    if (conn_open(&c, buf, nbytes, &pacer) != 0) {
+        return 1;
+    }
+    double t0 = now();
+    iomp_write(iomp, &c.aio);
+    wait_done(polled ? iomp : NULL, 1);
+    int bad = check(polled ? "polled" : "single", now() - t0, nbytes, rate);
+    conn_close(iomp, &c);
+    return bad;
+}
+
+/* one pacer over SOCKETS sockets, the rate is their sum */
+static int group(iomp_t iomp, const char* buf, size_t nbytes, uint64_t rate) {
+    struct iomp_pacer pacer;
+    iomp_pacer_init(&pacer, rate, BURST, 0);
+    struct conn cs[SOCKETS];
+    ndone = 0;
+    nfailed = 0;
+    for (int i = 0; i < SOCKETS; i++) {
+        if (conn_open(cs + i, buf, nbytes / SOCKETS, &pacer) != 0) {
+            return 1;
+        }
+    }
+    double t0 = now();
+    for (int i = 0; i < SOCKETS; i++) {
+        iomp_write(iomp, &cs[i].aio);
+    }
+    wait_done(NULL, SOCKETS);
+    int bad = check("group", now() - t0, nbytes / SOCKETS * SOCKETS, rate);
+    for (int i = 0; i < SOCKETS; i++) {
+        conn_close(iomp, cs + i);
+    }
+    return bad;
+}
+
+/* a paced write tried inline has to be queued all the same */
+static int tried(iomp_t iomp, const char* buf, size_t nbytes, uint64_t rate) {
+    struct iomp_pacer pacer;
+    iomp_pacer_init(&pacer, rate, BURST, 0);
+    struct conn c;
+    ndone = 0;
+    nfailed = 0;
+    if (conn_open(&c, buf, nbytes, &pacer) != 0) {
+        return 1;
+    }
+    double t0 = now();
+    int error = iomp_try_write(iomp, &c.aio);
+    if (error == EINPROGRESS) {
+        wait_done(NULL, 1);
+    }
+    int bad = check("try_write", now() - t0, nbytes, rate);
+    if (error != EINPROGRESS) {
+        printf("try_write: returned %d, wanted EINPROGRESS, FAIL\n", error);
+        bad = 1;
+    }
+    conn_close(iomp, &c);
+    return bad;
+}
+
+int main(int argc, char* argv[]) {
+    uint64_t rate = argc > 1 ? strtoull(argv[1], NULL, 10) : 4 << 20;
+    if (rate < 1024 * 1024) {
+        fprintf(stderr, "usage: %s [bytes per second, at least 1M]\n",
+                argv[0]);
+        return 2;
+    }
+    int probe[2];
+    if (iomp_loopback_pair(probe, 0) == 0) {
+        iomp_loopback_close(probe[0]);
+        iomp_loopback_close(probe[1]);
+        fprintf(stderr, "the writes need kernel sockets, "
+                "build without IOMP_LOOPBACK\n");
+        return 1;
+    }
+    /* a quarter of a second worth past the burst, every time */
+    size_t nbytes = rate / 4 + BURST;
+    char* buf = (char*)calloc(1, nbytes);
+    if (!buf) {
+        perror("calloc");
+        return 1;
+    }
+    iomp_t iomp = iomp_new(2);
+    if (!iomp) {
+        return 1;
+    }
+    int failed = single(iomp, 0, buf, nbytes, rate);
+    failed |= group(iomp, buf, nbytes, rate);
+    failed |= tried(iomp, buf, nbytes, rate);
+    iomp_drop(iomp);
+    iomp = iomp_new_polled();
+    if (!iomp) {
+        return 1;
+    }
+    failed |= single(iomp, 1, buf, nbytes, rate);
+    iomp_drop(iomp);
+    free(buf);
+    return failed;
+}
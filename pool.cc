@@ -0,0 +1,245 @@
+/* Drives a ConnectionPool against a local listener: min_idle connections
+ * must be dialed ahead, idle ones handed out newest first, ones the
+ * server hung up on never handed out, idle ones past max_idle closed on
+ * release and those unused for idle_ms closed from the timer; acquire
+ * on an empty destination dials. Then several threads take and give back
+ * connections as fast as they can, no fd may be out twice at once.
+ * Exits non zero on any mismatch; needs a build without IOMP_LOOPBACK.
+ * usage: pool [rounds per thread] */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <future>
+#include <chrono>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "iomp.h"
+
+static const int g_threads = 4;
+
+/* accepts on 127.0.0.1 until closed, keeps what it accepted */
+class Server {
+public:
+    Server(): _fd(::socket(AF_INET, SOCK_STREAM, 0)) {
+        std::memset(&_addr, 0, sizeof(_addr));
+        _addr.sin_family = AF_INET;
+        _addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(_addr);
+        if (_fd == -1 || ::bind(_fd, addr(), len) != 0 ||
+                ::listen(_fd, 128) != 0 ||
+                ::getsockname(_fd, reinterpret_cast<sockaddr*>(&_addr),
+                        &len) != 0) {
+            perror("listen");
+            exit(1);
+        }
+        _thread = std::thread([this] {
+            int fd;
+            while ((fd = ::accept(_fd, nullptr, nullptr)) != -1) {
+                std::lock_guard<std::mutex> lock(_lock);
+                _accepted.push_back(fd);
+            }
+        });
+    }
+    ~Server() {
+        ::shutdown(_fd, SHUT_RDWR);
+        _thread.join();
+        ::close(_fd);
+        this->hang_up();
+    }
+    const sockaddr* addr() const {
+        return reinterpret_cast<const sockaddr*>(&_addr);
+    }
+    socklen_t addrlen() const { return sizeof(_addr); }
+    size_t accepted() {
+        std::lock_guard<std::mutex> lock(_lock);
+        return _accepted.size();
+    }
+    void hang_up() {
+        std::lock_guard<std::mutex> lock(_lock);
+        for (int fd : _accepted) {
+            ::close(fd);
+        }
+        _accepted.clear();
+    }
+private:
+    int _fd;
+    sockaddr_in _addr;
+    std::thread _thread;
+    std::mutex _lock;
+    std::vector<int> _accepted;
+};
+
+/* waits up to a second for what() to hold */
+template <typename Pred>
+static bool eventually(Pred what) {
+    for (int i = 0; i < 1000; i++) {
+        if (what()) {
+            return true;
+        }
+        usleep(1000);
+    }
+    return what();
+}
+
+static int report(const char* name, bool ok, const char* detail = "") {
+    printf("%s: %s%s\n", name, detail, ok ? "ok" : "FAIL");
+    return !ok;
+}
+
+static int warmed(iomp::IOMultiPlexer& iomp, Server& server) {
+    iomp::ConnectionPool pool(iomp, 2, 4, 0);
+    auto& dest = pool.get(server.addr(), server.addrlen());
+    bool ok = eventually([&] { return dest.idle() == 2; }) &&
+            eventually([&] { return server.accepted() >= 2; });
+    return report("warm", ok);
+}
+
+/* newest first, and nothing past max_idle */
+static int lifo(iomp::IOMultiPlexer& iomp, Server& server) {
+    iomp::ConnectionPool pool(iomp, 3, 3, 0);
+    auto& dest = pool.get(server.addr(), server.addrlen());
+    bool ok = eventually([&] { return dest.idle() == 3; });
+    int a = dest.try_acquire();
+    int b = dest.try_acquire();
+    int c = dest.try_acquire();
+    ok = ok && a != -1 && b != -1 && c != -1 && dest.try_acquire() == -1;
+    dest.release(a);
+    dest.release(c);
+    dest.release(b);
+    ok = ok && dest.try_acquire() == b && dest.try_acquire() == c &&
+            dest.try_acquire() == a;
+    /* empty, acquire dials, and warms the stack back up to min_idle */
+    std::promise<int> dialed;
+    dest.acquire([&dialed](int error, int fd) {
+        dialed.set_value(error == 0 ? fd : -1);
+    });
+    int d = dialed.get_future().get();
+    ok = ok && d != -1 && eventually([&] { return dest.idle() == 3; });
+    /* no room left for these */
+    for (int fd : { a, b, c, d }) {
+        if (fd != -1) {
+            dest.release(fd);
+        }
+    }
+    ok = ok && dest.idle() == 3;
+    return report("newest first", ok);
+}
+
+/* the server goes away, nothing stale is handed out */
+static int hung_up(iomp::IOMultiPlexer& iomp, Server& server) {
+    iomp::ConnectionPool pool(iomp, 4, 4, 0);
+    auto& dest = pool.get(server.addr(), server.addrlen());
+    bool ok = eventually([&] { return dest.idle() == 4 &&
+            server.accepted() >= 4; });
+    server.hang_up();
+    usleep(20000);
+    int fd = dest.try_acquire();
+    ok = ok && fd == -1 && dest.idle() == 0;
+    if (fd != -1) {
+        dest.release(fd, false);
+    }
+    return report("hung up", ok);
+}
+
+/* unused past idle_ms, all but min_idle go */
+static int evicted(iomp::IOMultiPlexer& iomp, Server& server) {
+    iomp::ConnectionPool pool(iomp, 1, 8, 100);
+    auto& dest = pool.get(server.addr(), server.addrlen());
+    std::vector<int> fds;
+    for (int i = 0; i < 4; i++) {
+        std::promise<int> dialed;
+        dest.acquire([&dialed](int error, int fd) {
+            dialed.set_value(error == 0 ? fd : -1);
+        });
+        fds.push_back(dialed.get_future().get());
+    }
+    bool ok = true;
+    for (int fd : fds) {
+        ok = ok && fd != -1;
+        if (fd != -1) {
+            dest.release(fd);
+        }
+    }
+    size_t before = dest.idle();
+    ok = ok && before >= 4;
+    usleep(400000);
+    char detail[64];
+    snprintf(detail, sizeof(detail), "%zu idle, %zu left, ", before,
+            dest.idle());
+    ok = ok && dest.idle() == 1;
+    return report("idle eviction", ok, detail);
+}
+
+/* no fd out twice, none lost, while the stacks are hammered */
+static int hammered(iomp::IOMultiPlexer& iomp, Server& server, int rounds) {
+    const int nconns = 6;
+    iomp::ConnectionPool pool(iomp, nconns, nconns, 0);
+    auto& dest = pool.get(server.addr(), server.addrlen());
+    if (!eventually([&] { return dest.idle() == nconns; })) {
+        return report("hammered", false);
+    }
+    std::vector<std::atomic<int>> out(65536);
+    std::atomic<int> twice(0);
+    std::atomic<long> taken(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < g_threads; t++) {
+        threads.emplace_back([&] {
+            for (int i = 0; i < rounds; i++) {
+                int fd = dest.try_acquire();
+                if (fd == -1) {
+                    continue;
+                }
+                taken++;
+                if (fd >= 65536 || out[fd].exchange(1) != 0) {
+                    twice++;
+                    continue;
+                }
+                /* held a moment, so another taker has a chance to collide */
+                std::this_thread::yield();
+                out[fd].store(0);
+                dest.release(fd);
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    char detail[64];
+    snprintf(detail, sizeof(detail), "%ld taken, %d twice, %zu idle, ",
+            taken.load(), twice.load(), dest.idle());
+    return report("hammered", twice == 0 && taken > 0 &&
+            dest.idle() == nconns, detail);
+}
+
+int main(int argc, char* argv[]) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 100000;
+    if (rounds <= 0) {
+        fprintf(stderr, "usage: %s [rounds per thread]\n", argv[0]);
+        return 2;
+    }
+    int probe[2];
+    if (iomp_loopback_pair(probe, 0) == 0) {
+        iomp_loopback_close(probe[0]);
+        iomp_loopback_close(probe[1]);
+        fprintf(stderr, "a pool needs kernel sockets, "
+                "build without IOMP_LOOPBACK\n");
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    iomp::IOMultiPlexer iomp(2);
+    Server server;
+    int failed = warmed(iomp, server);
+    failed |= lifo(iomp, server);
+    failed |= hung_up(iomp, server);
+    failed |= evicted(iomp, server);
+    failed |= hammered(iomp, server, rounds);
+    return failed;
+}
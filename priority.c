@@ -0,0 +1,237 @@
+/* Checks the order a worker picks jobs in, for reads bound to an fd as
+ * well as for tasks: the one worker is held up by a task while a batch of
+ * low priority reads is queued, then a task, which runs at normal
+ * priority, and a high priority read; once it is let go the high read
+ * must complete first, then the task, then the low ones. With an
+ * admission limit of as many reads, one more normal read must fail with
+ * EBUSY at once while a high one still gets in. Then again with weights
+ * 1/0/1, where high and low reads must take turns. Every read finds its
+ * byte already there.
+ * Exits non zero on any mismatch.
+ * usage: priority [reads] */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "iomp.h"
+
+#define TAG_LOW     'l'
+#define TAG_NORMAL  'n'
+#define TAG_HIGH    'h'
+#define TAG_BUSY    'b'
+
+struct hold {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int running;
+    int released;
+};
+
+struct reader {
+    struct iomp_aio aio;
+    char byte;
+    char tag;
+    int fds[2];
+};
+
+static char* order = NULL;
+static int norder = 0;
+static volatile int ndone = 0;
+
+static void record(char tag) {
+    /* one worker, completions never overlap */
+    order[norder++] = tag;
+    __atomic_add_fetch(&ndone, 1, __ATOMIC_RELEASE);
+}
+
+static void on_read(iomp_aio_t aio, int error) {
+    struct reader* r = (struct reader*)aio;
+    record(error == 0 ? r->tag : error == EBUSY ? TAG_BUSY : '!');
+}
+
+static void on_task(void* arg, int error) {
+    record(error == 0 ? TAG_NORMAL : '!');
+}
+
+static void on_hold(void* arg, int error) {
+    struct hold* h = (struct hold*)arg;
+    pthread_mutex_lock(&h->lock);
+    h->running = 1;
+    pthread_cond_broadcast(&h->cond);
+    while (!h->released) {
+        pthread_cond_wait(&h->cond, &h->lock);
+    }
+    pthread_mutex_unlock(&h->lock);
+}
+
+static void hold_worker(iomp_t iomp, struct hold* h) {
+    h->running = 0;
+    h->released = 0;
+    iomp_post(iomp, on_hold, h);
+    pthread_mutex_lock(&h->lock);
+    while (!h->running) {
+        pthread_cond_wait(&h->cond, &h->lock);
+    }
+    pthread_mutex_unlock(&h->lock);
+}
+
+static void release_worker(struct hold* h) {
+    pthread_mutex_lock(&h->lock);
+    h->released = 1;
+    pthread_cond_broadcast(&h->cond);
+    pthread_mutex_unlock(&h->lock);
+}
+
+static int reader_init(struct reader* r, char tag, int priority) {
+    if (socketpair(AF_LOCAL, SOCK_STREAM, 0, r->fds) != 0) {
+        perror("socketpair");
+        return -1;
+    }
+    if (write(r->fds[1], "x", 1) != 1) {
+        perror("write");
+        return -1;
+    }
+    memset(&r->aio, 0, sizeof(r->aio));
+    r->aio.fildes = r->fds[0];
+    r->aio.buf = &r->byte;
+    r->aio.nbytes = 1;
+    r->aio.priority = priority;
+    r->aio.complete = on_read;
+    r->tag = tag;
+    return 0;
+}
+
+static void wait_done(int n) {
+    while (__atomic_load_n(&ndone, __ATOMIC_ACQUIRE) < n) {
+        usleep(1000);
+    }
+}
+
+/* n low reads, then a task and a high read, in priority order */
+static int strict(iomp_t iomp, struct reader* rs, int n, struct hold* h) {
+    norder = 0;
+    ndone = 0;
+    hold_worker(iomp, h);
+    for (int i = 0; i < n; i++) {
+        if (reader_init(rs + i, TAG_LOW, IOMP_PRIORITY_LOW) != 0) {
+            return 1;
+        }
+        iomp_read(iomp, &rs[i].aio);
+    }
+    iomp_post(iomp, on_task, NULL);
+    if (reader_init(rs + n, TAG_HIGH, IOMP_PRIORITY_HIGH) != 0) {
+        return 1;
+    }
+    iomp_read(iomp, &rs[n].aio);
+    release_worker(h);
+    wait_done(n + 2);
+    int bad = order[0] != TAG_HIGH || order[1] != TAG_NORMAL;
+    for (int i = 2; i < n + 2; i++) {
+        bad |= order[i] != TAG_LOW;
+    }
+    printf("strict: %.*s... %s\n", 8, order, bad ? "FAIL" : "ok");
+    return bad;
+}
+
+/* n low reads fill a limit of n, the next normal one is turned away
+ * before the worker is let go, a high one is not */
+static int admission(iomp_t iomp, struct reader* rs, int n, struct hold* h) {
+    norder = 0;
+    ndone = 0;
+    iomp_set_limit(iomp, n);
+    hold_worker(iomp, h);
+    for (int i = 0; i < n + 2; i++) {
+        char tag = (i < n ? TAG_LOW : i == n ? TAG_NORMAL : TAG_HIGH);
+        int priority = (i < n ? IOMP_PRIORITY_LOW : i == n ?
+                IOMP_PRIORITY_NORMAL : IOMP_PRIORITY_HIGH);
+        if (reader_init(rs + i, tag, priority) != 0) {
+            return 1;
+        }
+        iomp_read(iomp, &rs[i].aio);
+    }
+    release_worker(h);
+    wait_done(n + 2);
+    iomp_set_limit(iomp, 0);
+    int bad = order[0] != TAG_BUSY || order[1] != TAG_HIGH;
+    for (int i = 2; i < n + 2; i++) {
+        bad |= order[i] != TAG_LOW;
+    }
+    printf("admission: %.*s... %s\n", 8, order, bad ? "FAIL" : "ok");
+    return bad;
+}
+
+/* n low reads then n high reads with weights 1/0/1, taking turns */
+static int weighted(iomp_t iomp, struct reader* rs, int n, struct hold* h) {
+    norder = 0;
+    ndone = 0;
+    iomp_set_weights(iomp, 1, 0, 1);
+    hold_worker(iomp, h);
+    for (int i = 0; i < 2 * n; i++) {
+        int low = i < n;
+        if (reader_init(rs + i, low ? TAG_LOW : TAG_HIGH,
+                low ? IOMP_PRIORITY_LOW : IOMP_PRIORITY_HIGH) != 0) {
+            return 1;
+        }
+        iomp_read(iomp, &rs[i].aio);
+    }
+    release_worker(h);
+    wait_done(2 * n);
+    int bad = 0;
+    for (int i = 0; i < 2 * n; i++) {
+        bad |= order[i] != (i % 2 == 0 ? TAG_HIGH : TAG_LOW);
+    }
+    printf("weighted: %.*s... %s\n", 8, order, bad ? "FAIL" : "ok");
+    return bad;
+}
+
+static void readers_close(iomp_t iomp, struct reader* rs, int n) {
+    for (int i = 0; i < n; i++) {
+        iomp_forget(iomp, rs[i].fds[0]);
+        close(rs[i].fds[0]);
+        close(rs[i].fds[1]);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    int n = argc > 1 ? atoi(argv[1]) : 64;
+    if (n < 4) {
+        fprintf(stderr, "usage: %s [reads, at least 4]\n", argv[0]);
+        return 2;
+    }
+    int probe[2];
+    if (iomp_loopback_pair(probe, 0) == 0) {
+        iomp_loopback_close(probe[0]);
+        iomp_loopback_close(probe[1]);
+        fprintf(stderr, "the reads need kernel sockets, "
+                "build without IOMP_LOOPBACK\n");
+        return 1;
+    }
+    struct reader* rs = (struct reader*)calloc(2 * n, sizeof(*rs));
+    order = (char*)malloc(2 * n + 2);
+    if (!rs || !order) {
+        perror("malloc");
+        return 1;
+    }
+    struct hold h;
+    pthread_mutex_init(&h.lock, NULL);
+    pthread_cond_init(&h.cond, NULL);
+    iomp_t iomp = iomp_new(1);
+    if (!iomp) {
+        return 1;
+    }
+    int failed = strict(iomp, rs, n, &h);
+    readers_close(iomp, rs, n + 1);
+    failed |= admission(iomp, rs, n, &h);
+    readers_close(iomp, rs, n + 2);
+    failed |= weighted(iomp, rs, n, &h);
+    readers_close(iomp, rs, 2 * n);
+    iomp_drop(iomp);
+    pthread_cond_destroy(&h.cond);
+    pthread_mutex_destroy(&h.lock);
+    free(order);
+    free(rs);
+    return failed;
+}
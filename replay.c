@@ -0,0 +1,560 @@
+/* Plays back a capture from iomp_trace_open: each traced fd becomes a
+ * local socket pair (a loopback TCP connection with -l), its reads and
+ * writes are submitted at their traced offsets, and what a read consumed
+ * is written from the other end when the traced read completed; a read
+ * due while the one before it on that fd is still pending waits for it,
+ * its latency still counting from when it was due. Prints
+ * traced against replayed latencies, the replay itself can be traced
+ * again with -o. File I/O and accepts are not replayed, nor are aios
+ * that failed in the trace. Threads 0 runs polled on this thread.
+ * usage: replay [-t threads] [-l] [-s speed] [-o trace] trace */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sched.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "iomp.h"
+
+#define REPLAY_GRACE_NS (2 * 1000000000ull)
+
+#define IOMP_CONTAINER_OF(ptr, type, member) \
+    ((type*)((char*)(ptr) - offsetof(type, member)))
+
+struct op {
+    /* traced, ns from the start of the trace */
+    uint64_t at;
+    uint64_t done;
+    /* replayed */
+    uint64_t start;
+    uint64_t lat;
+    int error;
+    int kind;
+    int conn;
+    int skip;
+    size_t nbytes;
+    struct iomp_aio aio;
+    struct iomp_aio feed;
+    struct op* next;
+};
+
+/* one read may be pending per fd, later ones wait in line */
+struct conn {
+    int fd[2];
+    struct iomp_aio sink;
+    int lock;
+    int reading;
+    struct op* head;
+    struct op* tail;
+};
+
+struct event {
+    uint64_t at;
+    int op;
+    int feed;
+};
+
+struct slot {
+    uint64_t id;
+    int op;
+    int used;
+};
+
+static iomp_t g_iomp = NULL;
+static struct conn* g_conns = NULL;
+static char* g_buf = NULL;
+static long g_done = 0;
+static long g_failed = 0;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* 0 once the peer is gone */
+static int drain(int fd) {
+    char buf[16384];
+    while (1) {
+        ssize_t len = read(fd, buf, sizeof(buf));
+        if (len > 0) {
+            continue;
+        }
+        return len == -1 && errno == EAGAIN;
+    }
+}
+
+static void conn_lock(struct conn* c) {
+    while (__atomic_exchange_n(&c->lock, 1, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+}
+
+static void conn_unlock(struct conn* c) {
+    __atomic_store_n(&c->lock, 0, __ATOMIC_RELEASE);
+}
+
+static void read_next(struct conn* c, struct op* op) {
+    conn_lock(c);
+    if (op && c->reading) {
+        op->next = NULL;
+        if (c->tail) {
+            c->tail->next = op;
+        } else {
+            c->head = op;
+        }
+        c->tail = op;
+        op = NULL;
+    } else {
+        if (!op && c->head) {
+            op = c->head;
+            c->head = op->next;
+            c->tail = c->head ? c->tail : NULL;
+        }
+        c->reading = (op != NULL);
+    }
+    conn_unlock(c);
+    if (op) {
+        iomp_read(g_iomp, &op->aio);
+    }
+}
+
+static void on_done(iomp_aio_t aio, int error) {
+    struct op* op = IOMP_CONTAINER_OF(aio, struct op, aio);
+    op->lat = now_ns() - op->start;
+    op->error = error;
+    if (error == 0 && op->kind == IOMP_TRACE_READ && op->nbytes == 0) {
+        drain(aio->fildes);
+    }
+    if (error != 0) {
+        __atomic_add_fetch(&g_failed, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&g_done, 1, __ATOMIC_RELEASE);
+    if (op->kind == IOMP_TRACE_READ && error != -1) {
+        read_next(g_conns + op->conn, NULL);
+    }
+}
+
+static void on_feed(iomp_aio_t aio, int error) {
+    if (error != 0 && error != -1) {
+        fprintf(stderr, "feed fd %d: %s\n", aio->fildes, strerror(error));
+    }
+}
+
+static void on_sink(iomp_aio_t aio, int error) {
+    if (error == 0 && drain(aio->fildes)) {
+        iomp_read(g_iomp, aio);
+    }
+}
+
+static int cmp_rec(const void* a, const void* b) {
+    const struct iomp_trace_rec* x = (const struct iomp_trace_rec*)a;
+    const struct iomp_trace_rec* y = (const struct iomp_trace_rec*)b;
+    if (x->stamp != y->stamp) {
+        return x->stamp < y->stamp ? -1 : 1;
+    }
+    /* a completion never comes before its submission */
+    return (x->op == IOMP_TRACE_COMPLETE) - (y->op == IOMP_TRACE_COMPLETE);
+}
+
+static int cmp_event(const void* a, const void* b) {
+    const struct event* x = (const struct event*)a;
+    const struct event* y = (const struct event*)b;
+    if (x->at != y->at) {
+        return x->at < y->at ? -1 : 1;
+    }
+    return x->feed - y->feed;
+}
+
+static int cmp_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static struct iomp_trace_rec* load(const char* path, size_t* nrecs) {
+    FILE* fp = fopen(path, "rb");
+    if (!fp) {
+        fprintf(stderr, "open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    struct iomp_trace_hdr hdr;
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+            hdr.magic != IOMP_TRACE_MAGIC) {
+        fprintf(stderr, "%s: not an iomp trace\n", path);
+        fclose(fp);
+        return NULL;
+    }
+    if (hdr.version != IOMP_TRACE_VERSION ||
+            hdr.recsize != sizeof(struct iomp_trace_rec)) {
+        fprintf(stderr, "%s: trace version %u, replay reads version %u\n",
+                path, hdr.version, IOMP_TRACE_VERSION);
+        fclose(fp);
+        return NULL;
+    }
+    size_t n = 0;
+    size_t max = 4096;
+    struct iomp_trace_rec* recs = NULL;
+    while (1) {
+        struct iomp_trace_rec* p = (struct iomp_trace_rec*)realloc(recs,
+                sizeof(*recs) * max);
+        if (!p) {
+            fprintf(stderr, "realloc: %s\n", strerror(errno));
+            free(recs);
+            fclose(fp);
+            return NULL;
+        }
+        recs = p;
+        n += fread(recs + n, sizeof(*recs), max - n, fp);
+        if (n < max) {
+            break;
+        }
+        max *= 2;
+    }
+    fclose(fp);
+    qsort(recs, n, sizeof(*recs), cmp_rec);
+    *nrecs = n;
+    return recs;
+}
+
+/* last submission per aio address, open addressing */
+static struct slot* slot_get(struct slot* slots, size_t mask, uint64_t id) {
+    size_t i = (size_t)((id >> 4) * 0x9e3779b97f4a7c15ull) & mask;
+    while (slots[i].used && slots[i].id != id) {
+        i = (i + 1) & mask;
+    }
+    return slots + i;
+}
+
+static int nonblock(int fd) {
+    return fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+static int tcp_pair(int lfd, const struct sockaddr_in* addr, int* fds) {
+    int one = 1;
+    fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+    if (fds[0] == -1) {
+        return -1;
+    }
+    if (connect(fds[0], (const struct sockaddr*)addr, sizeof(*addr)) == -1) {
+        close(fds[0]);
+        return -1;
+    }
+    fds[1] = accept(lfd, NULL, NULL);
+    if (fds[1] == -1) {
+        close(fds[0]);
+        return -1;
+    }
+    setsockopt(fds[0], IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(fds[1], IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return 0;
+}
+
+static int open_conns(struct conn* conns, int nconns, int tcp) {
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    if (rl.rlim_cur < (rlim_t)(2 * nconns + 64)) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        getrlimit(RLIMIT_NOFILE, &rl);
+        if (rl.rlim_cur < (rlim_t)(2 * nconns + 64)) {
+            fprintf(stderr, "%d connections need more than %ld fds\n",
+                    nconns, (long)rl.rlim_cur);
+            return -1;
+        }
+    }
+    int lfd = -1;
+    struct sockaddr_in addr;
+    if (tcp) {
+        socklen_t addrlen = sizeof(addr);
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        lfd = socket(AF_INET, SOCK_STREAM, 0);
+        if (lfd == -1 || bind(lfd, (struct sockaddr*)&addr, addrlen) == -1 ||
+                listen(lfd, 128) == -1 ||
+                getsockname(lfd, (struct sockaddr*)&addr, &addrlen) == -1) {
+            fprintf(stderr, "listen: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+    for (int i = 0; i < nconns; i++) {
+        struct conn* c = conns + i;
+        int rv = tcp ? tcp_pair(lfd, &addr, c->fd) :
+                socketpair(AF_LOCAL, SOCK_STREAM, 0, c->fd);
+        if (rv == -1) {
+            fprintf(stderr, "connection %d: %s\n", i, strerror(errno));
+            return -1;
+        }
+        nonblock(c->fd[0]);
+        nonblock(c->fd[1]);
+    }
+    if (lfd != -1) {
+        close(lfd);
+    }
+    return 0;
+}
+
+static void wait_until(uint64_t target, int polled) {
+    while (1) {
+        uint64_t now = now_ns();
+        if (now >= target) {
+            return;
+        }
+        if (polled) {
+            iomp_poll(g_iomp, (int)((target - now) / 1000000));
+        } else {
+            struct timespec ts;
+            ts.tv_sec = (target - now) / 1000000000;
+            ts.tv_nsec = (target - now) % 1000000000;
+            nanosleep(&ts, NULL);
+        }
+    }
+}
+
+static void report(const char* name, struct op* ops, size_t nops, int kind) {
+    uint64_t* traced = (uint64_t*)malloc(sizeof(uint64_t) * (nops + 1));
+    uint64_t* replayed = (uint64_t*)malloc(sizeof(uint64_t) * (nops + 1));
+    size_t n = 0;
+    size_t m = 0;
+    for (size_t i = 0; traced && replayed && i < nops; i++) {
+        if (ops[i].skip || ops[i].kind != kind) {
+            continue;
+        }
+        traced[n++] = ops[i].done - ops[i].at;
+        if (ops[i].lat > 0 && ops[i].error == 0) {
+            replayed[m++] = ops[i].lat;
+        }
+    }
+    if (n > 0) {
+        qsort(traced, n, sizeof(uint64_t), cmp_u64);
+        qsort(replayed, m, sizeof(uint64_t), cmp_u64);
+        printf("%-6s %8zu %9.1f %9.1f %9.1f", name, n,
+                traced[n / 2] / 1e3, traced[n * 99 / 100] / 1e3,
+                traced[n - 1] / 1e3);
+        if (m > 0) {
+            printf(" | %8zu %9.1f %9.1f %9.1f\n", m,
+                    replayed[m / 2] / 1e3, replayed[m * 99 / 100] / 1e3,
+                    replayed[m - 1] / 1e3);
+        } else {
+            printf(" | %8d\n", 0);
+        }
+    }
+    free(traced);
+    free(replayed);
+}
+
+int main(int argc, char* argv[]) {
+    int nthreads = 4;
+    int tcp = 0;
+    double speed = 1;
+    const char* out = NULL;
+    int c = 0;
+    while ((c = getopt(argc, argv, "t:ls:o:")) != -1) {
+        switch (c) {
+        case 't': nthreads = atoi(optarg); break;
+        case 'l': tcp = 1; break;
+        case 's': speed = atof(optarg); break;
+        case 'o': out = optarg; break;
+        default: optind = argc + 1; break;
+        }
+    }
+    if (optind != argc - 1 || nthreads < 0 || speed <= 0) {
+        fprintf(stderr, "usage: %s [-t threads, 0 polled] [-l] "
+                "[-s speed] [-o trace] trace\n", argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    size_t nrecs = 0;
+    struct iomp_trace_rec* recs = load(argv[optind], &nrecs);
+    if (!recs) {
+        return 1;
+    }
+    /* pair completions with submissions, give each fd a connection */
+    size_t mask = 1;
+    while (mask < 2 * nrecs) {
+        mask = mask * 2 + 1;
+    }
+    struct slot* slots = (struct slot*)calloc(mask + 1, sizeof(*slots));
+    struct op* ops = (struct op*)calloc(nrecs + 1, sizeof(*ops));
+    int* fdmap = NULL;
+    int nfdmap = 0;
+    int nconns = 0;
+    size_t nops = 0;
+    size_t skipped = 0;
+    size_t maxbytes = 1;
+    if (!slots || !ops) {
+        fprintf(stderr, "calloc: %s\n", strerror(errno));
+        return 1;
+    }
+    for (size_t i = 0; i < nrecs; i++) {
+        const struct iomp_trace_rec* rec = recs + i;
+        struct slot* s = slot_get(slots, mask, rec->id);
+        if (rec->op == IOMP_TRACE_COMPLETE) {
+            if (s->used && s->op >= 0) {
+                struct op* op = ops + s->op;
+                op->done = rec->stamp;
+                op->skip = (rec->error != 0);
+                s->op = -1;
+            }
+            continue;
+        }
+        s->used = 1;
+        s->id = rec->id;
+        s->op = -1;
+        if ((rec->op != IOMP_TRACE_READ && rec->op != IOMP_TRACE_WRITE) ||
+                rec->fildes < 0) {
+            skipped++;
+            continue;
+        }
+        if (rec->fildes >= nfdmap) {
+            int n = nfdmap > 0 ? nfdmap : 64;
+            while (n <= rec->fildes) {
+                n *= 2;
+            }
+            int* p = (int*)realloc(fdmap, sizeof(int) * n);
+            if (!p) {
+                fprintf(stderr, "realloc: %s\n", strerror(errno));
+                return 1;
+            }
+            for (int j = nfdmap; j < n; j++) {
+                p[j] = -1;
+            }
+            fdmap = p;
+            nfdmap = n;
+        }
+        if (fdmap[rec->fildes] == -1) {
+            fdmap[rec->fildes] = nconns++;
+        }
+        struct op* op = ops + nops;
+        op->at = rec->stamp;
+        op->kind = rec->op;
+        op->conn = fdmap[rec->fildes];
+        op->nbytes = rec->nbytes;
+        op->skip = 1;
+        if (op->nbytes > maxbytes) {
+            maxbytes = op->nbytes;
+        }
+        s->op = nops++;
+    }
+    uint64_t span = nrecs > 0 ? recs[nrecs - 1].stamp : 0;
+    free(recs);
+    free(slots);
+    free(fdmap);
+    struct event* events = (struct event*)malloc(
+            sizeof(*events) * (2 * nops + 1));
+    struct conn* conns = (struct conn*)calloc(nconns + 1, sizeof(*conns));
+    g_buf = (char*)malloc(maxbytes);
+    if (!events || !conns || !g_buf) {
+        fprintf(stderr, "malloc: %s\n", strerror(errno));
+        return 1;
+    }
+    size_t nevents = 0;
+    for (size_t i = 0; i < nops; i++) {
+        if (ops[i].skip) {
+            skipped++;
+            continue;
+        }
+        events[nevents].at = ops[i].at;
+        events[nevents].op = i;
+        events[nevents++].feed = 0;
+        if (ops[i].kind == IOMP_TRACE_READ) {
+            events[nevents].at = ops[i].done;
+            events[nevents].op = i;
+            events[nevents++].feed = 1;
+        }
+    }
+    qsort(events, nevents, sizeof(*events), cmp_event);
+    g_conns = conns;
+    if (open_conns(conns, nconns, tcp) == -1) {
+        return 1;
+    }
+    g_iomp = nthreads > 0 ? iomp_new(nthreads) : iomp_new_polled();
+    if (!g_iomp) {
+        return 1;
+    }
+    for (int i = 0; i < nconns; i++) {
+        struct iomp_aio* aio = &conns[i].sink;
+        aio->fildes = conns[i].fd[1];
+        aio->buf = g_buf;
+        aio->nbytes = 0;
+        aio->complete = on_sink;
+        iomp_read(g_iomp, aio);
+    }
+    if (out) {
+        int rv = iomp_trace_open(out);
+        if (rv != 0) {
+            fprintf(stderr, "trace %s: %s\n", out, strerror(rv));
+            return 1;
+        }
+    }
+    long issued = 0;
+    uint64_t t0 = now_ns();
+    for (size_t i = 0; i < nevents; i++) {
+        struct event* ev = events + i;
+        struct op* op = ops + ev->op;
+        struct conn* c = conns + op->conn;
+        wait_until(t0 + (uint64_t)(ev->at / speed), nthreads == 0);
+        struct iomp_aio* aio = ev->feed ? &op->feed : &op->aio;
+        aio->fildes = c->fd[ev->feed];
+        aio->buf = g_buf;
+        aio->nbytes = op->nbytes;
+        aio->complete = ev->feed ? on_feed : on_done;
+        if (ev->feed) {
+            if (aio->nbytes == 0) {
+                aio->nbytes = 1;
+            }
+            iomp_write(g_iomp, aio);
+            continue;
+        }
+        issued++;
+        /* latencies count from when the aio was due */
+        op->start = now_ns();
+        if (op->kind == IOMP_TRACE_READ) {
+            read_next(c, op);
+        } else {
+            iomp_write(g_iomp, aio);
+        }
+    }
+    uint64_t deadline = now_ns() + REPLAY_GRACE_NS;
+    while (__atomic_load_n(&g_done, __ATOMIC_ACQUIRE) < issued &&
+            now_ns() < deadline) {
+        if (nthreads == 0) {
+            iomp_poll(g_iomp, 10);
+        } else {
+            usleep(1000);
+        }
+    }
+    uint64_t took = now_ns() - t0;
+    long done = __atomic_load_n(&g_done, __ATOMIC_ACQUIRE);
+    if (out) {
+        iomp_trace_close();
+    }
+    printf("%zu aios over %.3f s, %ld replayed in %.3f s, %zu skipped\n",
+            issued + skipped, span / 1e9, issued,
+            took / 1e9, skipped);
+    printf("%-6s %8s %9s %9s %9s | %8s %9s %9s %9s\n", "us", "traced",
+            "p50", "p99", "max", "replayed", "p50", "p99", "max");
+    report("read", ops, nops, IOMP_TRACE_READ);
+    report("write", ops, nops, IOMP_TRACE_WRITE);
+    printf("unfinished %ld, failed %ld\n", issued - done, (long)g_failed);
+    iomp_drop(g_iomp);
+    for (int i = 0; i < nconns; i++) {
+        close(conns[i].fd[0]);
+        close(conns[i].fd[1]);
+    }
+    free(conns);
+    free(events);
+    free(ops);
+    free(g_buf);
+    return done == issued && g_failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,208 @@
+/* Checks completion rings past their capacity: writes on a few sockets
+ * complete into a ring much smaller than the number in flight, first with
+ * nobody draining it until all are done, so most of them spill, then
+ * with a slow consumer taking them as they come. Every aio must come out
+ * exactly once, without error, those of one socket in the order they
+ * were written.
+ * Exits non zero on any mismatch.
+ * usage: ring [writes per socket] */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include "iomp.h"
+
+#define SOCKETS     4
+#define MSG         16
+#define BATCH       64
+
+struct conn {
+    int fds[2];
+    pthread_t peer;
+    size_t nbytes;
+    struct iomp_aio* aios;
+    /* the index of the next aio expected back */
+    int next;
+};
+
+static char g_msg[MSG];
+
+static void* drain(void* arg) {
+    struct conn* c = (struct conn*)arg;
+    char buf[4096];
+    size_t got = 0;
+    while (got < c->nbytes) {
+        ssize_t n = read(c->fds[1], buf, sizeof(buf));
+        if (n <= 0) {
+            break;
+        }
+        got += n;
+    }
+    return NULL;
+}
+
+static int conns_open(struct conn* cs, int nconns, int n, iomp_ring_t ring) {
+    for (int i = 0; i < nconns; i++) {
+        struct conn* c = cs + i;
+        if (socketpair(AF_LOCAL, SOCK_STREAM, 0, c->fds) != 0) {
+            perror("socketpair");
+            return -1;
+        }
+        fcntl(c->fds[0], F_SETFL, fcntl(c->fds[0], F_GETFL) | O_NONBLOCK);
+        c->nbytes = (size_t)n * MSG;
+        c->next = 0;
+        c->aios = (struct iomp_aio*)calloc(n, sizeof(*c->aios));
+        for (int j = 0; j < n; j++) {
+            c->aios[j].fildes = c->fds[0];
+            c->aios[j].buf = g_msg;
+            c->aios[j].nbytes = MSG;
+            c->aios[j].ring = ring;
+        }
+        pthread_create(&c->peer, NULL, drain, c);
+    }
+    return 0;
+}
+
+static void conns_join(struct conn* cs, int nconns) {
+    for (int i = 0; i < nconns; i++) {
+        pthread_join(cs[i].peer, NULL);
+    }
+}
+
+static void conns_close(iomp_t iomp, struct conn* cs, int nconns) {
+    for (int i = 0; i < nconns; i++) {
+        iomp_forget(iomp, cs[i].fds[0]);
+        close(cs[i].fds[0]);
+        close(cs[i].fds[1]);
+        free(cs[i].aios);
+    }
+}
+
+/* matches completions to their conn, returns the number of bad ones */
+static int check(struct conn* cs, int nconns, int n,
+        const struct iomp_completion* done, int ndone) {
+    int bad = 0;
+    for (int i = 0; i < ndone; i++) {
+        int found = 0;
+        for (int j = 0; j < nconns; j++) {
+            struct conn* c = cs + j;
+            if (done[i].aio < c->aios || done[i].aio >= c->aios + n) {
+                continue;
+            }
+            found = 1;
+            if (done[i].aio != c->aios + c->next || done[i].error != 0) {
+                bad++;
+            }
+            c->next++;
+        }
+        bad += !found;
+    }
+    return bad;
+}
+
+static void submit(iomp_t iomp, struct conn* cs, int nconns, int n) {
+    for (int j = 0; j < n; j++) {
+        for (int i = 0; i < nconns; i++) {
+            iomp_write(iomp, cs[i].aios + j);
+        }
+    }
+}
+
+/* everything completes before the first look, a 16 slot ring */
+static int spill(iomp_t iomp, int n) {
+    iomp_ring_t ring = iomp_ring_new(16);
+    struct conn cs[SOCKETS];
+    if (!ring || conns_open(cs, SOCKETS, n, ring) != 0) {
+        return 1;
+    }
+    submit(iomp, cs, SOCKETS, n);
+    conns_join(cs, SOCKETS);
+    struct iomp_completion done[BATCH];
+    int total = 0;
+    int bad = 0;
+    int got = 0;
+    while (total < SOCKETS * n &&
+            (got = iomp_get_completions(ring, done, BATCH, 1000)) > 0) {
+        bad += check(cs, SOCKETS, n, done, got);
+        total += got;
+    }
+    /* nothing more may come out */
+    bad += iomp_get_completions(ring, done, BATCH, 10) != 0;
+    printf("spill: %d of %d back, %d bad, %s\n", total, SOCKETS * n, bad,
+            bad || total != SOCKETS * n ? "FAIL" : "ok");
+    conns_close(iomp, cs, SOCKETS);
+    iomp_ring_drop(ring);
+    return bad || total != SOCKETS * n;
+}
+
+struct consumer {
+    iomp_ring_t ring;
+    struct conn* cs;
+    int n;
+    int total;
+    int bad;
+};
+
+static void* consume(void* arg) {
+    struct consumer* k = (struct consumer*)arg;
+    struct iomp_completion done[BATCH];
+    int got = 0;
+    while (k->total < SOCKETS * k->n &&
+            (got = iomp_get_completions(k->ring, done, BATCH, 1000)) > 0) {
+        k->bad += check(k->cs, SOCKETS, k->n, done, got);
+        k->total += got;
+        /* slow enough for the ring to fill up again meanwhile */
+        usleep(100);
+    }
+    return NULL;
+}
+
+/* drained while the writes complete, into an 8 slot ring, so the ring
+ * keeps filling up while older completions still sit in the spill list */
+static int concurrent(iomp_t iomp, int n) {
+    iomp_ring_t ring = iomp_ring_new(8);
+    struct conn cs[SOCKETS];
+    if (!ring || conns_open(cs, SOCKETS, n, ring) != 0) {
+        return 1;
+    }
+    struct consumer k = { ring, cs, n, 0, 0 };
+    pthread_t consumer;
+    pthread_create(&consumer, NULL, consume, &k);
+    submit(iomp, cs, SOCKETS, n);
+    pthread_join(consumer, NULL);
+    conns_join(cs, SOCKETS);
+    printf("concurrent: %d of %d back, %d bad, %s\n", k.total, SOCKETS * n,
+            k.bad, k.bad || k.total != SOCKETS * n ? "FAIL" : "ok");
+    conns_close(iomp, cs, SOCKETS);
+    iomp_ring_drop(ring);
+    return k.bad || k.total != SOCKETS * n;
+}
+
+int main(int argc, char* argv[]) {
+    int n = argc > 1 ? atoi(argv[1]) : 5000;
+    if (n <= 0) {
+        fprintf(stderr, "usage: %s [writes per socket]\n", argv[0]);
+        return 2;
+    }
+    int probe[2];
+    if (iomp_loopback_pair(probe, 0) == 0) {
+        iomp_loopback_close(probe[0]);
+        iomp_loopback_close(probe[1]);
+        fprintf(stderr, "the writes need kernel sockets, "
+                "build without IOMP_LOOPBACK\n");
+        return 1;
+    }
+    memset(g_msg, 'm', sizeof(g_msg));
+    iomp_t iomp = iomp_new(4);
+    if (!iomp) {
+        return 1;
+    }
+    int failed = spill(iomp, n);
+    failed |= concurrent(iomp, n);
+    iomp_drop(iomp);
+    return failed;
+}
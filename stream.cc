@@ -0,0 +1,216 @@
+/* Drives a Stream with a ring much smaller than what goes through it: a
+ * peer sends messages of every size up to most of the ring, each a 2
+ * byte big endian length and a payload made from its number, so reads
+ * keep wrapping around the end, with and without the mirrored mapping;
+ * each message must come out whole and in order, and be echoed back
+ * through the stream's writes. Then destroys streams with a read parked
+ * on a silent peer, which must return without calling the handler.
+ * Exits non zero on any mismatch; needs a build without IOMP_LOOPBACK.
+ * usage: stream [messages] */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <future>
+#include <chrono>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "iomp.h"
+
+static const size_t g_capacity = 4096;
+
+static std::string message(int n) {
+    size_t len = (n * 37) % (g_capacity - 2 - 100) + 1;
+    std::string msg(len + 2, '\0');
+    msg[0] = static_cast<char>(len >> 8);
+    msg[1] = static_cast<char>(len);
+    for (size_t i = 0; i < len; i++) {
+        msg[2 + i] = static_cast<char>(n + i);
+    }
+    return msg;
+}
+
+static bool write_full(int fd, const std::string& data) {
+    const char* p = data.data();
+    size_t nbytes = data.size();
+    while (nbytes > 0) {
+        ssize_t n = ::write(fd, p, nbytes);
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        nbytes -= n;
+    }
+    return true;
+}
+
+static bool read_full(int fd, std::string& data, size_t nbytes) {
+    data.resize(nbytes);
+    size_t got = 0;
+    while (got < nbytes) {
+        ssize_t n = ::read(fd, &data[got], nbytes - got);
+        if (n <= 0) {
+            return false;
+        }
+        got += n;
+    }
+    return true;
+}
+
+/* reads messages one after the other, echoing each payload back */
+class Echo {
+public:
+    Echo(iomp::IOMultiPlexer& iomp, int fd, int n, bool mirror):
+            _stream(iomp, fd, g_capacity, 1024, mirror), _n(n), _seen(0),
+            _bad(0) {}
+    void start() { this->next(); }
+    std::future<void> done() { return _done.get_future(); }
+    bool mirrored() const { return _stream.mirrored(); }
+    int seen() const { return _seen; }
+    int bad() const { return _bad; }
+private:
+    void next() {
+        if (_seen == _n) {
+            _stream.flush([this](int error) {
+                _bad += error != 0;
+                _done.set_value();
+            });
+            return;
+        }
+        _stream.read(2, [this](int error, const char* p) {
+            if (error != 0) {
+                _bad++;
+                _done.set_value();
+                return;
+            }
+            size_t len = (size_t)(unsigned char)p[0] << 8 |
+                    (unsigned char)p[1];
+            _stream.read(len, [this, len](int error, const char* p) {
+                if (error != 0) {
+                    _bad++;
+                    _done.set_value();
+                    return;
+                }
+                std::string want = message(_seen);
+                if (want.size() != len + 2 ||
+                        memcmp(want.data() + 2, p, len) != 0) {
+                    _bad++;
+                }
+                _stream.write(p, len);
+                _seen++;
+                this->next();
+            });
+        });
+    }
+private:
+    iomp::Stream _stream;
+    int _n;
+    int _seen;
+    int _bad;
+    std::promise<void> _done;
+};
+
+static int wraparound(iomp::IOMultiPlexer& iomp, int n, bool mirror) {
+    int sv[2];
+    if (socketpair(AF_LOCAL, SOCK_STREAM, 0, sv) != 0) {
+        perror("socketpair");
+        return 1;
+    }
+    fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+    std::atomic<int> echoed(0);
+    std::thread peer([&] {
+        std::thread sender([&] {
+            for (int i = 0; i < n; i++) {
+                if (!write_full(sv[1], message(i))) {
+                    break;
+                }
+            }
+        });
+        /* a payload that came back wrong is not counted, but read past,
+         * so the echoes never back up */
+        std::string got;
+        for (int i = 0; i < n; i++) {
+            std::string want = message(i);
+            if (!read_full(sv[1], got, want.size() - 2)) {
+                break;
+            }
+            echoed += got == want.substr(2);
+        }
+        sender.join();
+    });
+    int failed = 0;
+    {
+        Echo echo(iomp, sv[0], n, mirror);
+        auto done = echo.done();
+        echo.start();
+        if (done.wait_for(std::chrono::seconds(30)) !=
+                std::future_status::ready) {
+            /* fail whatever is stuck rather than wait for it */
+            shutdown(sv[1], SHUT_RDWR);
+            done.wait();
+        }
+        peer.join();
+        printf("wraparound%s: %d read, %d echoed, %d bad, %s\n",
+                echo.mirrored() ? " (mirrored)" : "", echo.seen(),
+                echoed.load(), echo.bad(),
+                echo.seen() != n || echoed != n || echo.bad() ? "FAIL" : "ok");
+        failed = echo.seen() != n || echoed != n || echo.bad() != 0;
+    }
+    iomp.forget(sv[0]);
+    close(sv[0]);
+    close(sv[1]);
+    return failed;
+}
+
+/* the destructor gets a parked read back by itself */
+static int parked(iomp::IOMultiPlexer& iomp, int n) {
+    std::atomic<int> called(0);
+    for (int i = 0; i < n; i++) {
+        int sv[2];
+        if (socketpair(AF_LOCAL, SOCK_STREAM, 0, sv) != 0) {
+            perror("socketpair");
+            return 1;
+        }
+        fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+        {
+            iomp::Stream stream(iomp, sv[0], g_capacity);
+            stream.read(8, [&called](int, const char*) { called++; });
+            if (i % 2) {
+                usleep(100);
+            }
+        }
+        iomp.forget(sv[0]);
+        close(sv[0]);
+        close(sv[1]);
+    }
+    printf("parked read: %d streams gone, %d handlers called, %s\n", n,
+            called.load(), called ? "FAIL" : "ok");
+    return called != 0;
+}
+
+int main(int argc, char* argv[]) {
+    int n = argc > 1 ? atoi(argv[1]) : 20000;
+    if (n <= 0) {
+        fprintf(stderr, "usage: %s [messages]\n", argv[0]);
+        return 2;
+    }
+    int probe[2];
+    if (iomp_loopback_pair(probe, 0) == 0) {
+        iomp_loopback_close(probe[0]);
+        iomp_loopback_close(probe[1]);
+        fprintf(stderr, "a stream needs kernel sockets, "
+                "build without IOMP_LOOPBACK\n");
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    iomp::IOMultiPlexer iomp(4);
+    int failed = wraparound(iomp, n, false);
+    failed |= wraparound(iomp, n, true);
+    failed |= parked(iomp, 1000);
+    return failed;
+}
@@ -36,6 +36,7 @@ public:
             if (error != -1) {
                 IOMP_LOG(ERROR, "read fail: %s", strerror(error));
             }
+            _iomp.forget(this->fildes);
             close(this->fildes);
             _promise.set_value();
             delete this;
@@ -66,6 +67,7 @@ public:
                 IOMP_LOG(ERROR, "write fail: %s",
                     error == -1 ? "eof" : strerror(error));
             }
+            _iomp.forget(this->fildes);
             close(this->fildes);
             _promise.set_value();
             delete this;
@@ -80,21 +82,22 @@ private:
     std::promise<void> _promise;
 };
 
-class Acceptor : public ::iomp::AsyncIO {
+class Acceptor : public ::iomp_acceptor {
 public:
     Acceptor(const char* host, const char* port, ::iomp::IOMultiPlexer& iomp) noexcept:
-            ::iomp::AsyncIO(-1, nullptr, 0),
-            _iomp(iomp) {
+            ::iomp_acceptor(), _iomp(iomp) {
+        aio.fildes = -1;
+        aio.complete = &Acceptor::accepted;
         struct addrinfo hint = {
             0, AF_INET, SOCK_STREAM, 0, 0, NULL, NULL, NULL,
         };
         struct addrinfo* ai = nullptr;
         getaddrinfo(host, port, &hint, &ai);
-        fildes = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
-        bind(fildes, ai->ai_addr, ai->ai_addrlen);
+        aio.fildes = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        bind(aio.fildes, ai->ai_addr, ai->ai_addrlen);
         freeaddrinfo(ai);
-        listen(fildes, 1024);
-        fcntl(fildes, F_SETFL, fcntl(fildes, F_GETFL, 0) | O_NONBLOCK);
+        ::listen(aio.fildes, 1024);
+        fcntl(aio.fildes, F_SETFL, fcntl(aio.fildes, F_GETFL, 0) | O_NONBLOCK);
     }
     inline ~Acceptor() noexcept {
         this->close();
@@ -103,55 +106,42 @@ public:
         }
     }
 public:
-    inline operator int() noexcept { return fildes; }
+    inline operator int() noexcept { return aio.fildes; }
     inline void close() noexcept {
-        if (fildes != -1) {
-            ::close(fildes);
-            fildes = -1;
+        if (aio.fildes != -1) {
+            _iomp.forget(aio.fildes);
+            ::close(aio.fildes);
+            aio.fildes = -1;
         }
     }
-public:
-    virtual void complete(int error) noexcept {
+private:
+    static void accepted(::iomp_aio_t aio, int error) noexcept {
+        auto self = static_cast<Acceptor*>(
+                reinterpret_cast<::iomp_acceptor*>(aio));
+        self->complete(error);
+    }
+    void complete(int error) noexcept {
         if (error != 0) {
-            IOMP_LOG(ERROR, "add accept event fail: %s", strerror(error));
+            IOMP_LOG(WARNING, "accept fail: %s", strerror(error));
             this->close();
             return;
         }
-        if (!_lock.try_lock()) {
-            return;
-        }
-        while (1) {
-            int remote = accept(fildes, nullptr, nullptr);
-            if (remote == -1) {
-                if (errno == EAGAIN) {
-                    break;
-                } else if (errno == ECONNABORTED) {
-                    continue;
-                } else {
-                    IOMP_LOG(WARNING, "accept fail: %s", strerror(errno));
-                    this->close();
-                    break;
-                }
-            } else {
-                IOMP_LOG(DEBUG, "accept %d", remote);
-                ::close(remote);
-                int sv[2] = { -1, -1 };
-                socketpair(AF_LOCAL, SOCK_STREAM, 0, sv);
-                fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL, 0) | O_NONBLOCK);
-                fcntl(sv[1], F_SETFL, fcntl(sv[1], F_GETFL, 0) | O_NONBLOCK);
-                auto r = new Reader(sv[0], _iomp);
-                _waits.push_back(r->get_future());
-                _iomp.read(r);
-                auto w = new Writer(sv[1], _iomp);
-                _waits.push_back(w->get_future());
-                _iomp.write(w);
-            }
-        }
-        _lock.unlock();
+        /* one connection per call, never two calls at once */
+        IOMP_LOG(DEBUG, "accept %d", fd);
+        ::close(fd);
+        int sv[2] = { -1, -1 };
+        socketpair(AF_LOCAL, SOCK_STREAM, 0, sv);
+        fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL, 0) | O_NONBLOCK);
+        fcntl(sv[1], F_SETFL, fcntl(sv[1], F_GETFL, 0) | O_NONBLOCK);
+        auto r = new Reader(sv[0], _iomp);
+        _waits.push_back(r->get_future());
+        _iomp.read(r);
+        auto w = new Writer(sv[1], _iomp);
+        _waits.push_back(w->get_future());
+        _iomp.write(w);
     }
 private:
     ::iomp::IOMultiPlexer& _iomp;
-    std::mutex _lock;
     std::vector<std::future<void>> _waits;
 };
 
@@ -163,7 +153,7 @@ int main(int argc, char* argv[]) {
     ::iomp_loglevel(IOMP_LOGLEVEL_DEBUG);
     ::iomp::IOMultiPlexer iomp;
     Acceptor accp { "127.0.0.1", "8643", iomp };
-    ::iomp_accept(iomp, &accp);
+    iomp.accept_multishot(accp);
 #if 0
     std::vector<std::future<void>> waits;
     for (int i = 0; i < 10; i++) {
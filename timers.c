@@ -0,0 +1,144 @@
+/* Checks iomp_schedule: tasks with spread out delays, scheduled in a
+ * shuffled order, must each run once, no earlier than their delay and
+ * not much later, in the order of their deadlines on a single worker;
+ * the same in polled mode, where they run inside iomp_poll. Tasks still
+ * waiting when iomp is dropped must get -1, once each.
+ * Exits non zero on any mismatch.
+ * usage: timers [tasks] */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "iomp.h"
+
+/* how late a task may run, generous for loaded boxes */
+#define LATE_MS     50
+
+struct task {
+    int delay_ms;
+    double start;
+    double ran;
+    int error;
+    int calls;
+};
+
+static struct task** order = NULL;
+static volatile int norder = 0;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void on_timer(void* arg, int error) {
+    struct task* t = (struct task*)arg;
+    t->ran = now();
+    t->error = error;
+    t->calls++;
+    /* one worker or the polling thread, never two at once */
+    order[norder] = t;
+    __atomic_add_fetch(&norder, 1, __ATOMIC_RELEASE);
+}
+
+static void schedule_all(iomp_t iomp, struct task* ts, int n, int base_ms) {
+    norder = 0;
+    for (int i = 0; i < n; i++) {
+        /* 0, 1, ... spread out, scheduled in a shuffled order */
+        struct task* t = ts + (i * 7919L) % n;
+        memset(t, 0, sizeof(*t));
+        t->delay_ms = base_ms + (int)(t - ts) * 2;
+        t->start = now();
+        iomp_schedule(iomp, t->delay_ms, on_timer, t);
+    }
+}
+
+static int check(const char* name, struct task* ts, int n) {
+    int early = 0;
+    int late = 0;
+    int bad = 0;
+    for (int i = 0; i < n; i++) {
+        struct task* t = ts + i;
+        double ms = (t->ran - t->start) * 1e3;
+        early += ms < t->delay_ms;
+        late += ms > t->delay_ms + LATE_MS;
+        bad += t->calls != 1 || t->error != 0;
+    }
+    int swapped = 0;
+    for (int i = 1; i < norder; i++) {
+        swapped += order[i]->delay_ms < order[i - 1]->delay_ms;
+    }
+    int failed = early || late || bad || swapped || norder != n;
+    printf("%s: %d tasks, %d early, %d late, %d out of order, "
+            "%d bad, %s\n", name, n, early, late, swapped, bad,
+            failed ? "FAIL" : "ok");
+    return failed;
+}
+
+static int threaded(struct task* ts, int n) {
+    iomp_t iomp = iomp_new(1);
+    if (!iomp) {
+        return 1;
+    }
+    schedule_all(iomp, ts, n, 0);
+    int waited = 0;
+    while (__atomic_load_n(&norder, __ATOMIC_ACQUIRE) < n &&
+            waited++ < 10000) {
+        usleep(1000);
+    }
+    int failed = check("threaded", ts, n);
+    iomp_drop(iomp);
+    return failed;
+}
+
+static int polled(struct task* ts, int n) {
+    iomp_t iomp = iomp_new_polled();
+    if (!iomp) {
+        return 1;
+    }
+    schedule_all(iomp, ts, n, 0);
+    double stop = now() + 10;
+    while (norder < n && now() < stop) {
+        iomp_poll(iomp, 100);
+    }
+    int failed = check("polled", ts, n);
+    iomp_drop(iomp);
+    return failed;
+}
+
+/* far off tasks, canceled by iomp_drop */
+static int dropped(struct task* ts, int n) {
+    iomp_t iomp = iomp_new(2);
+    if (!iomp) {
+        return 1;
+    }
+    schedule_all(iomp, ts, n, 60000);
+    iomp_drop(iomp);
+    int bad = 0;
+    for (int i = 0; i < n; i++) {
+        bad += ts[i].calls != 1 || ts[i].error != -1;
+    }
+    printf("dropped: %d tasks, %d bad, %s\n", n, bad, bad ? "FAIL" : "ok");
+    return bad != 0;
+}
+
+int main(int argc, char* argv[]) {
+    int n = argc > 1 ? atoi(argv[1]) : 200;
+    if (n <= 0 || n > 5000) {
+        fprintf(stderr, "usage: %s [tasks, up to 5000]\n", argv[0]);
+        return 2;
+    }
+    struct task* ts = (struct task*)calloc(n, sizeof(*ts));
+    order = (struct task**)calloc(n, sizeof(*order));
+    if (!ts || !order) {
+        perror("calloc");
+        return 1;
+    }
+    int failed = threaded(ts, n);
+    failed |= polled(ts, n);
+    failed |= dropped(ts, n);
+    free(order);
+    free(ts);
+    return failed;
+}